@@ -0,0 +1,62 @@
+#!/bin/bash
+#
+# Measure the terminal output of camera-ctl per keypress through a pseudo
+# terminal, with the normal and the low bandwidth (-b) screen updates.
+#
+# usage: bench-bandwidth.sh [camera-ctl options]
+#
+# camera-ctl runs under script(1) in an 80x24 terminal. Every run starts,
+# waits and quits; the keyed run sends a fixed key sequence in between.
+# Bytes per key are the difference of both runs divided by the number of
+# keys, so the startup screen is not counted.
+
+CAMERA_CTL=${CAMERA_CTL:-./camera-ctl}
+RATE=${RATE:-11520}
+DELAY=${DELAY:-0.2}
+
+TERM=${TERM:-xterm}
+export TERM
+
+# cursor keys as sent in keypad mode
+DOWN=$(tput kcud1)
+UP=$(tput kcuu1)
+RIGHT=$(tput kcuf1)
+LEFT=$(tput kcub1)
+
+# navigation, value changes and a tab switch
+KEYS="$DOWN $DOWN $DOWN $RIGHT $RIGHT $LEFT $UP $DOWN $RIGHT $LEFT ] [ $DOWN $UP"
+KEY_COUNT=14
+
+run()
+{
+    keys=$1
+    shift
+    # script -c takes one shell command line, every argument is quoted into it
+    command=$(printf '%q ' "$CAMERA_CTL" "$@")
+    {
+        sleep 1
+        for key in $keys
+        do
+            printf '%s' "$key"
+            sleep "$DELAY"
+        done
+        sleep 1
+        printf q
+        sleep 1
+    } | script -q -e -c "stty rows 24 cols 80; $command" /dev/null | wc -c
+}
+
+measure()
+{
+    label=$1
+    shift
+    idle=$(run "" "$@")
+    keyed=$(run "$KEYS" "$@")
+    printf '%-12s startup %6d bytes  %6d bytes per key\n' "$label" "$idle" $(((keyed - idle) / KEY_COUNT))
+}
+
+# the key sequence contains [ and ]
+set -f
+
+measure "normal" "$@"
+measure "-b $RATE" -b "$RATE" "$@"
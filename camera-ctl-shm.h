@@ -0,0 +1,137 @@
+/*
+ * camera-ctl / shared memory control state
+ *
+ * Layout of the segment published with "camera-ctl -s name" and inline
+ * helpers for reader processes. Readers map the segment read only and
+ * take consistent copies of control values without system calls.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef CAMERA_CTL_SHM_H
+#define CAMERA_CTL_SHM_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define CAMERA_CTL_SHM_MAGIC 0x48534343 /* "CCSH" */
+#define CAMERA_CTL_SHM_VERSION 1
+#define CAMERA_CTL_SHM_CONTROLS 256
+#define CAMERA_CTL_SHM_NAME_MAX 32
+
+/*
+ * sequence is odd while camera-ctl writes, generation counts published
+ * changes. Values are stored the way config files store them, ids of
+ * stream parameters are the small ids used in journal files.
+ */
+struct camera_ctl_shm
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sequence;
+    uint32_t count;
+    uint64_t generation;
+    int32_t values[CAMERA_CTL_SHM_CONTROLS];
+    uint32_t ids[CAMERA_CTL_SHM_CONTROLS];
+    char names[CAMERA_CTL_SHM_CONTROLS][CAMERA_CTL_SHM_NAME_MAX];
+};
+
+/* name as given to camera-ctl -s, without the leading slash */
+static inline const struct camera_ctl_shm *camera_ctl_shm_open(const char *name)
+{
+    const struct camera_ctl_shm *shm;
+    char path[CAMERA_CTL_SHM_NAME_MAX + 2];
+    int fd;
+
+    path[0] = '/';
+    strncpy(path + 1, name, sizeof(path) - 2);
+    path[sizeof(path) - 1] = '\0';
+
+    fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    shm = (const struct camera_ctl_shm *)mmap(NULL, sizeof(struct camera_ctl_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (shm->magic != CAMERA_CTL_SHM_MAGIC || shm->version != CAMERA_CTL_SHM_VERSION)
+    {
+        munmap((void *)shm, sizeof(struct camera_ctl_shm));
+        return NULL;
+    }
+    return shm;
+}
+
+static inline void camera_ctl_shm_close(const struct camera_ctl_shm *shm)
+{
+    munmap((void *)shm, sizeof(struct camera_ctl_shm));
+}
+
+/* index of a control by config file name, -1 if not published (yet) */
+static inline int camera_ctl_shm_find(const struct camera_ctl_shm *shm, const char *name)
+{
+    uint32_t count = __atomic_load_n(&shm->count, __ATOMIC_ACQUIRE);
+    uint32_t i;
+
+    for (i = 0; i < count && i < CAMERA_CTL_SHM_CONTROLS; i++)
+    {
+        if (!strncmp(shm->names[i], name, CAMERA_CTL_SHM_NAME_MAX))
+        {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Copy the values of count controls selected by index into values, all of
+ * them from the same generation. Returns that generation, readers can skip
+ * work when it did not change since the last call. Returns 0 without
+ * reading when an index is out of range, -1 from camera_ctl_shm_find()
+ * included; a published control always has a generation of 1 or more.
+ */
+static inline uint64_t camera_ctl_shm_read(const struct camera_ctl_shm *shm, const int *index, int count, int32_t *values)
+{
+    uint64_t generation;
+    uint32_t sequence;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (index[i] < 0 || index[i] >= CAMERA_CTL_SHM_CONTROLS)
+        {
+            return 0;
+        }
+    }
+
+    for (;;)
+    {
+        sequence = __atomic_load_n(&shm->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1)
+        {
+            continue;
+        }
+        for (i = 0; i < count; i++)
+        {
+            values[i] = __atomic_load_n(&shm->values[index[i]], __ATOMIC_RELAXED);
+        }
+        generation = __atomic_load_n(&shm->generation, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->sequence, __ATOMIC_RELAXED) == sequence)
+        {
+            return generation;
+        }
+    }
+}
+
+#endif /* CAMERA_CTL_SHM_H */
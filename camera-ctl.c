@@ -24,22 +24,66 @@
  */
 
 #include <ctype.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <ftw.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/timerfd.h>
+#include <linux/media.h>
 #include <linux/videodev2.h>
 #include <ncurses.h>
 
+#include "camera-ctl-shm.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define DEBUG false
 
+/*
+ * Static tracepoints, camera-ctl-trace.bt prints their latencies. Without
+ * <sys/sdt.h> (systemtap-sdt-dev) the probes compile to nothing.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define TRACE1(name, a) DTRACE_PROBE1(camera_ctl, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(camera_ctl, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(camera_ctl, name, a, b, c)
+#else
+#define TRACE1(name, a) ((void)(a))
+#define TRACE2(name, a, b) ((void)(a), (void)(b))
+#define TRACE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
+
 #define pixfmtstr(x) (x) & 0xff, ((x) >> 8) & 0xff, ((x) >> 16) & 0xff, ((x) >> 24) & 0xff
 
 #define clamp(val, min, max)                   \
@@ -66,10 +110,20 @@ enum control_entry_type
     V4L2_PARAM,
 };
 
+/* ids of stream parameters, below the range of V4L2 control ids */
+enum control_param_id
+{
+    PARAM_FPS = 1,
+    PARAM_PIXEL_FORMAT,
+    PARAM_RESOLUTION,
+};
+
 struct control_mapping
 {
     int entry_type;
     unsigned int id;
+    unsigned int ctrl_class;
+    int source;
     char *name;
     char *var_name;
     unsigned int control_type;
@@ -78,10 +132,107 @@ struct control_mapping
     int maximum;
     int step;
     int default_value;
+    unsigned int flags;
     bool hasoptions;
+    bool unsupported;
+    bool has_events;
+    bool polled;
+    const char *unit;
     struct control_option *options;
 } control_mapping;
 
+/* codecs a control applies to, controls without codec bits apply to all formats */
+enum control_codec
+{
+    CODEC_H264 = 1 << 0,
+    CODEC_H263 = 1 << 1,
+    CODEC_MPEG2 = 1 << 2,
+    CODEC_MPEG4 = 1 << 3,
+    CODEC_HEVC = 1 << 4,
+    CODEC_VP8 = 1 << 5,
+    CODEC_VP9 = 1 << 6,
+    CODEC_FWHT = 1 << 7,
+};
+
+struct control_info
+{
+    unsigned int id;
+    const char *var_name;
+    unsigned int codecs;
+    const char *unit;
+};
+
+#include "camera-ctl-controls.h"
+
+#define CONTROL_INFO_COUNT (sizeof(control_table) / sizeof(control_table[0]))
+#define CONTROL_INFO_SLOTS 2048
+
+_Static_assert(CONTROL_INFO_COUNT * 2 <= CONTROL_INFO_SLOTS, "control info index too small");
+
+static const struct
+{
+    unsigned int pixelformat;
+    unsigned int codecs;
+} codec_formats[] = {
+    {V4L2_PIX_FMT_H264, CODEC_H264},
+    {V4L2_PIX_FMT_H264_NO_SC, CODEC_H264},
+    {V4L2_PIX_FMT_H264_MVC, CODEC_H264},
+    {V4L2_PIX_FMT_H263, CODEC_H263},
+    {V4L2_PIX_FMT_MPEG2, CODEC_MPEG2},
+    {V4L2_PIX_FMT_MPEG4, CODEC_MPEG4},
+    {V4L2_PIX_FMT_VP8, CODEC_VP8},
+#ifdef V4L2_PIX_FMT_VP9
+    {V4L2_PIX_FMT_VP9, CODEC_VP9},
+#endif
+#ifdef V4L2_PIX_FMT_HEVC
+    {V4L2_PIX_FMT_HEVC, CODEC_HEVC},
+#endif
+#ifdef V4L2_PIX_FMT_FWHT
+    {V4L2_PIX_FMT_FWHT, CODEC_FWHT},
+#endif
+};
+
+#define CTRL_CLASSES_MAX 32
+
+struct control_class
+{
+    unsigned int id;
+    int source;
+    char *name;
+    bool enumerated;
+    unsigned int next_id; /* enumeration resumes after this control */
+    int cursor;
+};
+
+struct auto_pair
+{
+    unsigned int master;
+    unsigned int dependent;
+};
+
+/* automatic modes and the manual controls they drive */
+static const struct auto_pair auto_pairs[] = {
+    {V4L2_CID_EXPOSURE_AUTO, V4L2_CID_EXPOSURE_ABSOLUTE},
+    {V4L2_CID_EXPOSURE_AUTO, V4L2_CID_EXPOSURE},
+    {V4L2_CID_AUTOGAIN, V4L2_CID_GAIN},
+    {V4L2_CID_AUTO_WHITE_BALANCE, V4L2_CID_WHITE_BALANCE_TEMPERATURE},
+    {V4L2_CID_AUTO_WHITE_BALANCE, V4L2_CID_RED_BALANCE},
+    {V4L2_CID_AUTO_WHITE_BALANCE, V4L2_CID_BLUE_BALANCE},
+    {V4L2_CID_FOCUS_AUTO, V4L2_CID_FOCUS_ABSOLUTE},
+    {V4L2_CID_HUE_AUTO, V4L2_CID_HUE},
+    {V4L2_CID_AUTOBRIGHTNESS, V4L2_CID_BRIGHTNESS},
+    {V4L2_CID_ISO_SENSITIVITY_AUTO, V4L2_CID_ISO_SENSITIVITY},
+};
+
+#define DEPEND_PAIRS_MAX 16
+#define PLAN_EDGES_MAX 64
+
+/* -D master:dependent pairs of driver specific controls, resolved after enumeration */
+static char *depend_args[DEPEND_PAIRS_MAX];
+static int depend_arg_count = 0;
+static struct auto_pair depend_pairs[DEPEND_PAIRS_MAX];
+static int depend_count = 0;
+
 const char *ignored_variables[50];
 int last_ignored_variable = 0;
 
@@ -97,11 +248,433 @@ static unsigned int v4l2_dev_width;
 static unsigned int v4l2_dev_height;
 static int last_offset = 0;
 static int ctrl_last = 0;
+static int ctrl_size = 0;
+static int *ctrl_view = NULL;
+static int view_last = 0;
+static int *var_index = NULL;
+static unsigned int var_index_size = 0;
+static int var_index_count = 0;
+
+#define SEARCH_QUERY_MAX 32
+
+/* trigram of the lower case names with the controls containing it */
+struct search_gram
+{
+    uint32_t key;
+    int start;
+    int count;
+};
+
+static char search_query[SEARCH_QUERY_MAX + 1];
+static int search_len = 0;
+static bool search_typing = false;
+static long search_us = 0;
+static char **search_texts = NULL;
+static struct search_gram *search_grams = NULL;
+static int *search_postings = NULL;
+static int *search_slots = NULL;
+static unsigned int search_slot_count = 0;
+static int search_count = 0;
+static uint64_t *search_match = NULL;
+static uint64_t *search_candidates = NULL;
+static short control_info_ids[CONTROL_INFO_SLOTS];
+static short control_info_names[CONTROL_INFO_SLOTS];
+static bool control_info_ready = false;
 static int v4l2_dev_fd;
 static bool ui_initialized = false;
 static int active_control = 0;
+static bool layout_changed = false;
+static struct control_class ctrl_classes[CTRL_CLASSES_MAX];
+static int class_count = 0;
+static int active_class = 0;
+
+#define STARTUP_SLICE_US 20000
+#define STARTUP_WAIT_MS 10
+
+/* work left after the first paint, done between keys */
+enum startup_stage
+{
+    STARTUP_CONTROLS,
+    STARTUP_STREAM,
+    STARTUP_MEDIA,
+    STARTUP_DEPEND,
+    STARTUP_DONE,
+};
+
+static enum startup_stage startup_stage = STARTUP_CONTROLS;
+static uint64_t startup_begin_us = 0;
+static uint64_t startup_paint_us = 0;
+static uint64_t startup_done_us = 0;
+
+#define POLL_MIN_MS 100
+#define POLL_MAX_MS 2000
+
+static bool poll_enabled = false;
+static bool events_subscribed = false;
+static int poll_interval_ms = POLL_MIN_MS;
+static uint64_t poll_next_us = 0;
+static uint64_t poll_started_us = 0;
+static uint64_t poll_busy_us = 0;
+static unsigned int poll_count = 0;
+static long poll_last_us = 0;
+static int poll_ctrl_count = 0;
+
+static int bandwidth_rate = 0;
+static long bandwidth_tokens = 0;
+static uint64_t bandwidth_us = 0;
+static int bandwidth_io_fd = -1;
+static bool ui_pending = false;
+static WINDOW *input_pad = NULL;
+static unsigned long long ui_bytes = 0;
+static unsigned long long ui_keys = 0;
+
+#define CONFIG_NAME_MAX 64
+
+typedef void (*config_handler)(const char *name, size_t length, int value, void *data);
+
+struct config_result
+{
+    int lines;
+    int entries;
+    int errors;
+    int error_line;
+    const char *error;
+};
+
+/* config line resolved while the file is parsed, index into ctrl_mapping */
+struct config_entry
+{
+    int index;
+    int value;
+};
+
+static struct config_entry *config_entries = NULL;
+static int config_entry_count = 0;
+static int config_entry_size = 0;
+
+#define JOURNAL_MAGIC "CCJ1"
+#define JOURNAL_SIZE 4096 /* power of two */
+#define JOURNAL_FLUSH_MS 200
+#define JOURNAL_BATCH_MAX 64
+#define JOURNAL_WINDOW_US 10000
+
+enum journal_source
+{
+    JOURNAL_SESSION,
+    JOURNAL_KEY,
+    JOURNAL_PRESET,
+    JOURNAL_RESET,
+    JOURNAL_CONFIG,
+    JOURNAL_SNAPSHOT,
+    JOURNAL_DEVICE,
+};
+
+struct journal_header
+{
+    char magic[4];
+    uint32_t entry_size;
+};
+
+/* one control change, written to the log file as is */
+struct journal_entry
+{
+    uint64_t timestamp_us;
+    uint32_t id;
+    int32_t old_value;
+    int32_t new_value;
+    uint8_t source;
+    uint8_t reserved[3];
+};
+
+struct journal_batch
+{
+    struct v4l2_ext_control items[JOURNAL_BATCH_MAX];
+    struct control_mapping *targets[JOURNAL_BATCH_MAX];
+    int count;
+    int writes;
+    int failed;
+};
+
+/* single producer (key loop), single consumer (writer thread) */
+static struct journal_entry journal_ring[JOURNAL_SIZE];
+static atomic_uint journal_head = 0;
+static atomic_uint journal_tail = 0;
+static atomic_bool journal_stop = false;
+static unsigned int journal_dropped = 0;
+static unsigned int journal_lost = 0;
+static pthread_t journal_thread;
+static int journal_fd = -1;
+static char *journal_file = NULL;
+static char *journal_replay_file = NULL;
+static bool journal_fast = false;
+
+#define FIXTURE_MAGIC "CCX1"
+#define FIXTURE_FDS 1024
+#define FIXTURE_NODES_MAX 64
+#define FIXTURE_SPANS 5
+#define FIXTURE_LEVELS 3
+#define FIXTURE_ITEMS_MAX 4096 /* items of one array span, larger calls are not recorded */
+
+/* argument memory of the largest record: an ioctl argument and the topology arrays */
+#define FIXTURE_SIZE_MAX                                                                                     \
+    (_IOC_SIZEMASK + FIXTURE_ITEMS_MAX * (sizeof(struct media_v2_entity) + sizeof(struct media_v2_interface) + \
+                                          sizeof(struct media_v2_pad) + sizeof(struct media_v2_link)))
+
+enum fixture_type
+{
+    FIXTURE_NODE = 1,
+    FIXTURE_IOCTL,
+};
+
+/*
+ * One item of a fixture file, followed by size bytes: the path of a node,
+ * or the argument memory of an ioctl before and after the call.
+ */
+struct fixture_record
+{
+    uint32_t type;
+    uint32_t node;
+    uint32_t request;
+    int32_t result;
+    int32_t error;
+    uint32_t size;
+    uint64_t latency_ns;
+};
+
+/* argument of an ioctl or an array it points to */
+struct fixture_span
+{
+    void *data;
+    size_t size;
+};
+
+/* recorded call, chained to the next call with the same key on every level */
+struct fixture_call
+{
+    struct fixture_record record;
+    unsigned char *in;
+    unsigned char *out;
+    int next[FIXTURE_LEVELS];
+};
+
+/* calls with the same key, served in recorded order, the last one repeats */
+struct fixture_key
+{
+    uint64_t hash;
+    int level;
+    int first;
+    int last;
+    int cursor;
+};
+
+static char *fixture_record_file = NULL;
+static char *fixture_replay_file = NULL;
+static bool fixture_timed = false;
+static FILE *fixture_fp = NULL;
+static pthread_mutex_t fixture_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fixture_fd_nodes[FIXTURE_FDS];
+static char *fixture_nodes[FIXTURE_NODES_MAX];
+static int fixture_node_count = 0;
+static struct fixture_call *fixture_calls = NULL;
+static int fixture_call_count = 0;
+static struct fixture_key *fixture_keys = NULL;
+static unsigned int fixture_key_slots = 0;
+static unsigned long fixture_count = 0;
+static unsigned long fixture_missed = 0;
+
+#define SNAPSHOT_BLOCK 16
+#define UNDO_DEPTH 64
+
+/* blocks of control values shared between snapshots until they differ */
+struct value_block
+{
+    int refs;
+    int values[SNAPSHOT_BLOCK];
+};
+
+struct snapshot
+{
+    int count;
+    int block_count;
+    struct value_block **blocks;
+};
+
+static struct snapshot *undo_stack[UNDO_DEPTH];
+static int undo_count = 0;
+static struct snapshot *redo_stack[UNDO_DEPTH];
+static int redo_count = 0;
+static bool undo_step_open = false;
+/* index of the control of the last key step, the mapping moves when it grows */
+static int undo_last_key = -1;
+static struct snapshot *snapshot_ab[2] = {NULL, NULL};
+static int snapshot_ab_active = -1;
 static int fps_max = 30;
 
+#define DEVICE_CHECK_MS 250
+#define DEVICE_SCAN_MS 50
+#define DEVICE_RESCAN_MS 1000
+
+static char v4l2_bus_info[32];
+static char v4l2_card[32];
+static char device_path[512];
+static char device_dir[256];
+static char device_prefix[64];
+static bool device_lost = false;
+static bool device_capture = false;
+static uint64_t device_check_us = 0;
+static uint64_t device_lost_us = 0;
+static uint64_t device_seen_us = 0;
+static uint64_t device_scan_us = 0;
+static int device_watch_fd = -1;
+
+static struct camera_ctl_shm *shm_state = NULL;
+static char *shm_name = NULL;
+static char shm_path[CAMERA_CTL_SHM_NAME_MAX + 2];
+
+#define LOOP_EVENTS_MAX 8
+
+static int loop_epoll_fd = -1;
+static int loop_signal_fd = -1;
+static int loop_timer_fd = -1;
+static int loop_device_fd = -1;
+static uint32_t loop_device_mask = 0;
+static bool loop_device_hangup = false;
+static bool loop_device_timed = false;
+static int loop_watch_fd = -1;
+static bool loop_resize = false;
+
+#define SCAN_NODES_MAX 64
+
+struct scan_node
+{
+    char path[512];
+    pthread_t thread;
+};
+
+static bool scan_enabled = false;
+
+#define SYNC_DEVICES_MAX 8
+
+/* control of an additional camera, named the way config files name it */
+struct sync_control
+{
+    unsigned int id;
+    char *var_name;
+    const char *alias;
+};
+
+/* one camera of a synchronised apply, slot 0 is the device of the UI */
+struct sync_device
+{
+    const char *devname;
+    int fd;
+    int control_count;
+    struct sync_control *controls;
+    struct v4l2_ext_control *items;
+    int count;
+    int failed;
+    uint64_t release_us;
+    uint64_t done_us;
+    pthread_t thread;
+};
+
+/* preset line kept for the -m devices, their names resolve against their own controls */
+struct sync_entry
+{
+    char name[CONFIG_NAME_MAX + 1];
+    int value;
+};
+
+static struct sync_device sync_devices[SYNC_DEVICES_MAX + 1];
+static int sync_count = 0;
+static struct sync_entry *sync_entries = NULL;
+static int sync_entry_count = 0;
+static int sync_entry_size = 0;
+static pthread_barrier_t sync_start;
+static pthread_barrier_t sync_release;
+static pthread_barrier_t sync_done;
+static atomic_bool sync_quit = false;
+static bool sync_threads = false;
+
+#define MEDIA_SOURCES_MAX 8
+#define MEDIA_ENTITIES_MAX 64
+#define MEDIA_LINKS_MAX 128
+
+/* entity of a media graph, devnode is empty for entities without a V4L2 node */
+struct media_entity
+{
+    unsigned int id;
+    char name[64];
+    char devnode[256];
+    bool subdev;
+};
+
+/* data links are undirected here, only the connected part of the graph matters */
+struct media_graph
+{
+    struct media_entity entities[MEDIA_ENTITIES_MAX];
+    int entity_count;
+    unsigned int links[MEDIA_LINKS_MAX][2];
+    int link_count;
+    int video;
+    char media[288];
+};
+
+/* control of a sub-device, read by the enumeration thread of its node */
+struct media_control
+{
+    struct v4l2_queryctrl query;
+    int value;
+};
+
+/* node of the pipeline of the video device, slot 0 is the video device itself */
+struct media_source
+{
+    char name[32];
+    char path[256];
+    int fd;
+    struct media_control *controls;
+    int control_count;
+    uint64_t enum_us;
+    pthread_t thread;
+    bool threaded;
+    bool finished;
+};
+
+static struct media_source media_sources[MEDIA_SOURCES_MAX + 1];
+static int media_count = 0;
+static char *media_topology_file = NULL;
+static char media_device[288];
+static bool media_watched = false;
+
+#define FPS_INTERVALS_MAX 64
+
+struct frame_size
+{
+    unsigned int width;
+    unsigned int height;
+    int interval_count;
+    struct v4l2_fract *intervals;
+};
+
+struct pixel_format
+{
+    unsigned int pixelformat;
+    int size_count;
+    struct frame_size *sizes;
+};
+
+static struct pixel_format *formats = NULL;
+static int format_count = 0;
+
+static const unsigned int frame_standard_sizes[][2] = {
+    {160, 120}, {320, 240}, {640, 360}, {640, 480}, {800, 600}, {1024, 768},
+    {1280, 720}, {1280, 960}, {1600, 1200}, {1920, 1080}, {2592, 1944}, {3840, 2160}};
+
+static struct v4l2_fract fps_intervals[FPS_INTERVALS_MAX];
+static int fps_interval_count = 0;
+static struct v4l2_fract fps_default_interval = {1, 30};
+
 struct preset
 {
     char *path;
@@ -124,6 +697,151 @@ static int last_preset_loaded = -1;
 static bool preset_alpabetically = false;
 static int alpha_index = 0;
 
+#define CAPTURE_BUFFERS 4
+#define SCENE_INTERVAL_MS 250
+#define SCENE_ROW_STEP 2
+#define SCENE_DWELL 3
+
+struct capture_buffer
+{
+    void *start;
+    size_t length;
+};
+
+struct capture_frame
+{
+    const unsigned char *data;
+    size_t bytesused;
+    unsigned int sequence;
+    uint64_t timestamp_us;
+    int index;
+};
+
+static struct capture_buffer *capture_buffers = NULL;
+static unsigned int capture_nbuffers = 0;
+static bool capture_active = false;
+static unsigned int capture_pixelformat = V4L2_PIX_FMT_YUYV;
+static unsigned int capture_width = 0;
+static unsigned int capture_height = 0;
+static unsigned int capture_bytesperline = 0;
+static unsigned int capture_sequence = 0;
+#define REQUEST_CONTROLS_MAX 64
+
+/* request queued with a capture buffer and the controls it carries */
+struct capture_request
+{
+    int fd;
+    struct v4l2_ext_control controls[REQUEST_CONTROLS_MAX];
+    unsigned int count;
+    unsigned int since;
+};
+
+/* controls of the last request that completed with a frame */
+struct request_landing
+{
+    struct v4l2_ext_control controls[REQUEST_CONTROLS_MAX];
+    unsigned int count;
+    unsigned int since;
+    unsigned int sequence;
+    bool reported;
+};
+
+static bool request_enabled = false;
+static bool request_active = false;
+static int request_media_fd = -1;
+static struct capture_request *capture_requests = NULL;
+static unsigned int capture_nrequests = 0;
+static struct v4l2_ext_control request_pending[REQUEST_CONTROLS_MAX];
+static unsigned int request_pending_count = 0;
+static unsigned int request_pending_since = 0;
+static unsigned int request_seen = 0;
+static struct request_landing request_landed;
+static unsigned int request_check[REQUEST_CONTROLS_MAX * 2];
+static unsigned int request_check_count = 0;
+static const char *request_error = NULL;
+static char *raw_file = NULL;
+static int raw_fd = -1;
+static unsigned char *raw_frame = NULL;
+static size_t raw_frame_size = 0;
+
+struct scene_band
+{
+    int preset;
+    int threshold;
+};
+
+struct scene_stats
+{
+    unsigned int histogram[256];
+    unsigned int count;
+    double mean;
+    int median;
+    long elapsed_us;
+};
+
+static struct scene_band scene_bands[9];
+static int scene_band_count = 0;
+static int scene_hysteresis = 8;
+static int scene_band_active = -1;
+static int scene_band_pending = -1;
+static int scene_band_votes = 0;
+static struct scene_stats scene_last;
+static uint64_t scene_last_us = 0;
+static unsigned char *scene_row = NULL;
+
+#define FOCUS_SWEEP_STEPS 12
+#define FOCUS_SWEEP_SETTLE 2
+
+struct focus_stats
+{
+    double sharpness;
+    long elapsed_us;
+};
+
+/* coarse to fine search of the focus value with the sharpest frame, control is 0 when idle */
+struct focus_sweep
+{
+    unsigned int control;
+    int start_value;
+    int low;
+    int high;
+    int step;
+    int value;
+    int best_value;
+    double best;
+    int settle;
+};
+
+static bool focus_enabled = false;
+static struct focus_stats focus_last;
+static struct focus_sweep focus_sweep = {.best = -1};
+static unsigned char *focus_rows = NULL;
+
+#define HEALTH_WINDOW 128 /* power of two */
+#define HEALTH_PERCENTILES 3
+
+/* intervals of the last HEALTH_WINDOW frames, counters since the stream started */
+struct health_stats
+{
+    uint32_t intervals[HEALTH_WINDOW];
+    unsigned int count;
+    unsigned long frames;
+    unsigned long dropped;
+    unsigned int sequence;
+    uint64_t timestamp_us;
+};
+
+struct health_summary
+{
+    double fps;
+    double jitter_ms[HEALTH_PERCENTILES];
+};
+
+static const int health_percentiles[HEALTH_PERCENTILES] = {50, 95, 99};
+static bool health_enabled = false;
+static struct health_stats health;
+static uint64_t health_drawn_us = 0;
+
 struct window_dimensions
 {
     int top;
@@ -148,950 +866,8111 @@ void term(int signum)
     terminate = true;
 }
 
-static int v4l2_open(char *devname)
+static uint64_t monotonic_ns()
 {
-    struct v4l2_capability cap;
+    struct timespec ts;
 
-    v4l2_dev_fd = open(devname, O_RDWR | O_NONBLOCK, 0);
-    if (v4l2_dev_fd == -1)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* memory an ioctl reads and writes: its argument and the arrays the argument points to */
+static int fixture_spans(unsigned long request, void *arg, struct fixture_span *spans)
+{
+    struct v4l2_ext_controls *ctrls = arg;
+    struct media_v2_topology *topology = arg;
+
+    spans[0].data = arg;
+    spans[0].size = _IOC_SIZE(request);
+
+    switch (request)
     {
-        printf("ERROR: Device open failed: %s (%d)\n", strerror(errno), errno);
-        return -EINVAL;
+    case VIDIOC_G_EXT_CTRLS:
+    case VIDIOC_S_EXT_CTRLS:
+    case VIDIOC_TRY_EXT_CTRLS:
+        spans[1].data = ctrls->controls;
+        spans[1].size = ctrls->controls ? ctrls->count * sizeof(struct v4l2_ext_control) : 0;
+        return 2;
+
+    case MEDIA_IOC_G_TOPOLOGY:
+        spans[1].data = (void *)(uintptr_t)topology->ptr_entities;
+        spans[1].size = spans[1].data ? topology->num_entities * sizeof(struct media_v2_entity) : 0;
+        spans[2].data = (void *)(uintptr_t)topology->ptr_interfaces;
+        spans[2].size = spans[2].data ? topology->num_interfaces * sizeof(struct media_v2_interface) : 0;
+        spans[3].data = (void *)(uintptr_t)topology->ptr_pads;
+        spans[3].size = spans[3].data ? topology->num_pads * sizeof(struct media_v2_pad) : 0;
+        spans[4].data = (void *)(uintptr_t)topology->ptr_links;
+        spans[4].size = spans[4].data ? topology->num_links * sizeof(struct media_v2_link) : 0;
+        return 5;
+
+    default:
+        return 1;
     }
+}
 
-    if (ioctl(v4l2_dev_fd, VIDIOC_QUERYCAP, &cap) < 0)
+/* recorded arguments hold pointers of the recording process, spans NULL clears them */
+static void fixture_pointers(unsigned long request, void *arg, const struct fixture_span *spans)
+{
+    struct v4l2_ext_controls *ctrls = arg;
+    struct media_v2_topology *topology = arg;
+
+    switch (request)
     {
-        printf("ERROR: VIDIOC_QUERYCAP failed: %s (%d)\n", strerror(errno), errno);
-        goto err;
+    case VIDIOC_G_EXT_CTRLS:
+    case VIDIOC_S_EXT_CTRLS:
+    case VIDIOC_TRY_EXT_CTRLS:
+        ctrls->controls = spans ? spans[1].data : NULL;
+        break;
+
+    case MEDIA_IOC_G_TOPOLOGY:
+        topology->ptr_entities = spans ? (uintptr_t)spans[1].data : 0;
+        topology->ptr_interfaces = spans ? (uintptr_t)spans[2].data : 0;
+        topology->ptr_pads = spans ? (uintptr_t)spans[3].data : 0;
+        topology->ptr_links = spans ? (uintptr_t)spans[4].data : 0;
+        break;
+
+    default:
+        break;
     }
+}
 
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
+static size_t fixture_copy(unsigned char *dst, unsigned long request, const struct fixture_span *spans, int count)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
     {
-        printf("ERROR: %s is no video capture device\n", devname);
-        goto err;
+        memcpy(dst + size, spans[i].data, spans[i].size);
+        size += spans[i].size;
     }
-    return 1;
+    fixture_pointers(request, dst, NULL);
+    return size;
+}
 
-err:
-    close(v4l2_dev_fd);
-    return -EINVAL;
+/* the id or index most requests start with is the second level, the order per request the last */
+static size_t fixture_key_size(int level, size_t size)
+{
+    return level == 0 ? size : level == 1 ? (size < 4 ? size : 4) : 0;
 }
 
-static void v4l2_close()
+static uint64_t fixture_hash(int level, uint32_t node, uint32_t request, const unsigned char *in, size_t size)
 {
-    if (v4l2_dev_fd)
+    uint64_t hash = 14695981039346656037ULL;
+    uint32_t head[3] = {level, node, request};
+    size_t i;
+
+    for (i = 0; i < sizeof(head); i++)
     {
-        close(v4l2_dev_fd);
+        hash = (hash ^ ((const unsigned char *)head)[i]) * 1099511628211ULL;
+    }
+    for (i = 0; i < fixture_key_size(level, size); i++)
+    {
+        hash = (hash ^ in[i]) * 1099511628211ULL;
     }
+    return hash;
 }
 
-static int v4l2_fps_get()
+static struct fixture_key *fixture_key_find(int level, uint32_t node, uint32_t request, const unsigned char *in,
+                                            size_t size, bool add)
 {
-    static struct v4l2_streamparm parm;
-    struct v4l2_fract *tf;
-    memset(&parm, 0, sizeof(parm));
-
-    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    uint64_t hash = fixture_hash(level, node, request, in, size);
+    unsigned int slot = hash & (fixture_key_slots - 1);
+    const struct fixture_call *call;
+    struct fixture_key *key;
+    size_t length = fixture_key_size(level, size);
 
-    if (ioctl(v4l2_dev_fd, VIDIOC_G_PARM, &parm) == 0)
+    for (;; slot = (slot + 1) & (fixture_key_slots - 1))
     {
-        tf = &parm.parm.capture.timeperframe;
-
-        if (!tf->denominator || !tf->numerator)
+        key = &fixture_keys[slot];
+        if (key->first < 0)
         {
-            return 0;
+            if (add)
+            {
+                key->hash = hash;
+                key->level = level;
+            }
+            return add ? key : NULL;
         }
-        else
+        call = &fixture_calls[key->first];
+        if (key->hash == hash && key->level == level && call->record.node == node &&
+            call->record.request == request && fixture_key_size(level, call->record.size) == length &&
+            !memcmp(call->in, in, length))
         {
-            return (int)(1.0 * tf->denominator / tf->numerator);
+            return key;
         }
     }
-    return 0;
 }
 
-static int v4l2_fps_set(int fps)
+/*
+ * Answer an ioctl from the fixture: the next recorded call with the same
+ * argument, else with the same id or index, else the next call of the
+ * same request on the node. Recorded latency is kept with -t.
+ */
+static int fixture_replay(int fd, unsigned long request, void *arg)
 {
-    static struct v4l2_streamparm parm;
-    struct v4l2_fract *tf;
-    memset(&parm, 0, sizeof(parm));
+    struct fixture_span spans[FIXTURE_SPANS];
+    const struct fixture_call *call = NULL;
+    struct fixture_key *key = NULL;
+    struct timespec due;
+    uint64_t start_ns = monotonic_ns();
+    unsigned char *in;
+    size_t size = 0;
+    int node = fd >= 0 && fd < FIXTURE_FDS ? fixture_fd_nodes[fd] - 1 : -1;
+    int level;
+    int count;
+    int i;
 
-    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    parm.parm.capture.timeperframe.numerator = 1000;
-    parm.parm.capture.timeperframe.denominator =
-        (uint32_t)(fps * parm.parm.capture.timeperframe.numerator);
+    count = fixture_spans(request, arg, spans);
+    for (i = 0; i < count; i++)
+    {
+        size += spans[i].size;
+    }
+    in = malloc(size);
+    if (node < 0 || in == NULL)
+    {
+        free(in);
+        errno = node < 0 ? ENOTTY : ENOMEM;
+        return -1;
+    }
+    fixture_copy(in, request, spans, count);
 
-    if (ioctl(v4l2_dev_fd, VIDIOC_S_PARM, &parm) == 0)
+    pthread_mutex_lock(&fixture_lock);
+    for (level = 0; level < FIXTURE_LEVELS && key == NULL; level++)
+    {
+        key = fixture_key_find(level, node, request, in, size, false);
+    }
+    if (key)
+    {
+        call = &fixture_calls[key->cursor];
+        key->cursor = call->next[key->level] >= 0 ? call->next[key->level] : key->cursor;
+    }
+    /* the argument of another size cannot take the recorded answer */
+    call = call && call->record.size == size ? call : NULL;
+    fixture_count += call != NULL;
+    fixture_missed += call == NULL;
+    pthread_mutex_unlock(&fixture_lock);
+    free(in);
+
+    if (call == NULL)
     {
-        tf = &parm.parm.capture.timeperframe;
+        errno = EINVAL;
+        return -1;
+    }
 
-        if (!tf->denominator || !tf->numerator)
-        {
-            return 0;
-        }
-        else
+    for (i = 0, size = 0; i < count; i++)
+    {
+        memcpy(spans[i].data, call->out + size, spans[i].size);
+        size += spans[i].size;
+    }
+    fixture_pointers(request, arg, spans);
+
+    if (fixture_timed)
+    {
+        start_ns += call->record.latency_ns;
+        due.tv_sec = start_ns / 1000000000;
+        due.tv_nsec = start_ns % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
         {
-            return (int)(1.0 * tf->denominator / tf->numerator);
         }
     }
-    return 0;
-}
-
-static void v4l2_init_fps()
-{
-    int fps = v4l2_fps_get();
-
-    ctrl_mapping[ctrl_last].entry_type = V4L2_PARAM;
-    ctrl_mapping[ctrl_last].id = 0;
-    ctrl_mapping[ctrl_last].name = "FPS";
-    ctrl_mapping[ctrl_last].var_name = "fps";
-    ctrl_mapping[ctrl_last].control_type = 0;
-    ctrl_mapping[ctrl_last].value = fps;
-    ctrl_mapping[ctrl_last].minimum = 1;
-    ctrl_mapping[ctrl_last].maximum = fps_max;
-    ctrl_mapping[ctrl_last].step = 1;
-    ctrl_mapping[ctrl_last].default_value = 30;
-    ctrl_last++;
 
+    if (call->record.result < 0)
+    {
+        errno = call->record.error;
+    }
+    return call->record.result;
 }
 
-static int v4l2_set_ctrl_value(int id, int value)
+/*
+ * All ioctls on device nodes go through here. With -R every call is
+ * written to the fixture file with its argument memory before and after
+ * the call and its latency, with -N it is answered from the fixture.
+ */
+static int v4l2_ioctl(int fd, unsigned long request, void *arg)
 {
-    struct v4l2_control control;
+    struct fixture_span spans[FIXTURE_SPANS];
+    struct fixture_record record;
+    unsigned char *data;
+    uint64_t start_ns;
+    size_t size = 0;
+    int node;
+    int count;
+    int ret;
+    int i;
 
-    memset(&control, 0, sizeof(control));
-    control.id = id;
-    control.value = value;
-
-    return ioctl(v4l2_dev_fd, VIDIOC_S_CTRL, &control);
-}
-
-static void v4l2_apply_control(struct control_mapping *mapping)
-{
-    switch (mapping->entry_type)
+    if (fixture_replay_file)
     {
-    case V4L2_CONTROL:
-        v4l2_set_ctrl_value(mapping->id, mapping->value);
-        break;
+        return fixture_replay(fd, request, arg);
+    }
 
-    case V4L2_PARAM:
-        if (!strncmp(mapping->var_name, "fps", 3))
-        {
-            mapping->value = v4l2_fps_set(mapping->value);
-        }
-        break;
+    node = fd >= 0 && fd < FIXTURE_FDS ? fixture_fd_nodes[fd] - 1 : -1;
+    if (fixture_fp == NULL || node < 0)
+    {
+        return ioctl(fd, request, arg);
+    }
 
-    default:
-        break;
+    count = fixture_spans(request, arg, spans);
+    for (i = 0; i < count; i++)
+    {
+        size += spans[i].size;
+    }
+    /* fixture_load() rejects what is larger */
+    data = size <= FIXTURE_SIZE_MAX ? malloc(size * 2) : NULL;
+    if (data == NULL)
+    {
+        return ioctl(fd, request, arg);
     }
+    fixture_copy(data, request, spans, count);
+
+    start_ns = monotonic_ns();
+    ret = ioctl(fd, request, arg);
+    memset(&record, 0, sizeof(record));
+    record.latency_ns = monotonic_ns() - start_ns;
+    record.error = ret < 0 ? errno : 0;
+    record.type = FIXTURE_IOCTL;
+    record.node = node;
+    record.request = request;
+    record.result = ret;
+    record.size = size;
+    fixture_copy(data + size, request, spans, count);
+
+    pthread_mutex_lock(&fixture_lock);
+    fwrite(&record, sizeof(record), 1, fixture_fp);
+    fwrite(data, 1, size * 2, fixture_fp);
+    fixture_count++;
+    pthread_mutex_unlock(&fixture_lock);
+    free(data);
+
+    errno = record.error;
+    return ret;
 }
 
-static char *name2var(char *name)
+/* node of a path in the fixture, recorded on first use with -R */
+static int fixture_node(const char *path)
 {
-    int i;
-    int len_name = strlen(name) - 1;
-    char lowercase;
-    char out_name[127] = {'\0'};
-    bool add_underscore = false;
+    struct fixture_record record;
+    int node;
 
-    for (i = 0; i <= len_name; i++)
+    pthread_mutex_lock(&fixture_lock);
+    for (node = 0; node < fixture_node_count && (!fixture_nodes[node] || strcmp(fixture_nodes[node], path)); node++)
     {
-        if (isalnum(name[i]))
-        {
-            if (add_underscore)
-            {
-                strcat(out_name, "_");
-                add_underscore = false;
-            }
-            lowercase = tolower(name[i]);
-            strncat(out_name, &lowercase, 1);
-        }
-        else
-        {
-            add_underscore = true;
-        }
     }
-    return strdup((const char *)out_name);
+    if (fixture_fp && node == fixture_node_count && node < FIXTURE_NODES_MAX)
+    {
+        fixture_nodes[fixture_node_count++] = strdup(path);
+        memset(&record, 0, sizeof(record));
+        record.type = FIXTURE_NODE;
+        record.node = node;
+        record.size = strlen(path);
+        fwrite(&record, sizeof(record), 1, fixture_fp);
+        fwrite(path, 1, record.size, fixture_fp);
+    }
+    pthread_mutex_unlock(&fixture_lock);
+    return node < fixture_node_count ? node : -1;
 }
 
-static bool v4l2_check_supported_control(int control_id)
+/* device nodes are opened here, fixtures name the node of every ioctl by its path */
+static int v4l2_node_open(const char *path, int flags)
 {
-    if (v4l2_dev_pixelformat != V4L2_PIX_FMT_H264 &&
-        v4l2_dev_pixelformat != V4L2_PIX_FMT_H264_NO_SC &&
-        v4l2_dev_pixelformat != V4L2_PIX_FMT_H264_MVC)
-    {
-        switch (control_id)
-        {
-        case V4L2_CID_MPEG_MFC51_VIDEO_DECODER_H264_DISPLAY_DELAY:
-        case V4L2_CID_MPEG_MFC51_VIDEO_DECODER_H264_DISPLAY_DELAY_ENABLE:
-        case V4L2_CID_MPEG_MFC51_VIDEO_H264_ADAPTIVE_RC_ACTIVITY:
-        case V4L2_CID_MPEG_MFC51_VIDEO_H264_ADAPTIVE_RC_DARK:
-        case V4L2_CID_MPEG_MFC51_VIDEO_H264_ADAPTIVE_RC_SMOOTH:
-        case V4L2_CID_MPEG_MFC51_VIDEO_H264_ADAPTIVE_RC_STATIC:
-        case V4L2_CID_MPEG_MFC51_VIDEO_H264_NUM_REF_PIC_FOR_P:
-        case V4L2_CID_MPEG_VIDEO_H264_8X8_TRANSFORM:
-        case V4L2_CID_MPEG_VIDEO_H264_ASO:
-        case V4L2_CID_MPEG_VIDEO_H264_ASO_SLICE_ORDER:
-        case V4L2_CID_MPEG_VIDEO_H264_B_FRAME_QP:
-        case V4L2_CID_MPEG_VIDEO_H264_CPB_SIZE:
-        case V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE:
-        case V4L2_CID_MPEG_VIDEO_H264_FMO:
-        case V4L2_CID_MPEG_VIDEO_H264_FMO_CHANGE_DIRECTION:
-        case V4L2_CID_MPEG_VIDEO_H264_FMO_CHANGE_RATE:
-        case V4L2_CID_MPEG_VIDEO_H264_FMO_MAP_TYPE:
-        case V4L2_CID_MPEG_VIDEO_H264_FMO_RUN_LENGTH:
-        case V4L2_CID_MPEG_VIDEO_H264_FMO_SLICE_GROUP:
-        case V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING:
-        case V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING_LAYER:
-        case V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING_LAYER_QP:
-        case V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING_TYPE:
-        case V4L2_CID_MPEG_VIDEO_H264_I_PERIOD:
-        case V4L2_CID_MPEG_VIDEO_H264_LEVEL:
-        case V4L2_CID_MPEG_VIDEO_H264_LOOP_FILTER_ALPHA:
-        case V4L2_CID_MPEG_VIDEO_H264_LOOP_FILTER_BETA:
-        case V4L2_CID_MPEG_VIDEO_H264_LOOP_FILTER_MODE:
-        case V4L2_CID_MPEG_VIDEO_H264_MAX_QP:
-        case V4L2_CID_MPEG_VIDEO_H264_MIN_QP:
-        case V4L2_CID_MPEG_VIDEO_H264_PROFILE:
-        case V4L2_CID_MPEG_VIDEO_H264_SEI_FP_ARRANGEMENT_TYPE:
-        case V4L2_CID_MPEG_VIDEO_H264_SEI_FP_CURRENT_FRAME_0:
-        case V4L2_CID_MPEG_VIDEO_H264_SEI_FRAME_PACKING:
-        case V4L2_CID_MPEG_VIDEO_H264_VUI_EXT_SAR_HEIGHT:
-        case V4L2_CID_MPEG_VIDEO_H264_VUI_EXT_SAR_WIDTH:
-        case V4L2_CID_MPEG_VIDEO_H264_VUI_SAR_ENABLE:
-        case V4L2_CID_MPEG_VIDEO_H264_VUI_SAR_IDC:
-            return false;
-        default:
-            break;
+    int node;
+    int fd;
+
+    if (fixture_replay_file)
+    {
+        node = fixture_node(path);
+        if (node < 0)
+        {
+            errno = ENOENT;
+            return -1;
         }
+        fd = open("/dev/null", O_RDWR | (flags & O_CLOEXEC));
     }
-
-    if (v4l2_dev_pixelformat != V4L2_PIX_FMT_MPEG4)
+    else
     {
-        switch (control_id)
+        fd = open(path, flags, 0);
+        if (fd < 0 || fixture_fp == NULL)
         {
-        case V4L2_CID_MPEG_VIDEO_MPEG4_LEVEL:
-        case V4L2_CID_MPEG_VIDEO_MPEG4_PROFILE:
-        case V4L2_CID_MPEG_VIDEO_MPEG4_QPEL:
-        case V4L2_CID_MPEG_VIDEO_MPEG4_I_FRAME_QP:
-        case V4L2_CID_MPEG_VIDEO_MPEG4_P_FRAME_QP:
-        case V4L2_CID_MPEG_VIDEO_MPEG4_B_FRAME_QP:
-            return false;
-        default:
-            break;
+            return fd;
         }
+        node = fixture_node(path);
     }
-    return true;
+
+    if (fd >= 0 && fd < FIXTURE_FDS)
+    {
+        fixture_fd_nodes[fd] = node + 1;
+    }
+    return fd;
 }
 
-static void v4l2_get_controls()
+/*
+ * Requests come from MEDIA_IOC_REQUEST_ALLOC instead of open(). Each one
+ * is a node of its own, named after the media device and the order of
+ * allocation, a replayed request is a /dev/null descriptor.
+ */
+static int v4l2_request_alloc(int media_fd, int *request_fd)
 {
-    const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
-    struct v4l2_queryctrl queryctrl;
-    struct v4l2_control control;
-    struct v4l2_querymenu querymenu;
-    unsigned int options_count;
-    unsigned int option_nr;
-    unsigned int id;
-    int menu_index;
-    char *var_name;
-    bool ignore;
-    int liv;
-
-    memset(&queryctrl, 0, sizeof(queryctrl));
-    memset(&querymenu, 0, sizeof(querymenu));
+    static unsigned int allocated = 0;
+    char path[288];
+    int node = media_fd >= 0 && media_fd < FIXTURE_FDS ? fixture_fd_nodes[media_fd] - 1 : -1;
 
-    ctrl_mapping = malloc(100 * sizeof(struct control_mapping));
-
-    if (list_controls)
+    if (v4l2_ioctl(media_fd, MEDIA_IOC_REQUEST_ALLOC, request_fd) < 0)
     {
-        printf("INFO: %30s = %-30s\n", "Control variable name", "Control name");
+        return -1;
+    }
+    if (node < 0)
+    {
+        return 0;
     }
 
-    queryctrl.id = next_fl;
-    while (0 == ioctl(v4l2_dev_fd, VIDIOC_QUERYCTRL, &queryctrl))
+    snprintf(path, sizeof(path), "%s#request%u", fixture_nodes[node], allocated++);
+    node = fixture_node(path);
+    if (fixture_replay_file)
     {
-        id = queryctrl.id;
-        queryctrl.id |= next_fl;
+        *request_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    }
+    if (*request_fd >= 0 && *request_fd < FIXTURE_FDS)
+    {
+        fixture_fd_nodes[*request_fd] = node + 1;
+    }
+    return *request_fd >= 0 ? 0 : -1;
+}
+
+static int fixture_load(FILE *fp)
+{
+    struct fixture_record record;
+    struct fixture_call *calls;
+    struct fixture_key *key;
+    int size = 0;
+    int level;
+    int i;
 
-        if ((queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) ||
-            (queryctrl.flags & V4L2_CTRL_FLAG_INACTIVE) ||
-            (queryctrl.flags & V4L2_CTRL_FLAG_READ_ONLY))
+    while (fread(&record, sizeof(record), 1, fp) == 1)
+    {
+        if (record.type == FIXTURE_NODE && record.node < FIXTURE_NODES_MAX && !fixture_nodes[record.node] &&
+            record.size < PATH_MAX)
         {
+            fixture_nodes[record.node] = calloc(record.size + 1, 1);
+            if (fixture_nodes[record.node] == NULL || fread(fixture_nodes[record.node], 1, record.size, fp) != record.size)
+            {
+                return -1;
+            }
+            fixture_node_count = record.node >= (uint32_t)fixture_node_count ? (int)record.node + 1 : fixture_node_count;
             continue;
         }
+        /* sizes come from the file, a corrupt one must not overflow the buffers */
+        if (record.type != FIXTURE_IOCTL || record.size > FIXTURE_SIZE_MAX)
+        {
+            return -1;
+        }
 
-        if (disable_unsupported_controls)
+        if (fixture_call_count >= size)
         {
-            if (!v4l2_check_supported_control(id))
+            size = size ? size * 2 : 256;
+            calls = realloc(fixture_calls, size * sizeof(struct fixture_call));
+            if (calls == NULL)
             {
-                printf("INFO: Ignore unsupported control: %s\n", queryctrl.name);
-                continue;
+                return -1;
             }
+            fixture_calls = calls;
         }
-
-        control.id = queryctrl.id;
-        if (0 == ioctl(v4l2_dev_fd, VIDIOC_G_CTRL, &control))
+        fixture_calls[fixture_call_count].record = record;
+        fixture_calls[fixture_call_count].in = malloc(record.size * 2 + 1);
+        if (fixture_calls[fixture_call_count].in == NULL ||
+            fread(fixture_calls[fixture_call_count].in, 1, record.size * 2, fp) != record.size * 2)
         {
-            option_nr = 0;
-            var_name = name2var((char *)queryctrl.name);
+            free(fixture_calls[fixture_call_count].in);
+            return -1;
+        }
+        fixture_calls[fixture_call_count].out = fixture_calls[fixture_call_count].in + record.size;
+        fixture_call_count++;
+    }
 
-            if (list_controls)
-            {
-                printf("INFO: %30s = %-30s\n", var_name, queryctrl.name);
-                continue;
-            }
+    /* open addressing, at most half of the slots are used */
+    for (fixture_key_slots = 64; fixture_key_slots < (unsigned int)fixture_call_count * FIXTURE_LEVELS * 2;
+         fixture_key_slots *= 2)
+    {
+    }
+    fixture_keys = malloc(fixture_key_slots * sizeof(struct fixture_key));
+    if (fixture_keys == NULL)
+    {
+        return -1;
+    }
+    for (i = 0; i < (int)fixture_key_slots; i++)
+    {
+        fixture_keys[i].first = -1;
+    }
 
-            if (last_ignored_variable > 0)
+    for (i = 0; i < fixture_call_count; i++)
+    {
+        for (level = 0; level < FIXTURE_LEVELS; level++)
+        {
+            fixture_calls[i].next[level] = -1;
+            key = fixture_key_find(level, fixture_calls[i].record.node, fixture_calls[i].record.request,
+                                   fixture_calls[i].in, fixture_calls[i].record.size, true);
+            if (key->first < 0)
             {
-                ignore = false;
-                for (liv = 0; liv < last_ignored_variable; liv++)
-                {
-                    if (!strncmp(var_name, ignored_variables[liv], strlen(var_name)))
-                    {
-                        ignore = true;
-                        continue;
-                    }
-                }
-                if (ignore)
-                {
-                    continue;
-                }
+                key->first = i;
+                key->cursor = i;
             }
-
-            ctrl_mapping[ctrl_last].entry_type = V4L2_CONTROL;
-            ctrl_mapping[ctrl_last].id = id;
-            ctrl_mapping[ctrl_last].name = strdup((const char *)queryctrl.name);
-            ctrl_mapping[ctrl_last].var_name = var_name;
-            ctrl_mapping[ctrl_last].control_type = queryctrl.type;
-            ctrl_mapping[ctrl_last].value = control.value;
-            ctrl_mapping[ctrl_last].minimum = queryctrl.minimum;
-            ctrl_mapping[ctrl_last].maximum = queryctrl.maximum;
-            ctrl_mapping[ctrl_last].step = queryctrl.step;
-            ctrl_mapping[ctrl_last].default_value = queryctrl.default_value;
-
-            if (queryctrl.type == V4L2_CTRL_TYPE_MENU || queryctrl.type == V4L2_CTRL_TYPE_INTEGER_MENU)
+            else
             {
-                options_count = queryctrl.maximum - queryctrl.minimum + 1;
-                if (options_count <= 0)
-                {
-                    continue;
-                }
-                ctrl_mapping[ctrl_last].options = malloc(options_count * sizeof(struct control_option));
-
-                for (menu_index = queryctrl.minimum; menu_index <= queryctrl.maximum; menu_index++)
-                {
-                    querymenu.id = id;
-                    querymenu.index = menu_index;
-                    if (0 == ioctl(v4l2_dev_fd, VIDIOC_QUERYMENU, &querymenu))
-                    {
-                        ctrl_mapping[ctrl_last].options[option_nr].index = querymenu.index;
-
-                        if (queryctrl.type == V4L2_CTRL_TYPE_MENU)
-                        {
-                            ctrl_mapping[ctrl_last].options[option_nr].name = strdup((const char *)querymenu.name);
-                        }
-                        else
-                        {
-                            ctrl_mapping[ctrl_last].options[option_nr].value = querymenu.value;
-                        }
-                        option_nr += 1;
-                    }
-                }
-                if (option_nr)
-                {
-                    ctrl_mapping[ctrl_last].hasoptions = true;
-                }
+                fixture_calls[key->last].next[level] = i;
             }
-
-            ctrl_last += 1;
+            key->last = i;
         }
     }
+    return 0;
 }
 
-static void control_free()
+/* -R creates the fixture file, -N reads it at once */
+static int fixture_open()
 {
-    int i;
+    char magic[4];
+    FILE *fp;
 
-    for (i = 0; i < ctrl_last; i++)
+    if (fixture_record_file)
     {
-        if (ctrl_mapping[i].entry_type == V4L2_CONTROL)
+        fixture_fp = fopen(fixture_record_file, "wb");
+        if (fixture_fp == NULL)
         {
-            if (ctrl_mapping[i].name)
-            {
-                free(ctrl_mapping[i].name);
-                ctrl_mapping[i].name = NULL;
-            }
-            if (ctrl_mapping[i].var_name)
-            {
-                free(ctrl_mapping[i].var_name);
-                ctrl_mapping[i].var_name = NULL;
-            }
-            if (ctrl_mapping[i].hasoptions && ctrl_mapping[i].options)
-            {
-                free(ctrl_mapping[i].options);
-                ctrl_mapping[i].options = NULL;
-            }
+            printf("ERROR: Cannot create fixture %s: %s (%d)\n", fixture_record_file, strerror(errno), errno);
+            return -1;
         }
+        fwrite(FIXTURE_MAGIC, 1, sizeof(magic), fixture_fp);
+        return 0;
+    }
+
+    fp = fopen(fixture_replay_file, "rb");
+    if (fp == NULL)
+    {
+        printf("ERROR: Cannot open fixture %s: %s (%d)\n", fixture_replay_file, strerror(errno), errno);
+        return -1;
+    }
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, FIXTURE_MAGIC, sizeof(magic)) ||
+        fixture_load(fp) < 0)
+    {
+        printf("ERROR: %s is not a fixture file\n", fixture_replay_file);
+        fclose(fp);
+        return -1;
     }
+    fclose(fp);
+    return 0;
 }
 
-static void control_load(const char *title, const char *filename)
+static void fixture_close()
 {
-    char name[30];
-    int value;
     int i;
-    FILE *fp = fopen(filename, "r");
 
-    mvprintw(0, 20, "%*s", 60, " ");
+    if (fixture_fp)
+    {
+        fclose(fixture_fp);
+        fixture_fp = NULL;
+        printf("INFO: Recorded %lu ioctls on %d nodes to %s\n", fixture_count, fixture_node_count, fixture_record_file);
+    }
+    if (fixture_replay_file)
+    {
+        printf("INFO: Replayed %lu ioctls from %s, %lu without recorded answer\n", fixture_count, fixture_replay_file,
+               fixture_missed);
+    }
+    for (i = 0; i < fixture_call_count; i++)
+    {
+        free(fixture_calls[i].in);
+    }
+    free(fixture_calls);
+    fixture_calls = NULL;
+    fixture_call_count = 0;
+    free(fixture_keys);
+    fixture_keys = NULL;
+    for (i = 0; i < FIXTURE_NODES_MAX; i++)
+    {
+        free(fixture_nodes[i]);
+        fixture_nodes[i] = NULL;
+    }
+    fixture_node_count = 0;
+}
 
-    if (fp != NULL)
+static int v4l2_open(char *devname)
+{
+    struct v4l2_capability cap;
+
+    v4l2_dev_fd = v4l2_node_open(devname, O_RDWR | O_NONBLOCK);
+    if (v4l2_dev_fd == -1)
     {
-        // Assume control=value file format
-        while (fscanf(fp, "%[^=]=%d\r\n", name, &value) == 2)
-        {
-            for (i = 0; i < ctrl_last; i++)
-            {
-                if (strcmp(name, ctrl_mapping[i].var_name) == 0)
-                {
-                    if (ctrl_mapping[i].value != value)
-                    {
-                        ctrl_mapping[i].value = value;
-                        v4l2_apply_control(&ctrl_mapping[i]);
-                    };
-                    break;
-                }
-            }
-        }
-        mvprintw(0, 20, "%s file %s loaded", title, filename);
-        fclose(fp);
+        printf("ERROR: Device open failed: %s (%d)\n", strerror(errno), errno);
+        return -EINVAL;
     }
-    else
+
+    if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_QUERYCAP, &cap) < 0)
     {
-        mvprintw(0, 20, "Cannot load %s", filename);
+        printf("ERROR: VIDIOC_QUERYCAP failed: %s (%d)\n", strerror(errno), errno);
+        goto err;
     }
-    refresh();
+
+    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
+    {
+        printf("ERROR: %s is no video capture device\n", devname);
+        goto err;
+    }
+
+    /* identity used to find the device again after it was unplugged */
+    memcpy(v4l2_bus_info, cap.bus_info, sizeof(v4l2_bus_info));
+    memcpy(v4l2_card, cap.card, sizeof(v4l2_card));
+    return 1;
+
+err:
+    close(v4l2_dev_fd);
+    return -EINVAL;
 }
 
-static void control_save(const char *title, const char *filename)
+static void v4l2_close()
 {
-    int value;
-    // Overwrite existing file
-    FILE *fp = fopen(filename, "w");
+    int i;
 
-    mvprintw(0, 20, "%*s", 60, " ");
-    if (fp != NULL)
+    if (v4l2_dev_fd >= 0)
     {
-        for (int i = 0; i < ctrl_last; i++)
+        close(v4l2_dev_fd);
+        v4l2_dev_fd = -1;
+    }
+    for (i = 1; i <= media_count; i++)
+    {
+        if (media_sources[i].fd >= 0)
         {
-            value = 0;
-            if (ctrl_mapping[i].value != ctrl_mapping[i].default_value)
-            {
-                value = ctrl_mapping[i].value;
-                fprintf(fp, "%s=%d\r\n", ctrl_mapping[i].var_name, value);
-            }
+            close(media_sources[i].fd);
         }
-        fclose(fp);
-        mvprintw(0, 20, "%s file %s saved", title, filename);
     }
-    else
+    media_count = 0;
+    if (device_watch_fd >= 0)
     {
-        mvprintw(0, 20, "Cannot save %s", filename);
+        close(device_watch_fd);
+        device_watch_fd = -1;
     }
-    refresh();
 }
 
-static int presets_read(const char *fpath,
-                        const struct stat *sb,
-                        int tflag)
+/* nodes like the -v device, /dev/video0 is matched as /dev/video* */
+static void device_pattern()
 {
-    char *file = NULL;
-    int index = 0;
+    char path[sizeof(device_dir)];
+    char *base;
+    size_t len;
+
+    snprintf(path, sizeof(path), "%s", v4l2_devname);
+    snprintf(device_dir, sizeof(device_dir), "%s", dirname(path));
+    snprintf(path, sizeof(path), "%s", v4l2_devname);
+    base = basename(path);
+    len = strlen(base);
+    while (len && isdigit((unsigned char)base[len - 1]))
+    {
+        len--;
+    }
+    snprintf(device_prefix, sizeof(device_prefix), "%.*s", (int)len, base);
+}
 
-    (void)(tflag); /* avoid warning: unused parameter 'tflag' */
+static uint64_t monotonic_us()
+{
+    struct timespec ts;
 
-    if (!S_ISDIR(sb->st_mode))
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* bytes written by the calling thread, the terminal output of ncurses when called around doupdate() */
+static long long ui_written()
+{
+    char buf[512];
+    char *wchar;
+    ssize_t len;
+
+    if (bandwidth_io_fd < 0)
     {
-        file = (char *)(fpath + strlen(presets_path));
+        bandwidth_io_fd = open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC);
+    }
+    len = bandwidth_io_fd < 0 ? -1 : pread(bandwidth_io_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
+    {
+        return 0;
+    }
+    buf[len] = '\0';
+    wchar = strstr(buf, "wchar:");
+    return wchar ? atoll(wchar + 6) : 0;
+}
 
-        if (file[0] == '/')
-        {
-            file++;
-        }
+/*
+ * Screen output of the low bandwidth mode is limited to bandwidth_rate
+ * bytes per second with up to one second of burst. Updates over the
+ * budget are deferred, the windows collect further changes meanwhile
+ * and the next update sends only the final state.
+ */
+static void ui_update()
+{
+    uint64_t now;
+    long long before;
+    long long written;
 
-        if (preset_alpabetically)
-        {
-            if (alpha_index < 9)
-            {
-                presets[alpha_index].path = strdup((const char *)fpath);
-                presets[alpha_index].name = strdup((const char *)file);
-                printf("%d %s\n", alpha_index, presets[alpha_index].name);
-                alpha_index++;
-            }
-        }
-        else if (file[0] > 48 && file[0] < 58)
-        {
-            index = (int)file[0] - 49;
-            presets[index].path = strdup((const char *)fpath);
-            file++;
+    if (!bandwidth_rate)
+    {
+        doupdate();
+        return;
+    }
 
-            while (!isalnum((int)file[0]))
-            {
-                file++;
-            }
-            presets[index].name = strdup((const char *)file);
-        }
+    /* keys are read from input_pad, the text of stdscr is not sent by getch() */
+    wnoutrefresh(stdscr);
+
+    now = monotonic_us();
+    bandwidth_tokens += (long)((now - bandwidth_us) * bandwidth_rate / 1000000);
+    bandwidth_tokens = bandwidth_tokens > bandwidth_rate ? bandwidth_rate : bandwidth_tokens;
+    bandwidth_us = now;
+    if (bandwidth_tokens <= 0)
+    {
+        ui_pending = true;
+        return;
     }
-    return 0;
+
+    before = ui_written();
+    doupdate();
+    written = ui_written() - before;
+    bandwidth_tokens -= (long)written;
+    ui_bytes += written;
+    ui_pending = false;
 }
 
-static int sort_presets(const void *v1, const void *v2)
+static void ui_refresh()
 {
-    const struct preset *p1 = (struct preset *)v1;
-    const struct preset *p2 = (struct preset *)v2;
-    int rc = strcmp(p1->name, p2->name);
-    if (rc < 0)
-    {
-        return -1;
-    }
-    else if (rc > 0)
+    wnoutrefresh(stdscr);
+    ui_update();
+}
+
+/* windows are erased in low bandwidth mode, a clear repaints the whole terminal */
+static void ui_erase(WINDOW *win)
+{
+    if (bandwidth_rate && ui_initialized)
     {
-        return +1;
+        werase(win);
     }
     else
     {
-        return 0;
+        wclear(win);
     }
 }
 
-static void get_preset_files()
+static int luma_pixel_step(unsigned int pixelformat)
 {
-    if (presets_path)
+    switch (pixelformat)
     {
-        ftw(presets_path, presets_read, 20);
-        if (preset_alpabetically && alpha_index > 0)
-        {
-            qsort(presets, alpha_index, sizeof(struct preset), sort_presets);
-        }
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+    case V4L2_PIX_FMT_UYVY:
+    case V4L2_PIX_FMT_VYUY:
+        return 2;
+
+    case V4L2_PIX_FMT_GREY:
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_NV16:
+    case V4L2_PIX_FMT_NV61:
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YVU420:
+    case V4L2_PIX_FMT_YUV422P:
+        return 1;
+
+    default:
+        return 0;
     }
 }
 
-static void load_preset(int index)
+static size_t luma_frame_size(unsigned int pixelformat, unsigned int bytesperline, unsigned int height)
 {
-    if (index >= 0 && index < 9)
+    switch (pixelformat)
     {
-        if (presets[index].path)
-        {
-            control_load("Preset", presets[index].path);
-            last_preset_loaded = index;
-        }
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YVU420:
+        return (size_t)bytesperline * height * 3 / 2;
+
+    case V4L2_PIX_FMT_NV16:
+    case V4L2_PIX_FMT_NV61:
+    case V4L2_PIX_FMT_YUV422P:
+        return (size_t)bytesperline * height * 2;
+
+    default:
+        return (size_t)bytesperline * height;
     }
 }
 
-static void load_next_preset()
+static int capture_open_file()
 {
-    int i;
+    if (!capture_width || !capture_height)
+    {
+        printf("ERROR: Raw frame geometry is not defined (use -g)\n");
+        return -EINVAL;
+    }
 
-    if (last_preset_loaded < 0)
+    if (!luma_pixel_step(capture_pixelformat))
     {
-        for (i = 0; i < 9; i++)
-        {
-            if (presets[i].path)
-            {
-                load_preset(i);
-                return;
-            }
-        }
+        printf("ERROR: Unsupported raw frame format %c%c%c%c\n", pixfmtstr(capture_pixelformat));
+        return -EINVAL;
     }
-    else
+
+    raw_fd = open(raw_file, O_RDONLY);
+    if (raw_fd == -1)
     {
-        for (i = last_preset_loaded + 1; i < 9; i++)
+        printf("ERROR: Raw frame file open failed: %s (%d)\n", strerror(errno), errno);
+        return -EINVAL;
+    }
+
+    capture_bytesperline = capture_width * luma_pixel_step(capture_pixelformat);
+    raw_frame_size = luma_frame_size(capture_pixelformat, capture_bytesperline, capture_height);
+    raw_frame = malloc(raw_frame_size);
+    if (!raw_frame)
+    {
+        close(raw_fd);
+        raw_fd = -1;
+        return -ENOMEM;
+    }
+
+    capture_active = true;
+    return 1;
+}
+
+/* controls whose value is read back once the stream has shown them, the driver may not have taken it */
+static void request_check_add(const struct v4l2_ext_control *items, unsigned int count)
+{
+    unsigned int i;
+    unsigned int j;
+
+    for (i = 0; i < count; i++)
+    {
+        for (j = 0; j < request_check_count && request_check[j] != items[i].id; j++)
         {
-            if (presets[i].path)
-            {
-                load_preset(i);
-                return;
-            }
         }
-        for (i = 0; i < last_preset_loaded; i++)
+        if (j == request_check_count && j < REQUEST_CONTROLS_MAX * 2)
         {
-            if (presets[i].path)
-            {
-                load_preset(i);
-                return;
-            }
+            request_check[request_check_count++] = items[i].id;
         }
     }
 }
 
-static void menu_item(int cid, int y, int x)
+/*
+ * Pending controls go to the device at once when no request takes them,
+ * one by one when the driver refuses the batch. Returns the number of
+ * failed writes. All of them are read back later, the driver may also
+ * have adjusted a value.
+ */
+static int request_flush()
 {
-    struct control_mapping *cm = &ctrl_mapping[cid];
-    int idx;
-    char *value_diff = " ";
-    int row_width = menu_dim.cols - 4;
+    struct v4l2_ext_controls ctrls;
+    struct v4l2_control control;
+    int failed = 0;
+    unsigned int i;
 
-    if (cm->value > cm->default_value)
+    if (!request_pending_count)
     {
-        value_diff = "+";
-    }
-    else if (cm->value < cm->default_value)
-    {
-        value_diff = "-";
+        return 0;
     }
 
-    /* value */
-    mvwprintw(menu_win, y, x, "%*d", row_width, cm->value);
-
-    /* option name */
-    if (cm->hasoptions)
+    request_check_add(request_pending, request_pending_count);
+    memset(&ctrls, 0, sizeof(ctrls));
+    ctrls.which = V4L2_CTRL_WHICH_CUR_VAL;
+    ctrls.count = request_pending_count;
+    ctrls.controls = request_pending;
+    if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_S_EXT_CTRLS, &ctrls) < 0)
     {
-        for (idx = cm->minimum; idx <= cm->maximum; idx++)
+        for (i = 0; i < request_pending_count; i++)
         {
-            if (cm->options[idx].index == cm->value)
+            memset(&control, 0, sizeof(control));
+            control.id = request_pending[i].id;
+            control.value = request_pending[i].value;
+            if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_S_CTRL, &control) < 0)
             {
-                if (cm->options[idx].name)
-                {
-                    mvwprintw(menu_win, y, x, "%*s", row_width, cm->options[idx].name);
-                }
-                else
-                {
-                    mvwprintw(menu_win, y, x, "%*d", row_width, cm->options[idx].value);
-                }
+                failed++;
             }
         }
     }
-
-    /* name */
-    mvwprintw(menu_win, y, x, "%s %s", value_diff, cm->name);
+    request_pending_count = 0;
+    return failed;
 }
 
-static void v4l2_format_info()
+static void request_close()
 {
-    struct v4l2_format fmt;
-    memset(&fmt, 0, sizeof(fmt));
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    unsigned int i;
 
-    if (ioctl(v4l2_dev_fd, VIDIOC_G_FMT, &fmt) < 0)
+    request_active = false;
+    request_flush();
+    for (i = 0; i < capture_nrequests; i++)
     {
-        return;
+        if (capture_requests[i].fd >= 0)
+        {
+            close(capture_requests[i].fd);
+        }
+    }
+    free(capture_requests);
+    capture_requests = NULL;
+    capture_nrequests = 0;
+    if (request_media_fd >= 0)
+    {
+        close(request_media_fd);
+        request_media_fd = -1;
     }
-    v4l2_dev_pixelformat = fmt.fmt.pix.pixelformat;
-    v4l2_dev_width = fmt.fmt.pix.width;
-    v4l2_dev_height = fmt.fmt.pix.height;
-}
-
-static void ui_uninit()
-{
-    curs_set(1);
-    clrtoeol();
-    refresh();
-    endwin();
 }
 
-static void draw_top()
+/*
+ * One request per capture buffer, allocated on the media device of the
+ * video node. Without them the stream runs as usual and controls are
+ * written at once, request_error tells why.
+ */
+static int request_open(unsigned int count, unsigned int capabilities)
 {
-    int i;
-    int row = 2;
-    int col = 37;
-
-    wclear(top_win);
-    mvwin(top_win, top_dim.top, top_dim.left);
-    wresize(top_win, top_dim.rows, top_dim.cols);
-
-    mvprintw(0, 1, "Camera control: ", v4l2_devname);
-    mvprintw(1, 1, "V4L2:       %s", v4l2_devname);
-    mvprintw(2, 1, "Format:     %c%c%c%c", pixfmtstr(v4l2_dev_pixelformat));
-    mvprintw(3, 1, "Resolution: %dx%d", v4l2_dev_width, v4l2_dev_height);
+    if (!(capabilities & V4L2_BUF_CAP_SUPPORTS_REQUESTS))
+    {
+        request_error = "the device does not support requests";
+        return -1;
+    }
+    if (!media_device[0])
+    {
+        request_error = "no media device for requests";
+        return -1;
+    }
 
-    mvprintw(1, 28, "Config: %s", config_file);
-    mvprintw(2, 28, "Presets:");
+    request_media_fd = v4l2_node_open(media_device, O_RDWR | O_CLOEXEC);
+    capture_requests = calloc(count, sizeof(struct capture_request));
+    if (request_media_fd < 0 || capture_requests == NULL)
+    {
+        request_error = "cannot open the media device";
+        request_close();
+        return -1;
+    }
 
-    for (i = 0; i < 10; i++)
+    for (capture_nrequests = 0; capture_nrequests < count; capture_nrequests++)
     {
-        if (presets[i].name)
+        if (v4l2_request_alloc(request_media_fd, &capture_requests[capture_nrequests].fd) < 0)
         {
-            if (col + (int)strlen(presets[i].name) + 5 > (int)top_dim.cols)
-            {
-                row++;
-                col = 37;
-            }
-            if (row < 4)
-            {
-                mvprintw(row, col, "[%d] %s", i + 1, presets[i].name);
-                col += (int)strlen(presets[i].name) + 5;
-            }
+            request_error = "request allocation failed";
+            request_close();
+            return -1;
         }
     }
 
-    wnoutrefresh(top_win);
+    request_error = NULL;
+    request_active = true;
+    return 0;
 }
 
-static void draw_menu(bool full_redraw)
+/*
+ * With -Q writes of video node controls are collected while the stream
+ * runs and go out with the request of the next buffer handed back to the
+ * driver, so they take effect on a known frame. A control named twice is
+ * sent with its last value, a full batch is written at once and its
+ * failed writes are returned.
+ */
+static int request_add(const struct v4l2_ext_control *items, int count)
 {
+    int failed = 0;
+    unsigned int j;
     int i;
-    int x = 2;
-    int y = 1;
-    int max;
-    int offset = 0;
-    int btitle_offset = 0;
-    int window_lines = menu_dim.rows - 2;
-
-    if (full_redraw)
-    {
-        wclear(menu_win);
-        mvwin(menu_win, menu_dim.top, menu_dim.left);
-        wresize(menu_win, menu_dim.rows, menu_dim.cols);
-    }
-    else
-    {
-        werase(menu_win);
-    }
-    box(menu_win, 0, 0);
 
-    if (active_control > window_lines - 1)
+    for (i = 0; i < count; i++)
     {
-        if (active_control >= last_offset && active_control < last_offset + window_lines)
+        for (j = 0; j < request_pending_count && request_pending[j].id != items[i].id; j++)
         {
-            offset = last_offset;
         }
-        else
+        if (j == REQUEST_CONTROLS_MAX)
         {
-            offset = active_control - window_lines + 1;
+            failed += request_flush();
+            j = 0;
         }
-    }
-    else if (last_offset > 0)
-    {
-        if (active_control > last_offset)
+        if (!request_pending_count)
         {
-            offset = last_offset;
+            request_pending_since = request_seen;
         }
-        else
+        if (j == request_pending_count)
         {
-            offset = active_control;
+            memset(&request_pending[j], 0, sizeof(struct v4l2_ext_control));
+            request_pending[j].id = items[i].id;
+            request_pending_count++;
         }
+        request_pending[j].value = items[i].value;
     }
-    last_offset = offset;
+    return failed;
+}
 
-    max = (ctrl_last >= offset + window_lines) ? offset + window_lines : ctrl_last;
+/* a newer value of the control is still on its way to the device */
+static bool request_queued(unsigned int id)
+{
+    unsigned int i;
+    unsigned int j;
 
-    box(menu_win, 0, 0);
-    for (i = offset; i < max; i++)
+    for (i = 0; i < request_pending_count; i++)
     {
-        if (active_control == i)
+        if (request_pending[i].id == id)
         {
-            wattron(menu_win, A_REVERSE);
-            menu_item(i, y, x);
-            wattroff(menu_win, A_REVERSE);
+            return true;
         }
-        else
+    }
+    for (i = 0; i < capture_nrequests; i++)
+    {
+        for (j = 0; j < capture_requests[i].count; j++)
         {
-            menu_item(i, y, x);
+            if (capture_requests[i].controls[j].id == id)
+            {
+                return true;
+            }
         }
-        y++;
     }
+    return false;
+}
 
-    btitle_offset = menu_dim.cols - 9;
-    btitle_offset -= (active_control + 1 < 10) ? 1 : ((active_control + 1 < 100) ? 2 : 3);
-    btitle_offset -= (ctrl_last < 10) ? 1 : ((ctrl_last < 100) ? 2 : 3);
-
-    mvwhline(menu_win, 0, 1, ACS_HLINE, menu_dim.cols - 2);
-    wmove(menu_win, menu_dim.rows - 1, btitle_offset);
-    wprintw(menu_win, "[ %d / %d ]", active_control + 1, ctrl_last);
-
-    wnoutrefresh(menu_win);
+/* the pending controls of the frame the request of a dequeued buffer was queued with */
+static void request_done(unsigned int index, unsigned int sequence)
+{
+    struct capture_request *request;
 
-    if (full_redraw)
-    {
-        wnoutrefresh(menu_win);
-    }
-    else
+    request_seen = sequence;
+    if (index >= capture_nrequests || !capture_requests[index].count)
     {
-        wrefresh(menu_win);
+        return;
     }
+
+    request = &capture_requests[index];
+    request_check_add(request->controls, request->count);
+    memcpy(request_landed.controls, request->controls, request->count * sizeof(struct v4l2_ext_control));
+    request_landed.count = request->count;
+    request_landed.since = request->since;
+    request_landed.sequence = sequence;
+    request_landed.reported = false;
+    request->count = 0;
+}
+
+/*
+ * Hand a buffer to the driver. With requests the buffer is bound to its
+ * request, the pending controls are set in it and the request is queued,
+ * a completed request is reused after reinit.
+ */
+static int capture_queue(unsigned int index)
+{
+    struct capture_request *request;
+    struct v4l2_ext_controls ctrls;
+    struct v4l2_buffer buf;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+
+    if (!request_active || index >= capture_nrequests)
+    {
+        return v4l2_ioctl(v4l2_dev_fd, VIDIOC_QBUF, &buf);
+    }
+
+    request = &capture_requests[index];
+    v4l2_ioctl(request->fd, MEDIA_REQUEST_IOC_REINIT, NULL);
+    request->count = 0;
+    if (request_pending_count)
+    {
+        memset(&ctrls, 0, sizeof(ctrls));
+        ctrls.which = V4L2_CTRL_WHICH_REQUEST_VAL;
+        ctrls.count = request_pending_count;
+        ctrls.controls = request_pending;
+        ctrls.request_fd = request->fd;
+        if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_S_EXT_CTRLS, &ctrls) == 0)
+        {
+            memcpy(request->controls, request_pending, request_pending_count * sizeof(struct v4l2_ext_control));
+            request->count = request_pending_count;
+            request->since = request_pending_since;
+            request_pending_count = 0;
+        }
+        else
+        {
+            request_error = request_flush() ? "controls refused in a request and at once"
+                                            : "controls refused in a request, written at once";
+        }
+    }
+
+    buf.flags = V4L2_BUF_FLAG_REQUEST_FD;
+    buf.request_fd = request->fd;
+    if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_QBUF, &buf) < 0)
+    {
+        return -1;
+    }
+    return v4l2_ioctl(request->fd, MEDIA_REQUEST_IOC_QUEUE, NULL);
+}
+
+static void capture_free_buffers()
+{
+    struct v4l2_requestbuffers req;
+    unsigned int i;
+
+    request_close();
+    for (i = 0; i < capture_nbuffers; i++)
+    {
+        munmap(capture_buffers[i].start, capture_buffers[i].length);
+    }
+    free(capture_buffers);
+    capture_buffers = NULL;
+    capture_nbuffers = 0;
+
+    memset(&req, 0, sizeof(req));
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    v4l2_ioctl(v4l2_dev_fd, VIDIOC_REQBUFS, &req);
+}
+
+static void capture_stop()
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (!capture_active)
+    {
+        return;
+    }
+    capture_active = false;
+
+    /* rows of the analysis are sized for the frame width, a restart may bring another one */
+    free(scene_row);
+    scene_row = NULL;
+    free(focus_rows);
+    focus_rows = NULL;
+
+    if (raw_file)
+    {
+        close(raw_fd);
+        raw_fd = -1;
+        free(raw_frame);
+        raw_frame = NULL;
+        return;
+    }
+
+    v4l2_ioctl(v4l2_dev_fd, VIDIOC_STREAMOFF, &type);
+    capture_free_buffers();
+}
+
+static int capture_start()
+{
+    struct v4l2_format fmt;
+    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buf;
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    unsigned int i;
+
+    if (capture_active)
+    {
+        return 1;
+    }
+
+    if (raw_file)
+    {
+        return capture_open_file();
+    }
+
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_G_FMT, &fmt) < 0)
+    {
+        return -errno;
+    }
+
+    capture_pixelformat = fmt.fmt.pix.pixelformat;
+    capture_width = fmt.fmt.pix.width;
+    capture_height = fmt.fmt.pix.height;
+    capture_bytesperline = fmt.fmt.pix.bytesperline;
+
+    if (!luma_pixel_step(capture_pixelformat))
+    {
+        return -EINVAL;
+    }
+    if (!capture_bytesperline)
+    {
+        capture_bytesperline = capture_width * luma_pixel_step(capture_pixelformat);
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.count = CAPTURE_BUFFERS;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_REQBUFS, &req) < 0)
+    {
+        return -errno;
+    }
+
+    capture_buffers = calloc(req.count, sizeof(struct capture_buffer));
+    if (!capture_buffers || req.count < 2)
+    {
+        goto err;
+    }
+
+    if (request_enabled)
+    {
+        request_open(req.count, req.capabilities);
+    }
+
+    for (i = 0; i < req.count; i++)
+    {
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_QUERYBUF, &buf) < 0)
+        {
+            goto err;
+        }
+
+        /* frames answered from a fixture have no data, only their metadata is recorded */
+        capture_buffers[i].length = buf.length;
+        capture_buffers[i].start = fixture_replay_file
+                                       ? mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                                       : mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED, v4l2_dev_fd, buf.m.offset);
+        if (capture_buffers[i].start == MAP_FAILED)
+        {
+            goto err;
+        }
+        capture_nbuffers++;
+
+        if (capture_queue(i) < 0)
+        {
+            goto err;
+        }
+    }
+
+    if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_STREAMON, &type) < 0)
+    {
+        goto err;
+    }
+
+    memset(&health, 0, sizeof(health));
+    capture_active = true;
+    return 1;
+
+err:
+    capture_free_buffers();
+    return -EINVAL;
+}
+
+/*
+ * Fetch next frame without blocking. Returns 1 when a frame is available,
+ * 0 when there is none yet and a negative value at the end of the raw
+ * file or on error. Fetched frames are handed back by capture_release().
+ */
+static int capture_next(struct capture_frame *frame)
+{
+    struct v4l2_buffer buf;
+    ssize_t len;
+
+    memset(frame, 0, sizeof(*frame));
+    frame->index = -1;
+
+    if (raw_file)
+    {
+        len = read(raw_fd, raw_frame, raw_frame_size);
+        if (len < (ssize_t)raw_frame_size)
+        {
+            return -1;
+        }
+        frame->data = raw_frame;
+        frame->bytesused = raw_frame_size;
+        frame->sequence = capture_sequence++;
+        return 1;
+    }
+
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+
+    if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_DQBUF, &buf) < 0)
+    {
+        return (errno == EAGAIN) ? 0 : -errno;
+    }
+
+    if (request_active)
+    {
+        request_done(buf.index, buf.sequence);
+    }
+
+    frame->data = capture_buffers[buf.index].start;
+    frame->bytesused = buf.bytesused;
+    frame->sequence = buf.sequence;
+    frame->timestamp_us = (uint64_t)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+    frame->index = buf.index;
+    return 1;
+}
+
+static void capture_release(struct capture_frame *frame)
+{
+    if (frame->index < 0)
+    {
+        return;
+    }
+
+    capture_queue(frame->index);
+    frame->index = -1;
+}
+
+static struct control_mapping *control_new()
+{
+    struct control_mapping *mapping;
+    int size;
+
+    if (ctrl_last >= ctrl_size)
+    {
+        size = ctrl_size ? ctrl_size * 2 : 64;
+        mapping = realloc(ctrl_mapping, size * sizeof(struct control_mapping));
+        if (!mapping)
+        {
+            printf("ERROR: Cannot allocate controls\n");
+            exit(1);
+        }
+        memset(&mapping[ctrl_size], 0, (size - ctrl_size) * sizeof(struct control_mapping));
+        ctrl_mapping = mapping;
+        ctrl_size = size;
+    }
+    return &ctrl_mapping[ctrl_last];
+}
+
+static struct control_mapping *control_by_var_name(const char *var_name)
+{
+    int i;
+
+    for (i = 0; i < ctrl_last; i++)
+    {
+        if (!strcmp(ctrl_mapping[i].var_name, var_name))
+        {
+            return &ctrl_mapping[i];
+        }
+    }
+    return NULL;
+}
+
+static uint32_t var_hash(const char *name, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Open addressing index of variable names, rebuilt when controls were added.
+ * Without memory for it var_index stays NULL and lookups scan the mapping.
+ */
+static void var_index_update()
+{
+    unsigned int slot;
+    int i;
+
+    if (var_index && var_index_count == ctrl_last)
+    {
+        return;
+    }
+
+    free(var_index);
+    var_index = NULL;
+    var_index_size = 16;
+    while (var_index_size < (unsigned int)ctrl_last * 2)
+    {
+        var_index_size *= 2;
+    }
+    var_index = malloc(var_index_size * sizeof(int));
+    if (var_index == NULL)
+    {
+        return;
+    }
+    memset(var_index, -1, var_index_size * sizeof(int));
+
+    for (i = 0; i < ctrl_last; i++)
+    {
+        slot = var_hash(ctrl_mapping[i].var_name, strlen(ctrl_mapping[i].var_name)) & (var_index_size - 1);
+        while (var_index[slot] >= 0)
+        {
+            slot = (slot + 1) & (var_index_size - 1);
+        }
+        var_index[slot] = i;
+    }
+    var_index_count = ctrl_last;
+}
+
+/* lookup of a name that is not terminated, e.g. a span in a mapped config file */
+static struct control_mapping *control_by_var_span(const char *name, size_t length)
+{
+    unsigned int slot;
+    const char *var_name;
+    int i;
+
+    var_index_update();
+
+    if (var_index == NULL)
+    {
+        for (i = 0; i < ctrl_last; i++)
+        {
+            var_name = ctrl_mapping[i].var_name;
+            if (!strncmp(var_name, name, length) && var_name[length] == '\0')
+            {
+                return &ctrl_mapping[i];
+            }
+        }
+        return NULL;
+    }
+
+    slot = var_hash(name, length) & (var_index_size - 1);
+    while (var_index[slot] >= 0)
+    {
+        var_name = ctrl_mapping[var_index[slot]].var_name;
+        if (!strncmp(var_name, name, length) && var_name[length] == '\0')
+        {
+            return &ctrl_mapping[var_index[slot]];
+        }
+        slot = (slot + 1) & (var_index_size - 1);
+    }
+    return NULL;
+}
+
+static void search_free()
+{
+    int i;
+
+    for (i = 0; i < search_count; i++)
+    {
+        free(search_texts[i]);
+    }
+    free(search_texts);
+    free(search_grams);
+    free(search_postings);
+    free(search_slots);
+    free(search_match);
+    free(search_candidates);
+    search_texts = NULL;
+    search_grams = NULL;
+    search_postings = NULL;
+    search_slots = NULL;
+    search_match = NULL;
+    search_candidates = NULL;
+    search_count = 0;
+}
+
+static int search_pair_sort(const void *a, const void *b)
+{
+    const uint64_t *pa = (const uint64_t *)a;
+    const uint64_t *pb = (const uint64_t *)b;
+
+    return *pa < *pb ? -1 : *pa > *pb;
+}
+
+static uint32_t search_gram_key(const char *text)
+{
+    return (unsigned char)text[0] << 16 | (unsigned char)text[1] << 8 | (unsigned char)text[2];
+}
+
+static int search_gram_find(uint32_t key)
+{
+    unsigned int slot = (key * 2654435761u) & (search_slot_count - 1);
+
+    while (search_slots[slot] >= 0)
+    {
+        if (search_grams[search_slots[slot]].key == key)
+        {
+            return search_slots[slot];
+        }
+        slot = (slot + 1) & (search_slot_count - 1);
+    }
+    return -1;
+}
+
+/*
+ * Trigram index of "var_name display name" in lower case, rebuilt when
+ * controls were added. Trigrams do not cross word boundaries, posting
+ * lists hold each control once and in ascending order.
+ */
+static void search_index_update()
+{
+    uint64_t *pairs;
+    unsigned int slot;
+    size_t length;
+    char *text;
+    int words = (ctrl_last + 63) / 64;
+    int pair_count = 0;
+    int gram_count = 0;
+    int i;
+    int j;
+
+    if (search_texts && search_count == ctrl_last)
+    {
+        return;
+    }
+    search_free();
+
+    search_texts = calloc(ctrl_last + 1, sizeof(char *));
+    search_match = calloc(words + 1, sizeof(uint64_t));
+    search_candidates = calloc(words + 1, sizeof(uint64_t));
+    length = 0;
+    for (i = 0; i < ctrl_last; i++)
+    {
+        length += strlen(ctrl_mapping[i].var_name) + strlen(ctrl_mapping[i].name) + 2;
+    }
+    pairs = malloc((length + 1) * sizeof(uint64_t));
+    if (search_texts == NULL || search_match == NULL || search_candidates == NULL || pairs == NULL)
+    {
+        free(pairs);
+        search_free();
+        return;
+    }
+    search_count = ctrl_last;
+
+    for (i = 0; i < ctrl_last; i++)
+    {
+        length = strlen(ctrl_mapping[i].var_name) + strlen(ctrl_mapping[i].name) + 2;
+        text = malloc(length);
+        if (text == NULL)
+        {
+            continue;
+        }
+        snprintf(text, length, "%s %s", ctrl_mapping[i].var_name, ctrl_mapping[i].name);
+        for (j = 0; text[j]; j++)
+        {
+            text[j] = tolower((unsigned char)text[j]);
+        }
+        search_texts[i] = text;
+
+        for (j = 0; text[j] && text[j + 1] && text[j + 2]; j++)
+        {
+            if (isalnum((unsigned char)text[j]) && isalnum((unsigned char)text[j + 1]) &&
+                isalnum((unsigned char)text[j + 2]))
+            {
+                pairs[pair_count++] = (uint64_t)search_gram_key(&text[j]) << 32 | (uint32_t)i;
+            }
+        }
+    }
+
+    /* sorted by trigram, then control, duplicates are adjacent */
+    qsort(pairs, pair_count, sizeof(uint64_t), search_pair_sort);
+    search_grams = malloc((pair_count + 1) * sizeof(struct search_gram));
+    search_postings = malloc((pair_count + 1) * sizeof(int));
+    if (search_grams == NULL || search_postings == NULL)
+    {
+        free(pairs);
+        search_free();
+        return;
+    }
+    for (i = 0, j = 0; i < pair_count; i++)
+    {
+        if (i && pairs[i] == pairs[i - 1])
+        {
+            continue;
+        }
+        if (!gram_count || search_grams[gram_count - 1].key != (uint32_t)(pairs[i] >> 32))
+        {
+            search_grams[gram_count].key = (uint32_t)(pairs[i] >> 32);
+            search_grams[gram_count].start = j;
+            search_grams[gram_count].count = 0;
+            gram_count++;
+        }
+        search_postings[j++] = (int)(uint32_t)pairs[i];
+        search_grams[gram_count - 1].count++;
+    }
+    free(pairs);
+
+    search_slot_count = 16;
+    while (search_slot_count < (unsigned int)gram_count * 2)
+    {
+        search_slot_count *= 2;
+    }
+    search_slots = malloc(search_slot_count * sizeof(int));
+    if (search_slots == NULL)
+    {
+        search_free();
+        return;
+    }
+    memset(search_slots, -1, search_slot_count * sizeof(int));
+    for (i = 0; i < gram_count; i++)
+    {
+        slot = (search_grams[i].key * 2654435761u) & (search_slot_count - 1);
+        while (search_slots[slot] >= 0)
+        {
+            slot = (slot + 1) & (search_slot_count - 1);
+        }
+        search_slots[slot] = i;
+    }
+}
+
+/* controls containing every word of the query in any order, words of three or more letters narrowed by the index */
+static void search_update()
+{
+    uint64_t start = monotonic_us();
+    const struct search_gram *gram;
+    char word[SEARCH_QUERY_MAX + 1];
+    int words = (search_count + 63) / 64;
+    const char *query;
+    int length;
+    int found;
+    int i;
+    int k;
+
+    search_index_update();
+    if (search_texts == NULL)
+    {
+        return;
+    }
+    memset(search_match, 0xff, words * sizeof(uint64_t));
+
+    for (query = search_query; *query; query += length)
+    {
+        for (length = 0; query[length] && isalnum((unsigned char)query[length]); length++)
+        {
+        }
+        if (length == 0)
+        {
+            length = 1;
+            continue;
+        }
+        for (i = 0; i + 2 < length; i++)
+        {
+            found = search_gram_find(search_gram_key(&query[i]));
+            if (found < 0)
+            {
+                memset(search_match, 0, words * sizeof(uint64_t));
+                break;
+            }
+            gram = &search_grams[found];
+            memset(search_candidates, 0, words * sizeof(uint64_t));
+            for (k = 0; k < gram->count; k++)
+            {
+                search_candidates[search_postings[gram->start + k] / 64] |=
+                    1ull << (search_postings[gram->start + k] % 64);
+            }
+            for (k = 0; k < words; k++)
+            {
+                search_match[k] &= search_candidates[k];
+            }
+        }
+    }
+
+    /* trigrams may come from different places, the words are checked on the remaining controls */
+    for (i = 0; i < search_count; i++)
+    {
+        if (!(search_match[i / 64] & (1ull << (i % 64))))
+        {
+            continue;
+        }
+        for (query = search_query; *query; query += length)
+        {
+            for (length = 0; query[length] && isalnum((unsigned char)query[length]); length++)
+            {
+                word[length] = query[length];
+            }
+            if (length == 0)
+            {
+                length = 1;
+                continue;
+            }
+            word[length] = '\0';
+            if (search_texts[i] == NULL || strstr(search_texts[i], word) == NULL)
+            {
+                search_match[i / 64] &= ~(1ull << (i % 64));
+                break;
+            }
+        }
+    }
+    search_us = (long)(monotonic_us() - start);
+}
+
+static bool search_active()
+{
+    return search_typing || search_len;
+}
+
+static bool search_matched(int index)
+{
+    return index < search_count && (search_match[index / 64] & (1ull << (index % 64)));
+}
+
+static void control_options_free(struct control_mapping *mapping)
+{
+    int i;
+
+    if (mapping->options)
+    {
+        for (i = 0; i <= mapping->maximum - mapping->minimum; i++)
+        {
+            free(mapping->options[i].name);
+        }
+        free(mapping->options);
+    }
+    mapping->options = NULL;
+    mapping->hasoptions = false;
+}
+
+/* controls the device does not use right now stay in the mapping but not in the list */
+static bool control_hidden(const struct control_mapping *mapping)
+{
+    return mapping->entry_type == V4L2_CONTROL &&
+           (mapping->flags & (V4L2_CTRL_FLAG_INACTIVE | V4L2_CTRL_FLAG_DISABLED));
+}
+
+/* node the control belongs to, controls of sub-devices are not reachable through the video node */
+static int control_fd(const struct control_mapping *mapping)
+{
+    return mapping->source ? media_sources[mapping->source].fd : v4l2_dev_fd;
+}
+
+/* rows shown in menu_win, active_control keeps pointing to the same control if it stays visible */
+static void control_view_update()
+{
+    int current = view_last ? ctrl_view[active_control] : -1;
+    int i;
+
+    ctrl_view = realloc(ctrl_view, ctrl_size * sizeof(int));
+    view_last = 0;
+
+    /* the search spans all tabs and stays applied while controls come and go */
+    if (search_active() && search_count != ctrl_last)
+    {
+        search_update();
+    }
+
+    for (i = 0; i < ctrl_last; i++)
+    {
+        if (ctrl_mapping[i].unsupported || control_hidden(&ctrl_mapping[i]))
+        {
+            continue;
+        }
+        if (search_active() ? !search_matched(i)
+                            : (class_count && (ctrl_mapping[i].ctrl_class != ctrl_classes[active_class].id ||
+                                                ctrl_mapping[i].source != ctrl_classes[active_class].source)))
+        {
+            continue;
+        }
+        if (i == current)
+        {
+            active_control = view_last;
+        }
+        ctrl_view[view_last++] = i;
+    }
+    active_control = clamp(active_control, 0, view_last ? view_last - 1 : 0);
+}
+
+static struct control_mapping *control_active()
+{
+    static struct control_mapping no_control = {.name = "", .var_name = ""};
+
+    return view_last ? &ctrl_mapping[ctrl_view[active_control]] : &no_control;
+}
+
+static int format_index(unsigned int pixelformat)
+{
+    int i;
+
+    for (i = 0; i < format_count; i++)
+    {
+        if (formats[i].pixelformat == pixelformat)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void v4l2_enum_formats()
+{
+    struct v4l2_fmtdesc fmtdesc;
+    struct pixel_format *grown;
+
+    memset(&fmtdesc, 0, sizeof(fmtdesc));
+    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    while (v4l2_ioctl(v4l2_dev_fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0)
+    {
+        grown = realloc(formats, (format_count + 1) * sizeof(struct pixel_format));
+        if (grown == NULL)
+        {
+            break;
+        }
+        formats = grown;
+        memset(&formats[format_count], 0, sizeof(struct pixel_format));
+        formats[format_count].pixelformat = fmtdesc.pixelformat;
+        formats[format_count].size_count = -1;
+        format_count++;
+        fmtdesc.index++;
+    }
+}
+
+static int sort_sizes(const void *v1, const void *v2)
+{
+    const struct frame_size *s1 = (struct frame_size *)v1;
+    const struct frame_size *s2 = (struct frame_size *)v2;
+    unsigned long area1 = (unsigned long)s1->width * s1->height;
+    unsigned long area2 = (unsigned long)s2->width * s2->height;
+
+    if (area1 != area2)
+    {
+        return (area1 > area2) - (area1 < area2);
+    }
+    return (s1->width > s2->width) - (s1->width < s2->width);
+}
+
+/* returns false when the table cannot grow, the sizes found so far stay */
+static bool frame_size_add(struct pixel_format *pf, unsigned int width, unsigned int height)
+{
+    struct frame_size *grown;
+    int i;
+
+    for (i = 0; i < pf->size_count; i++)
+    {
+        if (pf->sizes[i].width == width && pf->sizes[i].height == height)
+        {
+            return true;
+        }
+    }
+    grown = realloc(pf->sizes, (pf->size_count + 1) * sizeof(struct frame_size));
+    if (grown == NULL)
+    {
+        return false;
+    }
+    pf->sizes = grown;
+    memset(&pf->sizes[pf->size_count], 0, sizeof(struct frame_size));
+    pf->sizes[pf->size_count].width = width;
+    pf->sizes[pf->size_count].height = height;
+    pf->size_count++;
+    return true;
+}
+
+/* frame sizes of a format are enumerated on first use and kept */
+static void v4l2_enum_sizes(struct pixel_format *pf)
+{
+    struct v4l2_frmsizeenum fsize;
+    struct v4l2_frmsize_stepwise *sw;
+    unsigned int i;
+
+    if (pf->size_count >= 0)
+    {
+        return;
+    }
+    pf->size_count = 0;
+
+    memset(&fsize, 0, sizeof(fsize));
+    fsize.pixel_format = pf->pixelformat;
+
+    while (v4l2_ioctl(v4l2_dev_fd, VIDIOC_ENUM_FRAMESIZES, &fsize) == 0)
+    {
+        if (fsize.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+        {
+            if (!frame_size_add(pf, fsize.discrete.width, fsize.discrete.height))
+            {
+                break;
+            }
+            fsize.index++;
+            continue;
+        }
+
+        sw = &fsize.stepwise;
+        for (i = 0; i < sizeof(frame_standard_sizes) / sizeof(frame_standard_sizes[0]); i++)
+        {
+            if (frame_standard_sizes[i][0] >= sw->min_width && frame_standard_sizes[i][0] <= sw->max_width &&
+                frame_standard_sizes[i][1] >= sw->min_height && frame_standard_sizes[i][1] <= sw->max_height &&
+                (!sw->step_width || (frame_standard_sizes[i][0] - sw->min_width) % sw->step_width == 0) &&
+                (!sw->step_height || (frame_standard_sizes[i][1] - sw->min_height) % sw->step_height == 0) &&
+                !frame_size_add(pf, frame_standard_sizes[i][0], frame_standard_sizes[i][1]))
+            {
+                break;
+            }
+        }
+        break;
+    }
+
+    if (pf->pixelformat == v4l2_dev_pixelformat && v4l2_dev_width && v4l2_dev_height)
+    {
+        frame_size_add(pf, v4l2_dev_width, v4l2_dev_height);
+    }
+
+    qsort(pf->sizes, pf->size_count, sizeof(struct frame_size), sort_sizes);
+}
+
+static int frame_size_index(struct pixel_format *pf, unsigned int width, unsigned int height)
+{
+    int i;
+
+    for (i = 0; i < pf->size_count; i++)
+    {
+        if (pf->sizes[i].width == width && pf->sizes[i].height == height)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static struct frame_size *frame_size_current()
+{
+    int fi = format_index(v4l2_dev_pixelformat);
+    int si;
+
+    if (fi < 0)
+    {
+        return NULL;
+    }
+    v4l2_enum_sizes(&formats[fi]);
+    si = frame_size_index(&formats[fi], v4l2_dev_width, v4l2_dev_height);
+    return si < 0 ? NULL : &formats[fi].sizes[si];
+}
+
+static void formats_free()
+{
+    int i;
+    int j;
+
+    for (i = 0; i < format_count; i++)
+    {
+        for (j = 0; j < formats[i].size_count; j++)
+        {
+            free(formats[i].sizes[j].intervals);
+        }
+        free(formats[i].sizes);
+    }
+    free(formats);
+    formats = NULL;
+    format_count = 0;
+}
+
+static const unsigned int fps_standard_rates[] = {1, 2, 5, 10, 15, 20, 24, 25, 30, 50, 60, 90, 100, 120};
+
+static bool fract_equal(const struct v4l2_fract *a, const struct v4l2_fract *b)
+{
+    return (uint64_t)a->numerator * b->denominator == (uint64_t)b->numerator * a->denominator;
+}
+
+static double fract_fps(const struct v4l2_fract *tf)
+{
+    return tf->numerator ? 1.0 * tf->denominator / tf->numerator : 0;
+}
+
+static int sort_intervals(const void *v1, const void *v2)
+{
+    double fps1 = fract_fps((const struct v4l2_fract *)v1);
+    double fps2 = fract_fps((const struct v4l2_fract *)v2);
+
+    return (fps1 > fps2) - (fps1 < fps2);
+}
+
+static void fps_interval_add(struct v4l2_fract *tf)
+{
+    int i;
+
+    if (!tf->numerator || !tf->denominator || fps_interval_count >= FPS_INTERVALS_MAX)
+    {
+        return;
+    }
+    for (i = 0; i < fps_interval_count; i++)
+    {
+        if (fract_equal(&fps_intervals[i], tf))
+        {
+            return;
+        }
+    }
+    fps_intervals[fps_interval_count++] = *tf;
+}
+
+/*
+ * Enumerate frame intervals for current format and resolution once.
+ * Stepwise and continuous ranges are represented by standard rates up
+ * to fps_max, devices without enumeration get the 1..fps_max range.
+ */
+static void v4l2_enum_intervals()
+{
+    struct frame_size *size = frame_size_current();
+    struct v4l2_frmivalenum ival;
+    struct v4l2_fract tf;
+    double fps_min_range;
+    double fps_max_range;
+    unsigned int i;
+
+    fps_interval_count = 0;
+
+    if (size && size->intervals)
+    {
+        memcpy(fps_intervals, size->intervals, size->interval_count * sizeof(struct v4l2_fract));
+        fps_interval_count = size->interval_count;
+        return;
+    }
+
+    memset(&ival, 0, sizeof(ival));
+    ival.pixel_format = v4l2_dev_pixelformat;
+    ival.width = v4l2_dev_width;
+    ival.height = v4l2_dev_height;
+
+    while (v4l2_ioctl(v4l2_dev_fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0)
+    {
+        if (ival.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+        {
+            fps_interval_add(&ival.discrete);
+            ival.index++;
+            continue;
+        }
+
+        fps_min_range = fract_fps(&ival.stepwise.max);
+        fps_max_range = fract_fps(&ival.stepwise.min);
+        for (i = 0; i < sizeof(fps_standard_rates) / sizeof(fps_standard_rates[0]); i++)
+        {
+            if (fps_standard_rates[i] >= fps_min_range && fps_standard_rates[i] <= fps_max_range &&
+                (int)fps_standard_rates[i] <= fps_max)
+            {
+                tf.numerator = 1;
+                tf.denominator = fps_standard_rates[i];
+                fps_interval_add(&tf);
+            }
+        }
+        break;
+    }
+
+    if (!fps_interval_count)
+    {
+        for (i = 1; i <= (unsigned int)fps_max; i++)
+        {
+            tf.numerator = 1;
+            tf.denominator = i;
+            fps_interval_add(&tf);
+        }
+    }
+
+    qsort(fps_intervals, fps_interval_count, sizeof(struct v4l2_fract), sort_intervals);
+
+    if (size)
+    {
+        size->intervals = malloc(fps_interval_count * sizeof(struct v4l2_fract));
+        if (size->intervals)
+        {
+            memcpy(size->intervals, fps_intervals, fps_interval_count * sizeof(struct v4l2_fract));
+            size->interval_count = fps_interval_count;
+        }
+    }
+}
+
+/* index of exact or nearest cached interval */
+static int fps_interval_index(const struct v4l2_fract *tf)
+{
+    double fps = fract_fps(tf);
+    double diff;
+    double best_diff = 0;
+    int best = 0;
+    int i;
+
+    for (i = 0; i < fps_interval_count; i++)
+    {
+        if (fract_equal(&fps_intervals[i], tf))
+        {
+            return i;
+        }
+        diff = fract_fps(&fps_intervals[i]) - fps;
+        diff = diff < 0 ? -diff : diff;
+        if (i == 0 || diff < best_diff)
+        {
+            best_diff = diff;
+            best = i;
+        }
+    }
+    return best;
+}
+
+static int v4l2_fps_get()
+{
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_G_PARM, &parm) == 0 &&
+        parm.parm.capture.timeperframe.numerator &&
+        parm.parm.capture.timeperframe.denominator)
+    {
+        return fps_interval_index(&parm.parm.capture.timeperframe);
+    }
+    return fps_interval_index(&fps_default_interval);
+}
+
+static int v4l2_fps_set(int index)
+{
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+
+    if (index < 0 || index >= fps_interval_count)
+    {
+        return v4l2_fps_get();
+    }
+
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe = fps_intervals[index];
+
+    if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_S_PARM, &parm) == 0 &&
+        parm.parm.capture.timeperframe.numerator &&
+        parm.parm.capture.timeperframe.denominator)
+    {
+        return fps_interval_index(&parm.parm.capture.timeperframe);
+    }
+    return v4l2_fps_get();
+}
+
+static void fps_update_options(struct control_mapping *mapping)
+{
+    char fps_name[16];
+    double fps;
+    int i;
+
+    control_options_free(mapping);
+
+    mapping->options = calloc(fps_interval_count, sizeof(struct control_option));
+    for (i = 0; i < fps_interval_count && mapping->options; i++)
+    {
+        fps = fract_fps(&fps_intervals[i]);
+        if (fps_intervals[i].denominator % fps_intervals[i].numerator)
+        {
+            snprintf(fps_name, sizeof(fps_name), "%.2f", fps);
+        }
+        else
+        {
+            snprintf(fps_name, sizeof(fps_name), "%.0f", fps);
+        }
+        mapping->options[i].index = i;
+        mapping->options[i].value = (int)(fps + 0.5);
+        mapping->options[i].name = strdup(fps_name);
+    }
+
+    mapping->value = v4l2_fps_get();
+    mapping->minimum = 0;
+    mapping->maximum = fps_interval_count - 1;
+    mapping->default_value = fps_interval_index(&fps_default_interval);
+    mapping->hasoptions = mapping->options != NULL;
+}
+
+static void v4l2_init_fps()
+{
+    struct control_mapping *cm = control_new();
+
+    v4l2_enum_intervals();
+
+    cm->entry_type = V4L2_PARAM;
+    cm->id = PARAM_FPS;
+    cm->name = "FPS";
+    cm->var_name = "fps";
+    cm->control_type = 0;
+    cm->step = 1;
+    fps_update_options(cm);
+    ctrl_last++;
+}
+
+/* config files keep integer fps, the control itself steps through interval indexes */
+static int control_file_value(struct control_mapping *mapping)
+{
+    if (mapping->entry_type == V4L2_PARAM && !strcmp(mapping->var_name, "fps") && mapping->hasoptions)
+    {
+        return mapping->options[mapping->value].value;
+    }
+    return mapping->value;
+}
+
+/*
+ * Seqlock writer of the -s segment. The sequence is odd while values are
+ * written, names and ids of new controls are appended before the count
+ * grows so readers can look them up without the lock.
+ */
+static void shm_publish()
+{
+    uint32_t sequence;
+    uint32_t count;
+    uint32_t i;
+    bool changed;
+
+    if (shm_state == NULL)
+    {
+        return;
+    }
+
+    count = ctrl_last < CAMERA_CTL_SHM_CONTROLS ? ctrl_last : CAMERA_CTL_SHM_CONTROLS;
+    changed = count != shm_state->count;
+    for (i = 0; i < count && !changed; i++)
+    {
+        changed = shm_state->values[i] != control_file_value(&ctrl_mapping[i]);
+    }
+    if (!changed)
+    {
+        return;
+    }
+
+    sequence = shm_state->sequence;
+    __atomic_store_n(&shm_state->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (i = shm_state->count; i < count; i++)
+    {
+        shm_state->ids[i] = ctrl_mapping[i].id;
+        snprintf(shm_state->names[i], CAMERA_CTL_SHM_NAME_MAX, "%s", ctrl_mapping[i].var_name);
+    }
+    for (i = 0; i < count; i++)
+    {
+        __atomic_store_n(&shm_state->values[i], control_file_value(&ctrl_mapping[i]), __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&shm_state->generation, shm_state->generation + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&shm_state->count, count, __ATOMIC_RELEASE);
+    __atomic_store_n(&shm_state->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* readers find the segment as /dev/shm/<name>, it is removed on exit */
+static int shm_create()
+{
+    uint32_t sequence;
+    int fd;
+
+    snprintf(shm_path, sizeof(shm_path), "/%s", shm_name);
+    fd = shm_open(shm_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        printf("ERROR: Cannot create shared memory %s: %s (%d)\n", shm_path, strerror(errno), errno);
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(struct camera_ctl_shm)) < 0)
+    {
+        printf("ERROR: Cannot resize shared memory %s: %s (%d)\n", shm_path, strerror(errno), errno);
+        close(fd);
+        shm_unlink(shm_path);
+        return -1;
+    }
+    shm_state = mmap(NULL, sizeof(struct camera_ctl_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm_state == MAP_FAILED)
+    {
+        printf("ERROR: Cannot map shared memory %s: %s (%d)\n", shm_path, strerror(errno), errno);
+        shm_state = NULL;
+        shm_unlink(shm_path);
+        return -1;
+    }
+
+    /* a segment left by an earlier run keeps its generation, readers still mapping it see the change */
+    sequence = shm_state->sequence & ~1u;
+    __atomic_store_n(&shm_state->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    shm_state->magic = CAMERA_CTL_SHM_MAGIC;
+    shm_state->version = CAMERA_CTL_SHM_VERSION;
+    __atomic_store_n(&shm_state->count, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&shm_state->sequence, sequence + 2, __ATOMIC_RELEASE);
+
+    shm_publish();
+    return 0;
+}
+
+static void shm_close()
+{
+    if (shm_state)
+    {
+        munmap(shm_state, sizeof(struct camera_ctl_shm));
+        shm_state = NULL;
+        shm_unlink(shm_path);
+    }
+}
+
+static int control_value_from_file(struct control_mapping *mapping, int value)
+{
+    struct v4l2_fract tf = {1, value};
+
+    if (mapping->entry_type == V4L2_PARAM && !strcmp(mapping->var_name, "fps"))
+    {
+        return value > 0 ? fps_interval_index(&tf) : mapping->value;
+    }
+    return value;
+}
+
+static int v4l2_set_ctrl_value(int fd, int id, int value)
+{
+    struct v4l2_ext_control item;
+    struct v4l2_control control;
+
+    if (request_active && fd == v4l2_dev_fd)
+    {
+        memset(&item, 0, sizeof(item));
+        item.id = id;
+        item.value = value;
+        return request_add(&item, 1);
+    }
+
+    memset(&control, 0, sizeof(control));
+    control.id = id;
+    control.value = value;
+
+    if (v4l2_ioctl(fd, VIDIOC_S_CTRL, &control) < 0)
+    {
+        if (errno == ENODEV)
+        {
+            device_check_us = 0;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/* config files use the driver names the way v4l2-ctl does, canonical names are accepted as aliases */
+static char *name2var(char *name)
+{
+    char out_name[sizeof(((struct v4l2_queryctrl *)0)->name) * 2];
+    bool add_underscore = false;
+    size_t len = 0;
+
+    for (; *name && len < sizeof(out_name) - 2; name++)
+    {
+        if (isalnum((unsigned char)*name))
+        {
+            if (add_underscore)
+            {
+                out_name[len++] = '_';
+                add_underscore = false;
+            }
+            out_name[len++] = tolower((unsigned char)*name);
+        }
+        else
+        {
+            add_underscore = true;
+        }
+    }
+    out_name[len] = '\0';
+    return strdup(out_name);
+}
+
+/* id and name indexes of the generated table, built on first use */
+static void control_info_init()
+{
+    unsigned int slot;
+    unsigned int i;
+
+    memset(control_info_ids, -1, sizeof(control_info_ids));
+    memset(control_info_names, -1, sizeof(control_info_names));
+
+    for (i = 0; i < CONTROL_INFO_COUNT; i++)
+    {
+        slot = (control_table[i].id * 2654435761u) & (CONTROL_INFO_SLOTS - 1);
+        while (control_info_ids[slot] >= 0)
+        {
+            slot = (slot + 1) & (CONTROL_INFO_SLOTS - 1);
+        }
+        control_info_ids[slot] = i;
+
+        slot = var_hash(control_table[i].var_name, strlen(control_table[i].var_name)) & (CONTROL_INFO_SLOTS - 1);
+        while (control_info_names[slot] >= 0)
+        {
+            slot = (slot + 1) & (CONTROL_INFO_SLOTS - 1);
+        }
+        control_info_names[slot] = i;
+    }
+    control_info_ready = true;
+}
+
+static const struct control_info *control_info_find(unsigned int id)
+{
+    unsigned int slot;
+
+    if (!control_info_ready)
+    {
+        control_info_init();
+    }
+
+    slot = (id * 2654435761u) & (CONTROL_INFO_SLOTS - 1);
+    while (control_info_ids[slot] >= 0)
+    {
+        if (control_table[control_info_ids[slot]].id == id)
+        {
+            return &control_table[control_info_ids[slot]];
+        }
+        slot = (slot + 1) & (CONTROL_INFO_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/* canonical names work in config files on every driver */
+static const struct control_info *control_info_by_name(const char *name, size_t length)
+{
+    const char *var_name;
+    unsigned int slot;
+
+    if (!control_info_ready)
+    {
+        control_info_init();
+    }
+
+    slot = var_hash(name, length) & (CONTROL_INFO_SLOTS - 1);
+    while (control_info_names[slot] >= 0)
+    {
+        var_name = control_table[control_info_names[slot]].var_name;
+        if (!strncmp(var_name, name, length) && var_name[length] == '\0')
+        {
+            return &control_table[control_info_names[slot]];
+        }
+        slot = (slot + 1) & (CONTROL_INFO_SLOTS - 1);
+    }
+    return NULL;
+}
+
+static unsigned int format_codecs(unsigned int pixelformat)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(codec_formats) / sizeof(codec_formats[0]); i++)
+    {
+        if (codec_formats[i].pixelformat == pixelformat)
+        {
+            return codec_formats[i].codecs;
+        }
+    }
+    return 0;
+}
+
+static bool v4l2_check_supported_control(int control_id)
+{
+    const struct control_info *info = control_info_find(control_id);
+
+    return info == NULL || !info->codecs || (info->codecs & format_codecs(v4l2_dev_pixelformat));
+}
+
+static void v4l2_format_info()
+{
+    struct v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_G_FMT, &fmt) < 0)
+    {
+        return;
+    }
+    v4l2_dev_pixelformat = fmt.fmt.pix.pixelformat;
+    v4l2_dev_width = fmt.fmt.pix.width;
+    v4l2_dev_height = fmt.fmt.pix.height;
+}
+
+/* re-evaluate codec dependent controls after format change without enumerating them again */
+static void control_filter_update()
+{
+    struct v4l2_control control;
+    bool unsupported;
+    int i;
+
+    for (i = 0; i < ctrl_last && disable_unsupported_controls; i++)
+    {
+        if (ctrl_mapping[i].entry_type != V4L2_CONTROL)
+        {
+            continue;
+        }
+
+        unsupported = !v4l2_check_supported_control(ctrl_mapping[i].id);
+        if (ctrl_mapping[i].unsupported && !unsupported)
+        {
+            memset(&control, 0, sizeof(control));
+            control.id = ctrl_mapping[i].id;
+            if (v4l2_ioctl(control_fd(&ctrl_mapping[i]), VIDIOC_G_CTRL, &control) == 0)
+            {
+                ctrl_mapping[i].value = control.value;
+            }
+        }
+        ctrl_mapping[i].unsupported = unsupported;
+    }
+    control_view_update();
+    layout_changed = true;
+}
+
+static void size_update_options(struct control_mapping *mapping)
+{
+    struct pixel_format *pf;
+    char size_name[24];
+    int fi = format_index(v4l2_dev_pixelformat);
+    int i;
+
+    control_options_free(mapping);
+    mapping->value = 0;
+    mapping->minimum = 0;
+    mapping->maximum = 0;
+
+    if (fi < 0)
+    {
+        return;
+    }
+
+    pf = &formats[fi];
+    v4l2_enum_sizes(pf);
+    if (!pf->size_count)
+    {
+        return;
+    }
+
+    mapping->options = calloc(pf->size_count, sizeof(struct control_option));
+    for (i = 0; i < pf->size_count && mapping->options; i++)
+    {
+        snprintf(size_name, sizeof(size_name), "%ux%u", pf->sizes[i].width, pf->sizes[i].height);
+        mapping->options[i].index = i;
+        mapping->options[i].value = i;
+        mapping->options[i].name = strdup(size_name);
+    }
+
+    i = frame_size_index(pf, v4l2_dev_width, v4l2_dev_height);
+    mapping->value = i < 0 ? 0 : i;
+    mapping->maximum = pf->size_count - 1;
+    mapping->hasoptions = mapping->options != NULL;
+}
+
+static void v4l2_format_changed()
+{
+    struct control_mapping *cm;
+    int fi = format_index(v4l2_dev_pixelformat);
+
+    if ((cm = control_by_var_name("pixel_format")) && fi >= 0)
+    {
+        cm->value = fi;
+    }
+    if ((cm = control_by_var_name("resolution")))
+    {
+        size_update_options(cm);
+    }
+    if ((cm = control_by_var_name("fps")))
+    {
+        v4l2_enum_intervals();
+        fps_update_options(cm);
+    }
+    control_filter_update();
+}
+
+static int v4l2_set_format(unsigned int pixelformat, unsigned int width, unsigned int height)
+{
+    struct v4l2_format fmt;
+    bool restart = capture_active;
+    int ret;
+
+    if (pixelformat == v4l2_dev_pixelformat && width == v4l2_dev_width && height == v4l2_dev_height)
+    {
+        return 0;
+    }
+
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_G_FMT, &fmt) < 0)
+    {
+        return -errno;
+    }
+
+    fmt.fmt.pix.pixelformat = pixelformat;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+
+    if (restart)
+    {
+        capture_stop();
+    }
+
+    ret = v4l2_ioctl(v4l2_dev_fd, VIDIOC_S_FMT, &fmt) < 0 ? -errno : 0;
+    if (ret < 0 && ui_initialized)
+    {
+        mvprintw(0, 20, "%*s", 60, " ");
+        mvprintw(0, 20, "Format change failed: %s", strerror(-ret));
+        ui_refresh();
+    }
+
+    v4l2_format_info();
+    v4l2_format_changed();
+
+    if (restart)
+    {
+        capture_start();
+    }
+    return ret;
+}
+
+static void v4l2_format_select(int index)
+{
+    struct pixel_format *pf;
+    int si;
+
+    if (index < 0 || index >= format_count)
+    {
+        return;
+    }
+
+    pf = &formats[index];
+    v4l2_enum_sizes(pf);
+
+    /* keep resolution when the new format has it, otherwise take the largest one */
+    si = frame_size_index(pf, v4l2_dev_width, v4l2_dev_height);
+    if (si < 0)
+    {
+        si = pf->size_count - 1;
+    }
+
+    if (si < 0)
+    {
+        v4l2_set_format(pf->pixelformat, v4l2_dev_width, v4l2_dev_height);
+    }
+    else
+    {
+        v4l2_set_format(pf->pixelformat, pf->sizes[si].width, pf->sizes[si].height);
+    }
+}
+
+static void v4l2_size_select(int index)
+{
+    int fi = format_index(v4l2_dev_pixelformat);
+
+    if (fi < 0 || index < 0 || index >= formats[fi].size_count)
+    {
+        return;
+    }
+    v4l2_set_format(v4l2_dev_pixelformat, formats[fi].sizes[index].width, formats[fi].sizes[index].height);
+}
+
+static void v4l2_init_format()
+{
+    struct control_mapping *cm;
+    char fourcc[5];
+    int fi;
+    int i;
+
+    v4l2_enum_formats();
+
+    fi = format_index(v4l2_dev_pixelformat);
+    if (fi < 0)
+    {
+        return;
+    }
+
+    cm = control_new();
+    cm->entry_type = V4L2_PARAM;
+    cm->id = PARAM_PIXEL_FORMAT;
+    cm->name = "Pixel format";
+    cm->var_name = "pixel_format";
+    cm->options = calloc(format_count, sizeof(struct control_option));
+    for (i = 0; i < format_count && cm->options; i++)
+    {
+        snprintf(fourcc, sizeof(fourcc), "%c%c%c%c", pixfmtstr(formats[i].pixelformat));
+        cm->options[i].index = i;
+        cm->options[i].value = i;
+        cm->options[i].name = strdup(fourcc);
+    }
+    cm->value = fi;
+    cm->minimum = 0;
+    cm->maximum = format_count - 1;
+    cm->step = 1;
+    cm->default_value = fi;
+    cm->hasoptions = cm->options != NULL;
+    ctrl_last++;
+
+    cm = control_new();
+    cm->entry_type = V4L2_PARAM;
+    cm->id = PARAM_RESOLUTION;
+    cm->name = "Resolution";
+    cm->var_name = "resolution";
+    cm->step = 1;
+    size_update_options(cm);
+    cm->default_value = cm->value;
+    ctrl_last++;
+}
+
+/* stream format belongs to the streaming application, it is not kept in config files */
+static bool control_is_persistent(struct control_mapping *mapping)
+{
+    return !mapping->unsupported && !(mapping->flags & V4L2_CTRL_FLAG_DISABLED) &&
+           (mapping->entry_type == V4L2_CONTROL || !strcmp(mapping->var_name, "fps"));
+}
+
+static struct control_mapping *control_by_id(unsigned int id)
+{
+    int i;
+
+    for (i = 0; i < ctrl_last; i++)
+    {
+        if (ctrl_mapping[i].entry_type == V4L2_CONTROL && ctrl_mapping[i].id == id)
+        {
+            return &ctrl_mapping[i];
+        }
+    }
+    return NULL;
+}
+
+/* menu entries of a menu control, indexes the driver skips are left out */
+static void control_query_options(struct control_mapping *cm)
+{
+    struct v4l2_querymenu querymenu;
+    unsigned int options_count;
+    unsigned int option_nr = 0;
+    int menu_index;
+
+    if (cm->control_type != V4L2_CTRL_TYPE_MENU && cm->control_type != V4L2_CTRL_TYPE_INTEGER_MENU)
+    {
+        return;
+    }
+
+    options_count = cm->maximum - cm->minimum + 1;
+    cm->options = calloc(options_count, sizeof(struct control_option));
+    memset(&querymenu, 0, sizeof(querymenu));
+
+    for (menu_index = cm->minimum; menu_index <= cm->maximum; menu_index++)
+    {
+        querymenu.id = cm->id;
+        querymenu.index = menu_index;
+        if (0 == v4l2_ioctl(control_fd(cm), VIDIOC_QUERYMENU, &querymenu))
+        {
+            cm->options[option_nr].index = querymenu.index;
+
+            if (cm->control_type == V4L2_CTRL_TYPE_MENU)
+            {
+                cm->options[option_nr].name = strdup((const char *)querymenu.name);
+            }
+            else
+            {
+                cm->options[option_nr].value = querymenu.value;
+            }
+            option_nr += 1;
+        }
+    }
+    cm->hasoptions = option_nr > 0;
+}
+
+static void control_set_range(struct control_mapping *cm, int minimum, int maximum, int step, int default_value)
+{
+    control_options_free(cm);
+    cm->minimum = minimum;
+    cm->maximum = maximum;
+    cm->step = step;
+    cm->default_value = default_value;
+    control_query_options(cm);
+}
+
+/*
+ * Re-read flags and range of one control. A control that becomes active
+ * gets its current value, the device may have changed it meanwhile.
+ * Returns true when the control was shown, hidden or got a new range.
+ */
+static bool control_refresh(struct control_mapping *cm)
+{
+    struct v4l2_query_ext_ctrl query;
+    struct v4l2_control control;
+    bool hidden = control_hidden(cm);
+    bool range;
+
+    memset(&query, 0, sizeof(query));
+    query.id = cm->id;
+    if (v4l2_ioctl(control_fd(cm), VIDIOC_QUERY_EXT_CTRL, &query) < 0)
+    {
+        return false;
+    }
+
+    range = query.minimum != cm->minimum || query.maximum != cm->maximum ||
+            query.step != (uint64_t)cm->step || query.default_value != cm->default_value;
+    if (range)
+    {
+        control_set_range(cm, query.minimum, query.maximum, query.step, query.default_value);
+    }
+    cm->flags = query.flags;
+
+    if (hidden && !control_hidden(cm))
+    {
+        memset(&control, 0, sizeof(control));
+        control.id = cm->id;
+        if (v4l2_ioctl(control_fd(cm), VIDIOC_G_CTRL, &control) == 0)
+        {
+            cm->value = control.value;
+        }
+    }
+    return range || hidden != control_hidden(cm);
+}
+
+/*
+ * After a write: the manual controls of an automatic mode, or the other
+ * controls of the class when the driver flags the control as UPDATE.
+ * Controls with events get their changes from the event queue instead.
+ */
+static void control_refresh_related(struct control_mapping *mapping)
+{
+    unsigned int builtin = sizeof(auto_pairs) / sizeof(auto_pairs[0]);
+    const struct auto_pair *pair;
+    struct control_mapping *cm;
+    bool master = false;
+    bool changed = false;
+    unsigned int i;
+    int j;
+
+    for (i = 0; i < builtin + depend_count; i++)
+    {
+        pair = i < builtin ? &auto_pairs[i] : &depend_pairs[i - builtin];
+        if (pair->master != mapping->id)
+        {
+            continue;
+        }
+        master = true;
+        cm = control_by_id(pair->dependent);
+        if (cm && !cm->has_events)
+        {
+            changed |= control_refresh(cm);
+        }
+    }
+
+    for (j = 0; j < ctrl_last && !master && (mapping->flags & V4L2_CTRL_FLAG_UPDATE); j++)
+    {
+        cm = &ctrl_mapping[j];
+        if (cm != mapping && cm->entry_type == V4L2_CONTROL && cm->ctrl_class == mapping->ctrl_class &&
+            cm->source == mapping->source && !cm->has_events)
+        {
+            changed |= control_refresh(cm);
+        }
+    }
+
+    if (changed)
+    {
+        control_view_update();
+        layout_changed = true;
+    }
+}
+
+static void v4l2_apply_control(struct control_mapping *mapping)
+{
+    int ret = 0;
+
+    TRACE2(apply_control_entry, mapping->id, mapping->value);
+
+    /* controls are written on reconnect, stream parameters return to the last device state */
+    if (device_lost)
+    {
+        TRACE3(apply_control_return, mapping->id, mapping->value, -ENODEV);
+        return;
+    }
+
+    switch (mapping->entry_type)
+    {
+    case V4L2_CONTROL:
+        ret = v4l2_set_ctrl_value(control_fd(mapping), mapping->id, mapping->value);
+        control_refresh_related(mapping);
+        break;
+
+    case V4L2_PARAM:
+        if (!strncmp(mapping->var_name, "fps", 3))
+        {
+            mapping->value = v4l2_fps_set(mapping->value);
+        }
+        else if (!strcmp(mapping->var_name, "pixel_format"))
+        {
+            v4l2_format_select(mapping->value);
+        }
+        else if (!strcmp(mapping->var_name, "resolution"))
+        {
+            v4l2_size_select(mapping->value);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    TRACE3(apply_control_return, mapping->id, mapping->value, ret);
+}
+
+/*
+ * Volatile controls never raise value events. Manual controls driven by
+ * an automatic mode of the device are polled when the driver did not
+ * accept an event subscription. Recomputed after every enumeration.
+ */
+static void control_poll_update()
+{
+    unsigned int builtin = sizeof(auto_pairs) / sizeof(auto_pairs[0]);
+    const struct auto_pair *pair;
+    struct control_mapping *master;
+    struct control_mapping *dependent;
+    unsigned int i;
+    int j;
+
+    for (j = 0; j < ctrl_last; j++)
+    {
+        ctrl_mapping[j].polled = ctrl_mapping[j].entry_type == V4L2_CONTROL &&
+                                 (ctrl_mapping[j].flags & V4L2_CTRL_FLAG_VOLATILE);
+    }
+
+    for (i = 0; i < builtin + depend_count; i++)
+    {
+        pair = i < builtin ? &auto_pairs[i] : &depend_pairs[i - builtin];
+        master = control_by_id(pair->master);
+        dependent = control_by_id(pair->dependent);
+        if (master && dependent && !dependent->has_events)
+        {
+            dependent->polled = true;
+        }
+    }
+}
+
+static bool v4l2_subscribe_control(int fd, unsigned int id)
+{
+    struct v4l2_event_subscription sub;
+
+    memset(&sub, 0, sizeof(sub));
+    sub.type = V4L2_EVENT_CTRL;
+    sub.id = id;
+
+    if (v4l2_ioctl(fd, VIDIOC_SUBSCRIBE_EVENT, &sub) < 0)
+    {
+        return false;
+    }
+    events_subscribed = true;
+    return true;
+}
+
+/* read values in one VIDIOC_G_EXT_CTRLS, controls the driver refuses keep their value */
+static void v4l2_fd_get_ctrl_values(int fd, struct v4l2_ext_control *items, int count)
+{
+    struct v4l2_ext_controls ctrls;
+    struct v4l2_control control;
+    int i;
+
+    memset(&ctrls, 0, sizeof(ctrls));
+    ctrls.which = V4L2_CTRL_WHICH_CUR_VAL;
+    ctrls.count = count;
+    ctrls.controls = items;
+
+    if (v4l2_ioctl(fd, VIDIOC_G_EXT_CTRLS, &ctrls) == 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        memset(&control, 0, sizeof(control));
+        control.id = items[i].id;
+        if (v4l2_ioctl(fd, VIDIOC_G_CTRL, &control) == 0)
+        {
+            items[i].value = control.value;
+        }
+    }
+}
+
+/* write values in one VIDIOC_S_EXT_CTRLS, falls back to single writes when the driver refuses the batch */
+static int v4l2_fd_set_ctrl_values(int fd, struct v4l2_ext_control *items, int count)
+{
+    struct v4l2_ext_controls ctrls;
+    struct v4l2_control control;
+    int failed = 0;
+    int i;
+
+    if (request_active && fd == v4l2_dev_fd)
+    {
+        return request_add(items, count);
+    }
+
+    memset(&ctrls, 0, sizeof(ctrls));
+    ctrls.which = V4L2_CTRL_WHICH_CUR_VAL;
+    ctrls.count = count;
+    ctrls.controls = items;
+
+    if (v4l2_ioctl(fd, VIDIOC_S_EXT_CTRLS, &ctrls) == 0)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        memset(&control, 0, sizeof(control));
+        control.id = items[i].id;
+        control.value = items[i].value;
+        if (v4l2_ioctl(fd, VIDIOC_S_CTRL, &control) < 0)
+        {
+            failed++;
+        }
+    }
+    return failed;
+}
+
+/*
+ * A batch of the UI device may hold controls of sub-devices. It is split
+ * by node, every part keeps its order and goes out in one ioctl, values
+ * are copied back in place. Returns the number of failed writes.
+ */
+static int media_ctrl_values(struct v4l2_ext_control *items, int count, bool write)
+{
+    struct v4l2_ext_control *part = malloc(count * sizeof(struct v4l2_ext_control));
+    int *index = malloc(count * sizeof(int));
+    struct control_mapping *cm;
+    int failed = 0;
+    int source;
+    int fd;
+    int n;
+    int i;
+
+    if (part == NULL || index == NULL)
+    {
+        free(part);
+        free(index);
+        return count;
+    }
+
+    for (source = 0; source <= media_count; source++)
+    {
+        for (i = 0, n = 0; i < count; i++)
+        {
+            cm = control_by_id(items[i].id);
+            if ((cm ? cm->source : 0) == source)
+            {
+                index[n] = i;
+                part[n++] = items[i];
+            }
+        }
+        if (!n)
+        {
+            continue;
+        }
+
+        fd = source ? media_sources[source].fd : v4l2_dev_fd;
+        if (write)
+        {
+            failed += v4l2_fd_set_ctrl_values(fd, part, n);
+        }
+        else
+        {
+            v4l2_fd_get_ctrl_values(fd, part, n);
+        }
+        for (i = 0; i < n; i++)
+        {
+            items[index[i]] = part[i];
+        }
+    }
+
+    free(part);
+    free(index);
+    return failed;
+}
+
+static void v4l2_get_ctrl_values(struct v4l2_ext_control *items, int count)
+{
+    if (media_count)
+    {
+        media_ctrl_values(items, count, false);
+        return;
+    }
+    v4l2_fd_get_ctrl_values(v4l2_dev_fd, items, count);
+}
+
+static int v4l2_set_ctrl_values(struct v4l2_ext_control *items, int count)
+{
+    if (media_count)
+    {
+        return media_ctrl_values(items, count, true);
+    }
+    return v4l2_fd_set_ctrl_values(v4l2_dev_fd, items, count);
+}
+
+/* a control named twice in one batch is written once with its last value */
+static int batch_add(struct v4l2_ext_control *items, int count, unsigned int id, int value)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (items[i].id == id)
+        {
+            items[i].value = value;
+            return count;
+        }
+    }
+    memset(&items[count], 0, sizeof(struct v4l2_ext_control));
+    items[count].id = id;
+    items[count].value = value;
+    return count + 1;
+}
+
+static bool v4l2_fd_ctrl_inactive(int fd, unsigned int id)
+{
+    struct v4l2_queryctrl queryctrl;
+
+    memset(&queryctrl, 0, sizeof(queryctrl));
+    queryctrl.id = id;
+    return v4l2_ioctl(fd, VIDIOC_QUERYCTRL, &queryctrl) == 0 && (queryctrl.flags & V4L2_CTRL_FLAG_INACTIVE);
+}
+
+/*
+ * Order a batch so that no manual control is written while its automatic
+ * mode makes the driver ignore it. A dependent that is inactive now goes
+ * after its master, an active one before the master that may disable it.
+ * Items without such a pair keep their order.
+ */
+static void apply_plan(int fd, struct v4l2_ext_control *items, int count)
+{
+    int builtin = sizeof(auto_pairs) / sizeof(auto_pairs[0]);
+    const struct auto_pair *pair;
+    struct v4l2_ext_control *ordered;
+    struct control_mapping *cm;
+    int before[PLAN_EDGES_MAX];
+    int after[PLAN_EDGES_MAX];
+    int edge_count = 0;
+    bool *placed;
+    int master;
+    int dependent;
+    int n;
+    int i;
+    int j;
+
+    for (i = 0; i < builtin + depend_count && edge_count < PLAN_EDGES_MAX; i++)
+    {
+        pair = i < builtin ? &auto_pairs[i] : &depend_pairs[i - builtin];
+        for (master = 0; master < count && items[master].id != pair->master; master++)
+        {
+        }
+        for (dependent = 0; dependent < count && items[dependent].id != pair->dependent; dependent++)
+        {
+        }
+        if (master == count || dependent == count)
+        {
+            continue;
+        }
+
+        /* a dependent of the UI device may live on a sub-device */
+        cm = fd == v4l2_dev_fd ? control_by_id(pair->dependent) : NULL;
+        if (v4l2_fd_ctrl_inactive(cm ? control_fd(cm) : fd, pair->dependent))
+        {
+            before[edge_count] = master;
+            after[edge_count] = dependent;
+        }
+        else
+        {
+            before[edge_count] = dependent;
+            after[edge_count] = master;
+        }
+        edge_count++;
+    }
+    if (!edge_count)
+    {
+        return;
+    }
+
+    ordered = malloc(count * sizeof(struct v4l2_ext_control));
+    placed = calloc(count, sizeof(bool));
+    if (ordered == NULL || placed == NULL)
+    {
+        free(ordered);
+        free(placed);
+        return;
+    }
+
+    /* stable topological order, a cycle of -D pairs is broken at its first item */
+    for (n = 0; n < count; n++)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (placed[i])
+            {
+                continue;
+            }
+            for (j = 0; j < edge_count && (after[j] != i || placed[before[j]]); j++)
+            {
+            }
+            if (j == edge_count)
+            {
+                break;
+            }
+        }
+        for (i = i < count ? i : 0; placed[i]; i++)
+        {
+        }
+        placed[i] = true;
+        ordered[n] = items[i];
+    }
+
+    memcpy(items, ordered, count * sizeof(struct v4l2_ext_control));
+    free(ordered);
+    free(placed);
+}
+
+/* lookup for journal entries, stream parameters have their own small ids */
+static struct control_mapping *control_by_journal_id(unsigned int id)
+{
+    int i;
+
+    for (i = 0; i < ctrl_last; i++)
+    {
+        if (ctrl_mapping[i].id == id)
+        {
+            return &ctrl_mapping[i];
+        }
+    }
+    return NULL;
+}
+
+static bool journal_write(const void *buf, size_t length)
+{
+    const char *pos = buf;
+    ssize_t n;
+
+    while (length)
+    {
+        n = write(journal_fd, pos, length);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        pos += n;
+        length -= n;
+    }
+    return true;
+}
+
+/* consumer side, only the writer thread calls this while the journal is open */
+static void journal_flush()
+{
+    unsigned int tail = atomic_load_explicit(&journal_tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&journal_head, memory_order_acquire);
+    unsigned int start;
+    unsigned int count;
+
+    while (tail != head)
+    {
+        start = tail & (JOURNAL_SIZE - 1);
+        count = head - tail;
+        if (count > JOURNAL_SIZE - start)
+        {
+            count = JOURNAL_SIZE - start;
+        }
+        if (!journal_write(&journal_ring[start], count * sizeof(struct journal_entry)))
+        {
+            journal_lost += count;
+        }
+        tail += count;
+        atomic_store_explicit(&journal_tail, tail, memory_order_release);
+    }
+}
+
+static void *journal_writer(void *arg)
+{
+    struct timespec delay = {0, JOURNAL_FLUSH_MS * 1000000L};
+
+    (void)(arg);
+
+    while (!atomic_load_explicit(&journal_stop, memory_order_acquire))
+    {
+        journal_flush();
+        nanosleep(&delay, NULL);
+    }
+    journal_flush();
+    return NULL;
+}
+
+/*
+ * Producer side, called from the key loop after the ioctl. Never blocks
+ * and never touches the file, a full ring drops the change.
+ */
+static void journal_record(struct control_mapping *mapping, int old_value, int source)
+{
+    struct journal_entry *entry;
+    unsigned int head;
+
+    if (journal_fd < 0 || old_value == mapping->value)
+    {
+        return;
+    }
+
+    head = atomic_load_explicit(&journal_head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&journal_tail, memory_order_acquire) >= JOURNAL_SIZE)
+    {
+        journal_dropped++;
+        return;
+    }
+
+    entry = &journal_ring[head & (JOURNAL_SIZE - 1)];
+    entry->timestamp_us = monotonic_us();
+    entry->id = mapping->id;
+    entry->old_value = old_value;
+    entry->new_value = mapping->value;
+    entry->source = source;
+    atomic_store_explicit(&journal_head, head + 1, memory_order_release);
+}
+
+static int journal_open()
+{
+    struct journal_header header;
+    struct journal_entry session;
+
+    journal_fd = open(journal_file, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journal_fd < 0)
+    {
+        printf("ERROR: Journal open failed: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    if (lseek(journal_fd, 0, SEEK_END) == 0)
+    {
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        header.entry_size = sizeof(struct journal_entry);
+        if (!journal_write(&header, sizeof(header)))
+        {
+            printf("ERROR: Journal write failed: %s (%d)\n", strerror(errno), errno);
+            goto err;
+        }
+    }
+    else if (pread(journal_fd, &header, sizeof(header), 0) != sizeof(header) ||
+             memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) ||
+             header.entry_size != sizeof(struct journal_entry))
+    {
+        printf("ERROR: %s is not a journal file\n", journal_file);
+        goto err;
+    }
+
+    /* sessions appended to one file are replayed with their own time base */
+    memset(&session, 0, sizeof(session));
+    session.timestamp_us = monotonic_us();
+    session.source = JOURNAL_SESSION;
+    journal_write(&session, sizeof(session));
+
+    if (pthread_create(&journal_thread, NULL, journal_writer, NULL))
+    {
+        printf("ERROR: Journal writer thread failed\n");
+        goto err;
+    }
+    return 0;
+
+err:
+    close(journal_fd);
+    journal_fd = -1;
+    return -1;
+}
+
+static void journal_close()
+{
+    if (journal_fd < 0)
+    {
+        return;
+    }
+
+    atomic_store_explicit(&journal_stop, true, memory_order_release);
+    pthread_join(journal_thread, NULL);
+    close(journal_fd);
+    journal_fd = -1;
+
+    if (journal_dropped || journal_lost)
+    {
+        printf("INFO: Journal missed %u changes (%u ring full, %u write errors)\n",
+               journal_dropped + journal_lost, journal_dropped, journal_lost);
+    }
+}
+
+static void snapshot_free(struct snapshot *snap)
+{
+    int i;
+
+    if (snap == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < snap->block_count; i++)
+    {
+        if (--snap->blocks[i]->refs == 0)
+        {
+            free(snap->blocks[i]);
+        }
+    }
+    free(snap->blocks);
+    free(snap);
+}
+
+/*
+ * Copy of the control values. Blocks equal to the base snapshot are shared,
+ * so a step changing one control costs one block. The changed control is
+ * stored with old_value, its value before the change. Returns NULL when
+ * the copy cannot be allocated.
+ */
+static struct snapshot *snapshot_take(const struct snapshot *base, struct control_mapping *changed, int old_value)
+{
+    struct snapshot *snap = calloc(1, sizeof(struct snapshot));
+    int values[SNAPSHOT_BLOCK];
+    int first;
+    int length;
+    int b;
+    int i;
+
+    if (snap == NULL)
+    {
+        return NULL;
+    }
+    snap->count = ctrl_last;
+    snap->blocks = calloc((ctrl_last + SNAPSHOT_BLOCK - 1) / SNAPSHOT_BLOCK, sizeof(struct value_block *));
+    if (snap->blocks == NULL)
+    {
+        free(snap);
+        return NULL;
+    }
+
+    for (b = 0; b < (ctrl_last + SNAPSHOT_BLOCK - 1) / SNAPSHOT_BLOCK; b++)
+    {
+        first = b * SNAPSHOT_BLOCK;
+        length = ctrl_last - first < SNAPSHOT_BLOCK ? ctrl_last - first : SNAPSHOT_BLOCK;
+        for (i = 0; i < length; i++)
+        {
+            values[i] = &ctrl_mapping[first + i] == changed ? old_value : ctrl_mapping[first + i].value;
+        }
+
+        if (base && b < base->block_count && base->count >= first + length &&
+            !memcmp(base->blocks[b]->values, values, length * sizeof(int)))
+        {
+            snap->blocks[b] = base->blocks[b];
+            snap->blocks[b]->refs++;
+        }
+        else
+        {
+            snap->blocks[b] = calloc(1, sizeof(struct value_block));
+            if (snap->blocks[b] == NULL)
+            {
+                /* blocks taken so far are counted, snapshot_free() releases them */
+                snapshot_free(snap);
+                return NULL;
+            }
+            snap->blocks[b]->refs = 1;
+            memcpy(snap->blocks[b]->values, values, length * sizeof(int));
+        }
+        snap->block_count++;
+    }
+    return snap;
+}
+
+/* a snapshot that could not be taken is no step */
+static void snapshot_push(struct snapshot **stack, int *count, struct snapshot *snap)
+{
+    if (snap == NULL)
+    {
+        return;
+    }
+    if (*count == UNDO_DEPTH)
+    {
+        snapshot_free(stack[0]);
+        memmove(stack, stack + 1, (UNDO_DEPTH - 1) * sizeof(struct snapshot *));
+        (*count)--;
+    }
+    stack[(*count)++] = snap;
+}
+
+static void snapshot_clear(struct snapshot **stack, int *count)
+{
+    while (*count)
+    {
+        snapshot_free(stack[--(*count)]);
+    }
+}
+
+static struct snapshot *snapshot_latest()
+{
+    return undo_count ? undo_stack[undo_count - 1] : NULL;
+}
+
+/*
+ * The first change in a key loop step saves the state before it, so a preset
+ * load is undone as a whole. Repeated key changes of one control make one step.
+ */
+static void snapshot_note(struct control_mapping *mapping, int old_value, int source)
+{
+    struct snapshot *snap;
+
+    if (old_value == mapping->value || undo_step_open)
+    {
+        return;
+    }
+    undo_step_open = true;
+
+    if (source == JOURNAL_KEY && mapping - ctrl_mapping == undo_last_key)
+    {
+        return;
+    }
+    undo_last_key = source == JOURNAL_KEY ? mapping - ctrl_mapping : -1;
+
+    snap = snapshot_take(snapshot_latest(), mapping, old_value);
+    if (snap == NULL)
+    {
+        undo_last_key = -1;
+        return;
+    }
+    snapshot_push(undo_stack, &undo_count, snap);
+    snapshot_clear(redo_stack, &redo_count);
+}
+
+/*
+ * Apply only the controls that differ from the snapshot, V4L2 controls in
+ * one write. Returns the number of changed controls, -1 when nothing could
+ * be applied.
+ */
+static int snapshot_restore(const struct snapshot *snap)
+{
+    struct v4l2_ext_control *items = calloc(snap->count, sizeof(struct v4l2_ext_control));
+    struct control_mapping *cm;
+    int changed = 0;
+    int count = 0;
+    int old_value;
+    int value;
+    int i;
+
+    if (items == NULL)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < snap->count && i < ctrl_last; i++)
+    {
+        cm = &ctrl_mapping[i];
+        value = snap->blocks[i / SNAPSHOT_BLOCK]->values[i % SNAPSHOT_BLOCK];
+        if (cm->value == value || cm->unsupported)
+        {
+            continue;
+        }
+
+        if (cm->entry_type != V4L2_CONTROL)
+        {
+            old_value = cm->value;
+            cm->value = value;
+            v4l2_apply_control(cm);
+            journal_record(cm, old_value, JOURNAL_SNAPSHOT);
+            changed++;
+            continue;
+        }
+
+        items[count].id = cm->id;
+        items[count].value = value;
+        count++;
+    }
+
+    apply_plan(v4l2_dev_fd, items, count);
+    if (count && v4l2_set_ctrl_values(items, count))
+    {
+        v4l2_get_ctrl_values(items, count);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        cm = control_by_id(items[i].id);
+        old_value = cm->value;
+        cm->value = items[i].value;
+        journal_record(cm, old_value, JOURNAL_SNAPSHOT);
+        control_refresh_related(cm);
+    }
+    changed += count;
+
+    free(items);
+    return changed;
+}
+
+static void snapshot_free_all()
+{
+    snapshot_clear(undo_stack, &undo_count);
+    snapshot_clear(redo_stack, &redo_count);
+    snapshot_free(snapshot_ab[0]);
+    snapshot_free(snapshot_ab[1]);
+    snapshot_ab[0] = NULL;
+    snapshot_ab[1] = NULL;
+}
+
+/* undo and journal bookkeeping of a value that is on the device */
+static void control_record(struct control_mapping *mapping, int old_value, int source)
+{
+    snapshot_note(mapping, old_value, source);
+    journal_record(mapping, old_value, source);
+}
+
+static void control_apply(struct control_mapping *mapping, int old_value, int source)
+{
+    v4l2_apply_control(mapping);
+    control_record(mapping, old_value, source);
+}
+
+/* an earlier sub-device with a writable control of the same id, 0 if there is none */
+static int media_control_owner(unsigned int id, int source)
+{
+    const struct media_control *mc;
+    int i;
+    int j;
+
+    for (i = 1; i < source; i++)
+    {
+        for (j = 0; j < media_sources[i].control_count; j++)
+        {
+            mc = &media_sources[i].controls[j];
+            if (mc->query.id == id && !(mc->query.flags & V4L2_CTRL_FLAG_READ_ONLY))
+            {
+                return i;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Inactive and disabled controls are kept hidden, they may become usable
+ * later. Controls of sub-devices come with the value their enumeration
+ * thread read, their names get the prefix of the sub-device.
+ */
+static void v4l2_add_control(struct v4l2_queryctrl *queryctrl, unsigned int id, int source, const int *value)
+{
+    const struct control_info *info;
+    struct v4l2_queryctrl query;
+    struct v4l2_control control;
+    struct control_mapping *cm;
+    bool unsupported;
+    char prefixed[CONFIG_NAME_MAX + 1];
+    char *var_name;
+    bool ignore;
+    bool video;
+    int owner;
+    int liv;
+
+    if (queryctrl->flags & V4L2_CTRL_FLAG_READ_ONLY)
+    {
+        return;
+    }
+
+    /* the id names the control in journals and batches, the video node or the first sub-device keeps it */
+    memset(&query, 0, sizeof(query));
+    query.id = id;
+    video = source && v4l2_ioctl(v4l2_dev_fd, VIDIOC_QUERYCTRL, &query) == 0;
+    owner = source && !video ? media_control_owner(id, source) : 0;
+    if (video || owner)
+    {
+        if (!ui_initialized)
+        {
+            printf("INFO: Ignore control of %s also found on %s: %s\n", media_sources[source].name,
+                   owner ? media_sources[owner].path : v4l2_devname, queryctrl->name);
+        }
+        return;
+    }
+
+    /* controls read after the first paint must not write into the screen */
+    unsupported = disable_unsupported_controls && !v4l2_check_supported_control(id);
+    if (unsupported)
+    {
+        if (!ui_initialized)
+        {
+            printf("INFO: Ignore unsupported control: %s\n", queryctrl->name);
+        }
+        if (list_controls)
+        {
+            return;
+        }
+    }
+
+    control.id = queryctrl->id;
+    control.value = value ? *value : queryctrl->default_value;
+    if (value || 0 == v4l2_ioctl(v4l2_dev_fd, VIDIOC_G_CTRL, &control) ||
+        (queryctrl->flags & (V4L2_CTRL_FLAG_DISABLED | V4L2_CTRL_FLAG_INACTIVE)))
+    {
+        var_name = name2var((char *)queryctrl->name);
+        if (source)
+        {
+            snprintf(prefixed, sizeof(prefixed), "%s_%s", media_sources[source].name, var_name);
+            free(var_name);
+            var_name = strdup(prefixed);
+        }
+
+        if (list_controls)
+        {
+            printf("INFO: %30s = %-30s\n", var_name, queryctrl->name);
+            free(var_name);
+            return;
+        }
+
+        if (last_ignored_variable > 0)
+        {
+            ignore = false;
+            for (liv = 0; liv < last_ignored_variable; liv++)
+            {
+                if (!strncmp(var_name, ignored_variables[liv], strlen(var_name)))
+                {
+                    ignore = true;
+                    continue;
+                }
+            }
+            if (ignore)
+            {
+                free(var_name);
+                return;
+            }
+        }
+
+        cm = control_new();
+        cm->entry_type = V4L2_CONTROL;
+        cm->id = id;
+        cm->ctrl_class = V4L2_CTRL_ID2CLASS(id);
+        cm->source = source;
+        cm->name = strdup((const char *)queryctrl->name);
+        cm->var_name = var_name;
+        cm->control_type = queryctrl->type;
+        cm->value = control.value;
+        cm->minimum = queryctrl->minimum;
+        cm->maximum = queryctrl->maximum;
+        cm->step = queryctrl->step;
+        cm->default_value = queryctrl->default_value;
+        cm->flags = queryctrl->flags;
+        cm->unsupported = unsupported;
+        cm->has_events = poll_enabled && v4l2_subscribe_control(control_fd(cm), id);
+        info = control_info_find(id);
+        cm->unit = info ? info->unit : NULL;
+
+        control_query_options(cm);
+
+        ctrl_last += 1;
+    }
+}
+
+static struct control_class *control_class_add(unsigned int id, const char *name)
+{
+    const char *suffix = " Controls";
+    int len = strlen(name);
+
+    if (class_count >= CTRL_CLASSES_MAX)
+    {
+        return NULL;
+    }
+
+    if (len > (int)strlen(suffix) && !strcmp(name + len - strlen(suffix), suffix))
+    {
+        len -= strlen(suffix);
+    }
+
+    ctrl_classes[class_count].id = id;
+    ctrl_classes[class_count].source = 0;
+    ctrl_classes[class_count].name = strndup(name, len);
+    ctrl_classes[class_count].enumerated = false;
+    ctrl_classes[class_count].next_id = 0;
+    ctrl_classes[class_count].cursor = 0;
+    return &ctrl_classes[class_count++];
+}
+
+/* tab of the class of a control, drivers without class controls get the usual names */
+static void control_class_name(const struct v4l2_queryctrl *queryctrl, char *name, size_t size)
+{
+    unsigned int cls = V4L2_CTRL_ID2CLASS(queryctrl->id);
+
+    if (queryctrl->type == V4L2_CTRL_TYPE_CTRL_CLASS)
+    {
+        snprintf(name, size, "%s", (const char *)queryctrl->name);
+    }
+    else if (cls == V4L2_CTRL_CLASS_USER)
+    {
+        snprintf(name, size, "User");
+    }
+    else if (cls == V4L2_CTRL_CLASS_MPEG)
+    {
+        snprintf(name, size, "Codec");
+    }
+    else if (cls == V4L2_CTRL_CLASS_CAMERA)
+    {
+        snprintf(name, size, "Camera");
+    }
+    else
+    {
+        snprintf(name, size, "Class %02x", (cls >> 16) & 0xff);
+    }
+}
+
+/*
+ * Find control classes of the device with one query per class. Controls
+ * of a class are enumerated when its tab is shown for the first time.
+ * Stream parameters (format, resolution, FPS) have their own tab.
+ */
+static void v4l2_enum_classes()
+{
+    const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+    struct v4l2_queryctrl queryctrl;
+    char class_name[sizeof(queryctrl.name)];
+    unsigned int cls;
+
+    memset(&queryctrl, 0, sizeof(queryctrl));
+
+    queryctrl.id = next_fl;
+    while (0 == v4l2_ioctl(v4l2_dev_fd, VIDIOC_QUERYCTRL, &queryctrl))
+    {
+        cls = V4L2_CTRL_ID2CLASS(queryctrl.id);
+        control_class_name(&queryctrl, class_name, sizeof(class_name));
+        control_class_add(cls, class_name);
+
+        queryctrl.id = (cls | 0xffff) | next_fl;
+    }
+
+    control_class_add(0, "Stream");
+}
+
+/*
+ * Read controls of a class until it is complete or, with a deadline in
+ * monotonic us, until the deadline has passed. At least one control is
+ * read per call. Returns true when the class is complete.
+ */
+static bool v4l2_get_class_slice(struct control_class *cc, uint64_t deadline_us)
+{
+    const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+    struct v4l2_queryctrl queryctrl;
+    unsigned int id;
+
+    if (cc->enumerated || device_lost)
+    {
+        return cc->enumerated;
+    }
+
+    if (!cc->id)
+    {
+        cc->enumerated = true;
+        return true;
+    }
+
+    memset(&queryctrl, 0, sizeof(queryctrl));
+
+    queryctrl.id = (cc->next_id ? cc->next_id : cc->id) | next_fl;
+    for (;;)
+    {
+        if (v4l2_ioctl(v4l2_dev_fd, VIDIOC_QUERYCTRL, &queryctrl) != 0 ||
+            V4L2_CTRL_ID2CLASS(queryctrl.id) != cc->id)
+        {
+            cc->enumerated = true;
+            break;
+        }
+        id = queryctrl.id;
+        cc->next_id = id;
+        queryctrl.id |= next_fl;
+        v4l2_add_control(&queryctrl, id, 0, NULL);
+
+        if (deadline_us && monotonic_us() >= deadline_us)
+        {
+            break;
+        }
+    }
+
+    if (poll_enabled)
+    {
+        control_poll_update();
+    }
+    return cc->enumerated;
+}
+
+static void v4l2_get_class_controls(struct control_class *cc)
+{
+    v4l2_get_class_slice(cc, 0);
+}
+
+static void v4l2_get_controls()
+{
+    int i;
+
+    TRACE2(get_controls_entry, class_count, ctrl_last);
+
+    if (list_controls)
+    {
+        printf("INFO: %30s = %-30s\n", "Control variable name", "Control name");
+    }
+
+    for (i = 0; i < class_count; i++)
+    {
+        v4l2_get_class_controls(&ctrl_classes[i]);
+    }
+
+    TRACE2(get_controls_return, class_count, ctrl_last);
+}
+
+static int media_entity_index(const struct media_graph *graph, unsigned int id)
+{
+    int i;
+
+    for (i = 0; i < graph->entity_count; i++)
+    {
+        if (graph->entities[i].id == id)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void media_link_add(struct media_graph *graph, unsigned int source, unsigned int sink)
+{
+    if (graph->link_count < MEDIA_LINKS_MAX)
+    {
+        graph->links[graph->link_count][0] = source;
+        graph->links[graph->link_count][1] = sink;
+        graph->link_count++;
+    }
+}
+
+/* /dev name of a character device, udev names nodes after their sysfs directory */
+static void media_devnode(unsigned int major, unsigned int minor, char *path, size_t size)
+{
+    char link[64];
+    char target[256];
+    ssize_t len;
+
+    path[0] = '\0';
+    snprintf(link, sizeof(link), "/sys/dev/char/%u:%u", major, minor);
+    len = readlink(link, target, sizeof(target) - 1);
+    if (len > 0)
+    {
+        target[len] = '\0';
+        snprintf(path, size, "/dev/%s", basename(target));
+    }
+}
+
+/*
+ * Entities, enabled data links and sub-device nodes of a media device.
+ * The first call returns the sizes, the second one the graph. The video
+ * node is found by the device number of its interface.
+ */
+static int media_graph_read(int fd, dev_t video, struct media_graph *graph)
+{
+    struct media_v2_topology topology;
+    struct media_v2_entity *entities = NULL;
+    struct media_v2_interface *interfaces = NULL;
+    struct media_v2_interface *intf;
+    struct media_v2_link *links = NULL;
+    struct media_v2_pad *pads = NULL;
+    unsigned int source;
+    unsigned int sink;
+    unsigned int i;
+    unsigned int j;
+    int index;
+    int ret = -1;
+
+    memset(&topology, 0, sizeof(topology));
+    if (v4l2_ioctl(fd, MEDIA_IOC_G_TOPOLOGY, &topology) < 0)
+    {
+        return -1;
+    }
+
+    entities = calloc(topology.num_entities + 1, sizeof(struct media_v2_entity));
+    interfaces = calloc(topology.num_interfaces + 1, sizeof(struct media_v2_interface));
+    links = calloc(topology.num_links + 1, sizeof(struct media_v2_link));
+    pads = calloc(topology.num_pads + 1, sizeof(struct media_v2_pad));
+    if (entities == NULL || interfaces == NULL || links == NULL || pads == NULL)
+    {
+        goto out;
+    }
+    topology.ptr_entities = (uintptr_t)entities;
+    topology.ptr_interfaces = (uintptr_t)interfaces;
+    topology.ptr_links = (uintptr_t)links;
+    topology.ptr_pads = (uintptr_t)pads;
+    if (v4l2_ioctl(fd, MEDIA_IOC_G_TOPOLOGY, &topology) < 0)
+    {
+        goto out;
+    }
+
+    memset(graph, 0, sizeof(*graph));
+    graph->video = -1;
+    for (i = 0; i < topology.num_entities && graph->entity_count < MEDIA_ENTITIES_MAX; i++)
+    {
+        graph->entities[graph->entity_count].id = entities[i].id;
+        snprintf(graph->entities[graph->entity_count].name, sizeof(graph->entities[0].name), "%s", entities[i].name);
+        graph->entity_count++;
+    }
+
+    for (i = 0; i < topology.num_links; i++)
+    {
+        if ((links[i].flags & MEDIA_LNK_FL_LINK_TYPE) == MEDIA_LNK_FL_INTERFACE_LINK)
+        {
+            for (j = 0, intf = NULL; j < topology.num_interfaces && intf == NULL; j++)
+            {
+                intf = interfaces[j].id == links[i].source_id ? &interfaces[j] : NULL;
+            }
+            index = media_entity_index(graph, links[i].sink_id);
+            if (intf == NULL || index < 0)
+            {
+                continue;
+            }
+            if (intf->intf_type == MEDIA_INTF_T_V4L_VIDEO &&
+                makedev(intf->devnode.major, intf->devnode.minor) == video)
+            {
+                graph->video = index;
+            }
+            else if (intf->intf_type == MEDIA_INTF_T_V4L_SUBDEV)
+            {
+                media_devnode(intf->devnode.major, intf->devnode.minor, graph->entities[index].devnode,
+                              sizeof(graph->entities[index].devnode));
+                graph->entities[index].subdev = graph->entities[index].devnode[0] != '\0';
+            }
+        }
+        else if ((links[i].flags & MEDIA_LNK_FL_LINK_TYPE) == MEDIA_LNK_FL_DATA_LINK &&
+                 (links[i].flags & MEDIA_LNK_FL_ENABLED))
+        {
+            /* data links connect pads, the walk needs their entities */
+            for (j = 0, source = 0, sink = 0; j < topology.num_pads; j++)
+            {
+                source = pads[j].id == links[i].source_id ? pads[j].entity_id : source;
+                sink = pads[j].id == links[i].sink_id ? pads[j].entity_id : sink;
+            }
+            media_link_add(graph, source, sink);
+        }
+    }
+    ret = 0;
+
+out:
+    free(entities);
+    free(interfaces);
+    free(links);
+    free(pads);
+    return ret;
+}
+
+/* media device with the video node in its graph */
+static int media_graph_find(struct media_graph *graph)
+{
+    char path[sizeof(((struct dirent *)0)->d_name) + 5];
+    struct dirent *entry;
+    struct stat st;
+    bool found = false;
+    DIR *dir;
+    int fd;
+
+    if (stat(v4l2_devname, &st) < 0 || !S_ISCHR(st.st_mode) || (dir = opendir("/dev")) == NULL)
+    {
+        return -1;
+    }
+
+    while (!found && (entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "media", 5))
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+        fd = v4l2_node_open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            continue;
+        }
+        found = media_graph_read(fd, st.st_rdev, graph) == 0 && graph->video >= 0;
+        snprintf(graph->media, sizeof(graph->media), "%s", path);
+        close(fd);
+    }
+    closedir(dir);
+    return found ? 0 : -1;
+}
+
+/*
+ * Topology given with -G instead of a media device, one item per line:
+ *   entity <id> <node or -> <name>
+ *   link <id> <id>
+ *   media <node>
+ * The entity with the node of -v is the video node, entities with any
+ * other node are sub-devices. The media device itself is only needed for
+ * the requests of -Q.
+ */
+static int media_graph_load(const char *filename, struct media_graph *graph)
+{
+    struct media_entity *entity;
+    char line[512];
+    unsigned int source;
+    unsigned int sink;
+    int line_nr = 0;
+    FILE *fp;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        printf("ERROR: Cannot open %s: %s (%d)\n", filename, strerror(errno), errno);
+        return -1;
+    }
+
+    memset(graph, 0, sizeof(*graph));
+    graph->video = -1;
+    while (fgets(line, sizeof(line), fp))
+    {
+        line_nr++;
+        line[strcspn(line, "\r\n")] = '\0';
+        entity = &graph->entities[graph->entity_count];
+        if (line[0] == '\0' || line[0] == '#')
+        {
+            continue;
+        }
+        if (graph->entity_count < MEDIA_ENTITIES_MAX &&
+            sscanf(line, "entity %u %255s %63[^\n]", &entity->id, entity->devnode, entity->name) == 3)
+        {
+            if (!strcmp(entity->devnode, "-"))
+            {
+                entity->devnode[0] = '\0';
+            }
+            else if (!strcmp(entity->devnode, v4l2_devname))
+            {
+                graph->video = graph->entity_count;
+            }
+            entity->subdev = entity->devnode[0] != '\0' && graph->video != graph->entity_count;
+            graph->entity_count++;
+        }
+        else if (sscanf(line, "link %u %u", &source, &sink) == 2)
+        {
+            media_link_add(graph, source, sink);
+        }
+        else if (sscanf(line, "media %255s", graph->media) != 1)
+        {
+            printf("ERROR: %s:%d: Invalid topology line\n", filename, line_nr);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+
+    if (graph->video < 0)
+    {
+        printf("ERROR: %s has no entity with node %s\n", filename, v4l2_devname);
+        return -1;
+    }
+    return 0;
+}
+
+/* sub-devices connected to the video node, nearest first, named after the first word of the entity */
+static void media_pipeline(const struct media_graph *graph)
+{
+    const struct media_entity *entity;
+    int queue[MEDIA_ENTITIES_MAX];
+    bool seen[MEDIA_ENTITIES_MAX];
+    struct media_source *src;
+    int head = 0;
+    int tail = 0;
+    int other;
+    char *name;
+    int i;
+
+    memset(seen, 0, sizeof(seen));
+    queue[tail++] = graph->video;
+    seen[graph->video] = true;
+
+    while (head < tail)
+    {
+        entity = &graph->entities[queue[head++]];
+        if (entity->subdev && media_count < MEDIA_SOURCES_MAX)
+        {
+            src = &media_sources[++media_count];
+            memset(src, 0, sizeof(*src));
+            src->fd = -1;
+            snprintf(src->path, sizeof(src->path), "%s", entity->devnode);
+            snprintf(src->name, sizeof(src->name), "%.*s", (int)strcspn(entity->name, " "), entity->name);
+            name = name2var(src->name);
+            snprintf(src->name, sizeof(src->name), "%s", name[0] ? name : "subdev");
+            free(name);
+            for (i = 1; i < media_count; i++)
+            {
+                if (!strcmp(media_sources[i].name, src->name))
+                {
+                    snprintf(src->name + strlen(src->name), sizeof(src->name) - strlen(src->name), "_%d", media_count);
+                    break;
+                }
+            }
+        }
+
+        for (i = 0; i < graph->link_count; i++)
+        {
+            if (graph->links[i][0] == entity->id)
+            {
+                other = media_entity_index(graph, graph->links[i][1]);
+            }
+            else if (graph->links[i][1] == entity->id)
+            {
+                other = media_entity_index(graph, graph->links[i][0]);
+            }
+            else
+            {
+                continue;
+            }
+            if (other >= 0 && !seen[other])
+            {
+                seen[other] = true;
+                queue[tail++] = other;
+            }
+        }
+    }
+}
+
+/* one thread per sub-device, every thread works on its own slot only */
+static void *media_enum_worker(void *data)
+{
+    const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+    struct media_source *src = data;
+    struct media_control *controls;
+    struct v4l2_queryctrl queryctrl;
+    struct v4l2_control control;
+    uint64_t start_us = monotonic_us();
+    int size = 0;
+
+    src->fd = v4l2_node_open(src->path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (src->fd < 0)
+    {
+        __atomic_store_n(&src->finished, true, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    memset(&queryctrl, 0, sizeof(queryctrl));
+    queryctrl.id = next_fl;
+    while (0 == v4l2_ioctl(src->fd, VIDIOC_QUERYCTRL, &queryctrl))
+    {
+        memset(&control, 0, sizeof(control));
+        control.id = queryctrl.id;
+        control.value = queryctrl.default_value;
+
+        /* class controls name the tabs, the rest follows the rules of v4l2_add_control() */
+        if (queryctrl.type != V4L2_CTRL_TYPE_CTRL_CLASS &&
+            ((queryctrl.flags & V4L2_CTRL_FLAG_READ_ONLY) ||
+             (v4l2_ioctl(src->fd, VIDIOC_G_CTRL, &control) < 0 &&
+              !(queryctrl.flags & (V4L2_CTRL_FLAG_DISABLED | V4L2_CTRL_FLAG_INACTIVE)))))
+        {
+            queryctrl.id |= next_fl;
+            continue;
+        }
+
+        if (src->control_count >= size)
+        {
+            size = size ? size * 2 : 32;
+            controls = realloc(src->controls, size * sizeof(struct media_control));
+            if (controls == NULL)
+            {
+                break;
+            }
+            src->controls = controls;
+        }
+        src->controls[src->control_count].query = queryctrl;
+        src->controls[src->control_count].value = control.value;
+        src->control_count++;
+        queryctrl.id |= next_fl;
+    }
+
+    src->enum_us = monotonic_us() - start_us;
+    __atomic_store_n(&src->finished, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* tab of a sub-device class, named by the class control when the driver has one */
+static struct control_class *media_class_add(struct media_source *src, const struct v4l2_queryctrl *queryctrl)
+{
+    unsigned int cls = V4L2_CTRL_ID2CLASS(queryctrl->id);
+    char class_name[sizeof(queryctrl->name)];
+    char tab_name[sizeof(src->name) + sizeof(class_name)];
+    struct control_class *cc;
+    int i;
+
+    for (i = 0; i < src->control_count; i++)
+    {
+        if (src->controls[i].query.id == (cls | 1))
+        {
+            queryctrl = &src->controls[i].query;
+            break;
+        }
+    }
+    control_class_name(queryctrl, class_name, sizeof(class_name));
+    snprintf(tab_name, sizeof(tab_name), "%s %s", src->name, class_name);
+
+    cc = control_class_add(cls, tab_name);
+    if (cc)
+    {
+        cc->source = src - media_sources;
+        cc->enumerated = true;
+    }
+    return cc;
+}
+
+/*
+ * Controls of the sub-devices in the media pipeline of the video node,
+ * e.g. the sensor behind a CSI-2 receiver. All sub-devices are read at
+ * the same time by threads started here, media_add_controls() collects
+ * them. Fails only for a bad -G file.
+ */
+static int media_open()
+{
+    struct media_graph *graph = calloc(1, sizeof(struct media_graph));
+    int i;
+
+    if (graph == NULL)
+    {
+        return 0;
+    }
+    if (media_topology_file ? media_graph_load(media_topology_file, graph) < 0 : media_graph_find(graph) < 0)
+    {
+        free(graph);
+        return media_topology_file ? -1 : 0;
+    }
+    media_pipeline(graph);
+    snprintf(media_device, sizeof(media_device), "%s", graph->media);
+    free(graph);
+
+    for (i = 1; i <= media_count; i++)
+    {
+        media_sources[i].threaded =
+            pthread_create(&media_sources[i].thread, NULL, media_enum_worker, &media_sources[i]) == 0;
+        if (!media_sources[i].threaded)
+        {
+            media_enum_worker(&media_sources[i]);
+        }
+    }
+    return 0;
+}
+
+/* true while a sub-device thread is still reading */
+static bool media_busy()
+{
+    int i;
+
+    for (i = 1; i <= media_count; i++)
+    {
+        if (media_sources[i].threaded && !__atomic_load_n(&media_sources[i].finished, __ATOMIC_ACQUIRE))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void media_wait()
+{
+    int i;
+
+    for (i = 1; i <= media_count; i++)
+    {
+        if (media_sources[i].threaded)
+        {
+            pthread_join(media_sources[i].thread, NULL);
+            media_sources[i].threaded = false;
+        }
+    }
+}
+
+/* the controls of the sub-devices get tabs and names of their own and are written through their own node */
+static void media_add_controls()
+{
+    struct control_class *cc;
+    struct media_source *src;
+    struct media_control *mc;
+    int last;
+    int i;
+    int j;
+
+    media_wait();
+
+    for (i = 1; i <= media_count; i++)
+    {
+        src = &media_sources[i];
+        if (src->fd < 0)
+        {
+            if (!ui_initialized)
+            {
+                printf("INFO: Cannot open sub-device %s (%s)\n", src->path, src->name);
+            }
+            continue;
+        }
+
+        cc = NULL;
+        for (j = 0; j < src->control_count; j++)
+        {
+            mc = &src->controls[j];
+            if (mc->query.type == V4L2_CTRL_TYPE_CTRL_CLASS)
+            {
+                continue;
+            }
+            last = ctrl_last;
+            v4l2_add_control(&mc->query, mc->query.id, i, &mc->value);
+            if (ctrl_last > last && (cc == NULL || cc->id != V4L2_CTRL_ID2CLASS(mc->query.id)))
+            {
+                cc = media_class_add(src, &mc->query);
+            }
+        }
+        if (!ui_initialized)
+        {
+            printf("INFO: Sub-device %s (%s): %d controls read in %llu us\n", src->path, src->name,
+                   src->control_count, (unsigned long long)src->enum_us);
+        }
+    }
+
+    /* kept until all are added, a later sub-device may repeat an id */
+    for (i = 1; i <= media_count; i++)
+    {
+        free(media_sources[i].controls);
+        media_sources[i].controls = NULL;
+        media_sources[i].control_count = 0;
+    }
+
+    if (poll_enabled && media_count)
+    {
+        control_poll_update();
+    }
+}
+
+static void control_free()
+{
+    int i;
+
+    for (i = 0; i < ctrl_last; i++)
+    {
+        if (ctrl_mapping[i].entry_type == V4L2_CONTROL)
+        {
+            if (ctrl_mapping[i].name)
+            {
+                free(ctrl_mapping[i].name);
+                ctrl_mapping[i].name = NULL;
+            }
+            if (ctrl_mapping[i].var_name)
+            {
+                free(ctrl_mapping[i].var_name);
+                ctrl_mapping[i].var_name = NULL;
+            }
+            if (ctrl_mapping[i].hasoptions && ctrl_mapping[i].options)
+            {
+                free(ctrl_mapping[i].options);
+                ctrl_mapping[i].options = NULL;
+            }
+        }
+        else
+        {
+            control_options_free(&ctrl_mapping[i]);
+        }
+    }
+    free(ctrl_mapping);
+    ctrl_mapping = NULL;
+    free(ctrl_view);
+    ctrl_view = NULL;
+    free(var_index);
+    var_index = NULL;
+    search_free();
+    for (i = 0; i < class_count; i++)
+    {
+        free(ctrl_classes[i].name);
+    }
+    class_count = 0;
+    ctrl_last = 0;
+    ctrl_size = 0;
+    view_last = 0;
+    formats_free();
+}
+
+static const char *config_skip_space(const char *pos, const char *end)
+{
+    while (pos < end && (*pos == ' ' || *pos == '\t'))
+    {
+        pos++;
+    }
+    return pos;
+}
+
+/* decimal or 0x prefixed hex value with optional sign, bounded by the line end */
+static const char *config_parse_value(const char *pos, const char *end, int *value)
+{
+    bool negative = false;
+    long long result = 0;
+    int base = 10;
+    int digit;
+    const char *digits;
+
+    if (pos < end && (*pos == '-' || *pos == '+'))
+    {
+        negative = *pos == '-';
+        pos++;
+    }
+    if (end - pos > 2 && pos[0] == '0' && (pos[1] == 'x' || pos[1] == 'X'))
+    {
+        base = 16;
+        pos += 2;
+    }
+
+    for (digits = pos; pos < end; pos++)
+    {
+        if (*pos >= '0' && *pos <= '9')
+        {
+            digit = *pos - '0';
+        }
+        else if (base == 16 && isxdigit((unsigned char)*pos))
+        {
+            digit = tolower((unsigned char)*pos) - 'a' + 10;
+        }
+        else
+        {
+            break;
+        }
+        result = result * base + digit;
+        if (result > (long long)INT32_MAX + 1)
+        {
+            return NULL;
+        }
+    }
+
+    if (pos == digits)
+    {
+        return NULL;
+    }
+    result = negative ? -result : result;
+    if (result > INT32_MAX)
+    {
+        return NULL;
+    }
+    *value = (int)result;
+    return pos;
+}
+
+static void config_error(struct config_result *result, int line, const char *error)
+{
+    if (!result->errors++)
+    {
+        result->error_line = line;
+        result->error = error;
+    }
+}
+
+/*
+ * Parse name=value lines of a config or preset file mapped into memory.
+ * Blank lines, # comments, spaces around tokens and CRLF are accepted.
+ * Names are passed to the handler as spans into the mapping.
+ */
+static int config_parse(const char *filename, config_handler handler, void *data, struct config_result *result)
+{
+    const char *map = NULL;
+    const char *pos;
+    const char *end;
+    const char *eol;
+    const char *next;
+    const char *name;
+    size_t length;
+    struct stat st;
+    int value;
+    int fd;
+
+    memset(result, 0, sizeof(struct config_result));
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0)
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    pos = map;
+    end = map + st.st_size;
+    while (pos < end)
+    {
+        result->lines++;
+        eol = memchr(pos, '\n', end - pos);
+        next = eol ? eol + 1 : end;
+        eol = eol ? eol : end;
+        if (eol > pos && eol[-1] == '\r')
+        {
+            eol--;
+        }
+
+        pos = config_skip_space(pos, eol);
+        if (pos == eol || *pos == '#')
+        {
+            goto skip;
+        }
+
+        name = pos;
+        while (pos < eol && (isalnum((unsigned char)*pos) || *pos == '_'))
+        {
+            pos++;
+        }
+        length = pos - name;
+        if (!length || length > CONFIG_NAME_MAX)
+        {
+            config_error(result, result->lines, length ? "name too long" : "invalid name");
+            goto skip;
+        }
+
+        pos = config_skip_space(pos, eol);
+        if (pos == eol || *pos != '=')
+        {
+            config_error(result, result->lines, "missing '='");
+            goto skip;
+        }
+
+        pos = config_parse_value(config_skip_space(pos + 1, eol), eol, &value);
+        if (pos == NULL)
+        {
+            config_error(result, result->lines, "invalid value");
+            goto skip;
+        }
+
+        pos = config_skip_space(pos, eol);
+        if (pos != eol && *pos != '#')
+        {
+            config_error(result, result->lines, "unexpected text after value");
+            goto skip;
+        }
+
+        handler(name, length, value, data);
+        result->entries++;
+
+    skip:
+        pos = next;
+    }
+
+    if (map)
+    {
+        munmap((void *)map, st.st_size);
+    }
+    return 0;
+}
+
+/* config files name controls like v4l2-ctl does, canonical names are aliases */
+static struct control_mapping *control_by_config_name(const char *name, size_t length)
+{
+    struct control_mapping *cm = control_by_var_span(name, length);
+    const struct control_info *info;
+
+    if (cm == NULL && (info = control_info_by_name(name, length)))
+    {
+        cm = control_by_id(info->id);
+    }
+    return cm;
+}
+
+/* the name span is resolved while the file is mapped, unknown controls are dropped here */
+static void config_collect_entry(const char *name, size_t length, int value, void *data)
+{
+    struct control_mapping *cm = control_by_config_name(name, length);
+    struct config_entry *entries;
+
+    (void)(data); /* avoid warning: unused parameter 'data' */
+
+    if (cm == NULL || !control_is_persistent(cm))
+    {
+        return;
+    }
+    if (config_entry_count == config_entry_size)
+    {
+        entries = realloc(config_entries, (config_entry_size ? config_entry_size * 2 : 32) * sizeof(struct config_entry));
+        if (entries == NULL)
+        {
+            return;
+        }
+        config_entries = entries;
+        config_entry_size = config_entry_size ? config_entry_size * 2 : 32;
+    }
+    config_entries[config_entry_count].index = cm - ctrl_mapping;
+    config_entries[config_entry_count].value = value;
+    config_entry_count++;
+}
+
+/* names of -D pairs may belong to any control class, all classes have to be read */
+static void depend_resolve()
+{
+    struct control_mapping *master;
+    struct control_mapping *dependent;
+    char *sep;
+    int i;
+
+    depend_count = 0;
+    for (i = 0; i < depend_arg_count; i++)
+    {
+        sep = strchr(depend_args[i], ':');
+        master = control_by_config_name(depend_args[i], sep - depend_args[i]);
+        dependent = control_by_config_name(sep + 1, strlen(sep + 1));
+        if (master == NULL || dependent == NULL ||
+            master->entry_type != V4L2_CONTROL || dependent->entry_type != V4L2_CONTROL)
+        {
+            if (!ui_initialized)
+            {
+                printf("INFO: Ignored dependency: %s\n", depend_args[i]);
+            }
+            continue;
+        }
+        depend_pairs[depend_count].master = master->id;
+        depend_pairs[depend_count].dependent = dependent->id;
+        depend_count++;
+    }
+    control_poll_update();
+}
+
+/*
+ * Config files, presets, reset and search work with all controls. What
+ * the startup has not read yet is read now and the -D dependencies are
+ * resolved, so a batch planned afterwards follows them.
+ */
+static void control_enumerate_all()
+{
+    int last = ctrl_last;
+    int i;
+
+    for (i = 0; i < class_count; i++)
+    {
+        if (!ctrl_classes[i].enumerated)
+        {
+            v4l2_get_controls();
+            break;
+        }
+    }
+    if (startup_stage <= STARTUP_STREAM)
+    {
+        v4l2_init_format();
+        v4l2_init_fps();
+    }
+    if (startup_stage <= STARTUP_MEDIA)
+    {
+        media_add_controls();
+        if (depend_arg_count)
+        {
+            depend_resolve();
+        }
+        startup_stage = STARTUP_DEPEND;
+    }
+    if (ctrl_last != last)
+    {
+        control_view_update();
+    }
+}
+
+static void control_load_value(struct control_mapping *cm, int value, int source)
+{
+    int old_value;
+
+    value = control_value_from_file(cm, value);
+    if (cm->value != value)
+    {
+        old_value = cm->value;
+        cm->value = value;
+        control_apply(cm, old_value, source);
+    }
+}
+
+/* stream parameters first, then the controls in planned order */
+static void control_load_entries(int source)
+{
+    struct v4l2_ext_control *items = calloc(config_entry_count + 1, sizeof(struct v4l2_ext_control));
+    struct control_mapping *cm;
+    int count = 0;
+    int i;
+
+    if (items == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < config_entry_count; i++)
+    {
+        cm = &ctrl_mapping[config_entries[i].index];
+        if (cm->entry_type == V4L2_CONTROL)
+        {
+            count = batch_add(items, count, cm->id, config_entries[i].value);
+        }
+        else
+        {
+            control_load_value(cm, config_entries[i].value, source);
+        }
+    }
+
+    apply_plan(v4l2_dev_fd, items, count);
+    for (i = 0; i < count; i++)
+    {
+        control_load_value(control_by_id(items[i].id), items[i].value, source);
+    }
+    free(items);
+}
+
+/* open an additional camera and learn the names of its writable controls */
+static int sync_open(struct sync_device *dev)
+{
+    const struct control_info *info;
+    struct v4l2_capability cap;
+    struct v4l2_queryctrl queryctrl;
+    struct sync_control *controls;
+    int size = 0;
+
+    dev->fd = v4l2_node_open(dev->devname, O_RDWR | O_NONBLOCK);
+    if (dev->fd == -1)
+    {
+        printf("ERROR: Device %s open failed: %s (%d)\n", dev->devname, strerror(errno), errno);
+        return -1;
+    }
+
+    if (v4l2_ioctl(dev->fd, VIDIOC_QUERYCAP, &cap) < 0 || !(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
+    {
+        printf("ERROR: %s is no video capture device\n", dev->devname);
+        return -1;
+    }
+
+    memset(&queryctrl, 0, sizeof(queryctrl));
+    queryctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+    while (v4l2_ioctl(dev->fd, VIDIOC_QUERYCTRL, &queryctrl) == 0)
+    {
+        if (queryctrl.type != V4L2_CTRL_TYPE_CTRL_CLASS &&
+            queryctrl.type < V4L2_CTRL_COMPOUND_TYPES &&
+            !(queryctrl.flags & (V4L2_CTRL_FLAG_DISABLED | V4L2_CTRL_FLAG_READ_ONLY)))
+        {
+            if (dev->control_count == size)
+            {
+                size = size ? size * 2 : 32;
+                controls = realloc(dev->controls, size * sizeof(struct sync_control));
+                if (controls == NULL)
+                {
+                    printf("ERROR: Out of memory\n");
+                    return -1;
+                }
+                dev->controls = controls;
+            }
+            info = control_info_find(queryctrl.id);
+            dev->controls[dev->control_count].id = queryctrl.id;
+            dev->controls[dev->control_count].var_name = name2var((char *)queryctrl.name);
+            dev->controls[dev->control_count].alias = info ? info->var_name : NULL;
+            dev->control_count++;
+        }
+        queryctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+    }
+
+    dev->items = calloc(dev->control_count ? dev->control_count : 1, sizeof(struct v4l2_ext_control));
+    if (dev->items == NULL)
+    {
+        printf("ERROR: Out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void sync_stage(struct sync_device *dev)
+{
+    struct sync_control *sc;
+    int i;
+    int j;
+
+    dev->count = 0;
+    for (i = 0; i < sync_entry_count; i++)
+    {
+        for (j = 0; j < dev->control_count; j++)
+        {
+            sc = &dev->controls[j];
+            if (!strcmp(sc->var_name, sync_entries[i].name) ||
+                (sc->alias && !strcmp(sc->alias, sync_entries[i].name)))
+            {
+                dev->count = batch_add(dev->items, dev->count, sc->id, sync_entries[i].value);
+                break;
+            }
+        }
+    }
+    apply_plan(dev->fd, dev->items, dev->count);
+}
+
+/*
+ * Camera threads run for the whole session. For every preset each of them
+ * stages its batch, waits until all cameras are staged and then writes it.
+ */
+static void *sync_worker(void *data)
+{
+    struct sync_device *dev = data;
+
+    for (;;)
+    {
+        pthread_barrier_wait(&sync_start);
+        if (atomic_load(&sync_quit))
+        {
+            break;
+        }
+        if (dev != &sync_devices[0])
+        {
+            sync_stage(dev);
+        }
+
+        pthread_barrier_wait(&sync_release);
+        dev->release_us = monotonic_us();
+        if (dev == &sync_devices[0])
+        {
+            /* controls of the UI device may belong to its sub-devices */
+            dev->failed = dev->count ? v4l2_set_ctrl_values(dev->items, dev->count) : 0;
+        }
+        else
+        {
+            dev->failed = dev->count ? v4l2_fd_set_ctrl_values(dev->fd, dev->items, dev->count) : 0;
+        }
+        dev->done_us = monotonic_us();
+        pthread_barrier_wait(&sync_done);
+    }
+    return NULL;
+}
+
+/* a failed thread start leaves the barriers incomplete, the caller has to exit */
+static int sync_start_threads()
+{
+    int i;
+
+    pthread_barrier_init(&sync_start, NULL, sync_count + 2);
+    pthread_barrier_init(&sync_release, NULL, sync_count + 2);
+    pthread_barrier_init(&sync_done, NULL, sync_count + 2);
+    for (i = 0; i <= sync_count; i++)
+    {
+        if (pthread_create(&sync_devices[i].thread, NULL, sync_worker, &sync_devices[i]) != 0)
+        {
+            printf("ERROR: Cannot start thread for %s\n", sync_devices[i].devname);
+            return -1;
+        }
+    }
+    sync_threads = true;
+    return 0;
+}
+
+static void sync_stop_threads()
+{
+    int i;
+
+    if (!sync_threads)
+    {
+        return;
+    }
+    atomic_store(&sync_quit, true);
+    pthread_barrier_wait(&sync_start);
+    for (i = 0; i <= sync_count; i++)
+    {
+        pthread_join(sync_devices[i].thread, NULL);
+    }
+    pthread_barrier_destroy(&sync_start);
+    pthread_barrier_destroy(&sync_release);
+    pthread_barrier_destroy(&sync_done);
+    sync_threads = false;
+}
+
+static void sync_close()
+{
+    int i;
+    int j;
+
+    sync_stop_threads();
+    for (i = 1; i <= sync_count; i++)
+    {
+        if (sync_devices[i].fd >= 0)
+        {
+            close(sync_devices[i].fd);
+            sync_devices[i].fd = -1;
+        }
+        for (j = 0; j < sync_devices[i].control_count; j++)
+        {
+            free(sync_devices[i].controls[j].var_name);
+        }
+        free(sync_devices[i].controls);
+        sync_devices[i].controls = NULL;
+        sync_devices[i].control_count = 0;
+    }
+    for (i = 0; i <= sync_count; i++)
+    {
+        free(sync_devices[i].items);
+        sync_devices[i].items = NULL;
+    }
+    free(sync_entries);
+    sync_entries = NULL;
+    sync_entry_size = 0;
+}
+
+/* the UI device keeps the resolved entry, the -m devices get the name */
+static void sync_collect_entry(const char *name, size_t length, int value, void *data)
+{
+    struct sync_entry *entries;
+
+    config_collect_entry(name, length, value, data);
+
+    if (sync_entry_count == sync_entry_size)
+    {
+        entries = realloc(sync_entries, (sync_entry_size ? sync_entry_size * 2 : 32) * sizeof(struct sync_entry));
+        if (entries == NULL)
+        {
+            return;
+        }
+        sync_entries = entries;
+        sync_entry_size = sync_entry_size ? sync_entry_size * 2 : 32;
+    }
+    memcpy(sync_entries[sync_entry_count].name, name, length);
+    sync_entries[sync_entry_count].name[length] = '\0';
+    sync_entries[sync_entry_count].value = value;
+    sync_entry_count++;
+}
+
+/*
+ * Apply a preset to the UI device and all -m devices at the same instant.
+ * The camera threads are released together after staging their batched
+ * writes, the spread of their completion times is reported as skew.
+ */
+static int sync_load(const char *filename, int source, struct config_result *result, char *status, size_t size)
+{
+    struct sync_device *primary = &sync_devices[0];
+    struct control_mapping *cm;
+    uint64_t first_us = UINT64_MAX;
+    uint64_t last_us = 0;
+    struct v4l2_ext_control *items;
+    int *old_values;
+    int failed = 0;
+    size_t length;
+    int i;
+
+    /* classes are enumerated on demand, the mapping may have grown */
+    items = realloc(primary->items, (ctrl_last ? ctrl_last : 1) * sizeof(struct v4l2_ext_control));
+    if (items == NULL)
+    {
+        return -1;
+    }
+    primary->items = items;
+
+    config_entry_count = 0;
+    sync_entry_count = 0;
+    if (config_parse(filename, sync_collect_entry, NULL, result) < 0)
+    {
+        return -1;
+    }
+
+    old_values = calloc(ctrl_last ? ctrl_last : 1, sizeof(int));
+    if (old_values == NULL)
+    {
+        return -1;
+    }
+    for (i = 0; i < ctrl_last; i++)
+    {
+        old_values[i] = ctrl_mapping[i].value;
+    }
+
+    /* the UI device is staged here, its names resolve through the control mapping */
+    primary->count = 0;
+    for (i = 0; i < config_entry_count && !device_lost; i++)
+    {
+        cm = &ctrl_mapping[config_entries[i].index];
+        if (cm->entry_type == V4L2_CONTROL)
+        {
+            primary->count = batch_add(primary->items, primary->count, cm->id, config_entries[i].value);
+        }
+    }
+    primary->fd = v4l2_dev_fd;
+    apply_plan(primary->fd, primary->items, primary->count);
+
+    pthread_barrier_wait(&sync_start);
+    pthread_barrier_wait(&sync_release);
+    pthread_barrier_wait(&sync_done);
+
+    for (i = 0; i <= sync_count; i++)
+    {
+        first_us = sync_devices[i].done_us < first_us ? sync_devices[i].done_us : first_us;
+        last_us = sync_devices[i].done_us > last_us ? sync_devices[i].done_us : last_us;
+        failed += sync_devices[i].failed;
+    }
+
+    /* the driver may have refused single values of the UI device */
+    if (primary->failed)
+    {
+        v4l2_get_ctrl_values(primary->items, primary->count);
+    }
+    for (i = 0; i < primary->count; i++)
+    {
+        cm = control_by_id(primary->items[i].id);
+        cm->value = primary->items[i].value;
+        if (cm->value != old_values[cm - ctrl_mapping])
+        {
+            control_record(cm, old_values[cm - ctrl_mapping], source);
+        }
+        control_refresh_related(cm);
+    }
+    free(old_values);
+
+    /* stream parameters are not part of the synchronised batch */
+    for (i = 0; i < config_entry_count; i++)
+    {
+        cm = &ctrl_mapping[config_entries[i].index];
+        if (cm->entry_type == V4L2_PARAM)
+        {
+            control_load_value(cm, config_entries[i].value, source);
+        }
+    }
+
+    length = snprintf(status, size, "synced on %d cameras, skew %llu us [", sync_count + 1,
+                      (unsigned long long)(last_us - first_us));
+    for (i = 0; i <= sync_count && length < size; i++)
+    {
+        length += snprintf(status + length, size - length, i ? " +%llu" : "+%llu",
+                           (unsigned long long)(sync_devices[i].done_us - first_us));
+    }
+    if (length < size)
+    {
+        length += snprintf(status + length, size - length, "]");
+    }
+    if (failed && length < size)
+    {
+        snprintf(status + length, size - length, ", %d failed", failed);
+    }
+    return 0;
+}
+
+static void control_load(const char *title, const char *filename, int source)
+{
+    struct config_result result;
+    char status[128];
+    int ret;
+
+    TRACE2(control_load_entry, filename, source);
+
+    mvprintw(0, 20, "%*s", 60, " ");
+
+    control_enumerate_all();
+
+    status[0] = '\0';
+    if (source == JOURNAL_PRESET && sync_count)
+    {
+        ret = sync_load(filename, source, &result, status, sizeof(status));
+    }
+    else
+    {
+        config_entry_count = 0;
+        ret = config_parse(filename, config_collect_entry, NULL, &result);
+        if (ret == 0)
+        {
+            control_load_entries(source);
+        }
+    }
+
+    if (ret < 0)
+    {
+        mvprintw(0, 20, "Cannot load %s", filename);
+    }
+    else if (result.errors)
+    {
+        mvprintw(0, 20, "%s file %s: %d errors, line %d: %s", title, filename,
+                 result.errors, result.error_line, result.error);
+    }
+    else if (status[0])
+    {
+        mvprintw(0, 20, "%s %s", title, status);
+    }
+    else
+    {
+        mvprintw(0, 20, "%s file %s loaded", title, filename);
+    }
+    ui_refresh();
+
+    TRACE3(control_load_return, filename, ret < 0 ? 0 : result.entries, ret < 0 ? ret : result.errors);
+}
+
+static void control_save(const char *title, const char *filename)
+{
+    int written = 0;
+    int value;
+    int ret = 0;
+    FILE *fp;
+
+    TRACE1(control_save_entry, filename);
+
+    // Overwrite existing file
+    fp = fopen(filename, "w");
+
+    mvprintw(0, 20, "%*s", 60, " ");
+
+    control_enumerate_all();
+    if (fp != NULL)
+    {
+        for (int i = 0; i < ctrl_last; i++)
+        {
+            value = 0;
+            if (control_is_persistent(&ctrl_mapping[i]) &&
+                ctrl_mapping[i].value != ctrl_mapping[i].default_value)
+            {
+                value = control_file_value(&ctrl_mapping[i]);
+                fprintf(fp, "%s=%d\r\n", ctrl_mapping[i].var_name, value);
+                written++;
+            }
+        }
+        ret = fclose(fp);
+        mvprintw(0, 20, "%s file %s saved", title, filename);
+    }
+    else
+    {
+        ret = -1;
+        mvprintw(0, 20, "Cannot save %s", filename);
+    }
+    ui_refresh();
+
+    TRACE3(control_save_return, filename, written, ret);
+}
+
+static int presets_read(const char *fpath,
+                        const struct stat *sb,
+                        int tflag)
+{
+    char *file = NULL;
+    int index = 0;
+
+    (void)(tflag); /* avoid warning: unused parameter 'tflag' */
+
+    if (!S_ISDIR(sb->st_mode))
+    {
+        file = (char *)(fpath + strlen(presets_path));
+
+        if (file[0] == '/')
+        {
+            file++;
+        }
+
+        if (preset_alpabetically)
+        {
+            if (alpha_index < 9)
+            {
+                presets[alpha_index].path = strdup((const char *)fpath);
+                presets[alpha_index].name = strdup((const char *)file);
+                printf("%d %s\n", alpha_index, presets[alpha_index].name);
+                alpha_index++;
+            }
+        }
+        else if (file[0] > 48 && file[0] < 58)
+        {
+            index = (int)file[0] - 49;
+            presets[index].path = strdup((const char *)fpath);
+            file++;
+
+            while (!isalnum((int)file[0]))
+            {
+                file++;
+            }
+            presets[index].name = strdup((const char *)file);
+        }
+    }
+    return 0;
+}
+
+static int sort_presets(const void *v1, const void *v2)
+{
+    const struct preset *p1 = (struct preset *)v1;
+    const struct preset *p2 = (struct preset *)v2;
+    int rc = strcmp(p1->name, p2->name);
+    if (rc < 0)
+    {
+        return -1;
+    }
+    else if (rc > 0)
+    {
+        return +1;
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+static void get_preset_files()
+{
+    if (presets_path)
+    {
+        ftw(presets_path, presets_read, 20);
+        if (preset_alpabetically && alpha_index > 0)
+        {
+            qsort(presets, alpha_index, sizeof(struct preset), sort_presets);
+        }
+    }
+}
+
+static void load_preset(int index)
+{
+    if (index >= 0 && index < 9)
+    {
+        if (presets[index].path)
+        {
+            control_load("Preset", presets[index].path, JOURNAL_PRESET);
+            last_preset_loaded = index;
+        }
+    }
+}
+
+static void load_next_preset()
+{
+    int i;
+
+    if (last_preset_loaded < 0)
+    {
+        for (i = 0; i < 9; i++)
+        {
+            if (presets[i].path)
+            {
+                load_preset(i);
+                return;
+            }
+        }
+    }
+    else
+    {
+        for (i = last_preset_loaded + 1; i < 9; i++)
+        {
+            if (presets[i].path)
+            {
+                load_preset(i);
+                return;
+            }
+        }
+        for (i = 0; i < last_preset_loaded; i++)
+        {
+            if (presets[i].path)
+            {
+                load_preset(i);
+                return;
+            }
+        }
+    }
+}
+
+static void snapshot_undo()
+{
+    struct snapshot *current;
+    struct snapshot *snap;
+    int changed;
+
+    mvprintw(0, 20, "%*s", 60, " ");
+    if (!undo_count)
+    {
+        mvprintw(0, 20, "Nothing to undo");
+        ui_refresh();
+        return;
+    }
+
+    snap = undo_stack[undo_count - 1];
+    current = snapshot_take(snap, NULL, 0);
+    changed = current ? snapshot_restore(snap) : -1;
+    undo_last_key = -1;
+    if (changed < 0)
+    {
+        snapshot_free(current);
+        mvprintw(0, 20, "Undo: out of memory, nothing changed");
+        ui_refresh();
+        return;
+    }
+    undo_count--;
+    snapshot_push(redo_stack, &redo_count, current);
+    snapshot_free(snap);
+
+    mvprintw(0, 20, "Undo: %d controls changed, %d more steps", changed, undo_count);
+    ui_refresh();
+}
+
+static void snapshot_redo()
+{
+    struct snapshot *current;
+    struct snapshot *snap;
+    int changed;
+
+    mvprintw(0, 20, "%*s", 60, " ");
+    if (!redo_count)
+    {
+        mvprintw(0, 20, "Nothing to redo");
+        ui_refresh();
+        return;
+    }
+
+    snap = redo_stack[redo_count - 1];
+    current = snapshot_take(snap, NULL, 0);
+    changed = current ? snapshot_restore(snap) : -1;
+    undo_last_key = -1;
+    if (changed < 0)
+    {
+        snapshot_free(current);
+        mvprintw(0, 20, "Redo: out of memory, nothing changed");
+        ui_refresh();
+        return;
+    }
+    redo_count--;
+    snapshot_push(undo_stack, &undo_count, current);
+    snapshot_free(snap);
+
+    mvprintw(0, 20, "Redo: %d controls changed, %d more steps", changed, redo_count);
+    ui_refresh();
+}
+
+static void snapshot_store(int slot)
+{
+    control_enumerate_all();
+
+    snapshot_free(snapshot_ab[slot]);
+    snapshot_ab[slot] = snapshot_take(snapshot_latest(), NULL, 0);
+    snapshot_ab_active = slot;
+
+    mvprintw(0, 20, "%*s", 60, " ");
+    mvprintw(0, 20, snapshot_ab[slot] ? "Snapshot %c stored" : "Snapshot %c: out of memory", 'A' + slot);
+    ui_refresh();
+}
+
+/* switch to the other of the A/B snapshots, the switch itself can be undone */
+static void snapshot_toggle()
+{
+    int slot = snapshot_ab_active == 0 ? 1 : 0;
+    struct snapshot *current;
+    int changed;
+
+    mvprintw(0, 20, "%*s", 60, " ");
+    if (snapshot_ab[slot] == NULL)
+    {
+        mvprintw(0, 20, "Snapshot %c is empty", 'A' + slot);
+        ui_refresh();
+        return;
+    }
+
+    current = snapshot_take(snapshot_latest(), NULL, 0);
+    changed = current ? snapshot_restore(snapshot_ab[slot]) : -1;
+    if (changed < 0)
+    {
+        snapshot_free(current);
+        mvprintw(0, 20, "Snapshot %c: out of memory, nothing changed", 'A' + slot);
+        ui_refresh();
+        return;
+    }
+    if (changed)
+    {
+        snapshot_push(undo_stack, &undo_count, current);
+        snapshot_clear(redo_stack, &redo_count);
+    }
+    else
+    {
+        snapshot_free(current);
+    }
+    undo_last_key = -1;
+    snapshot_ab_active = slot;
+
+    mvprintw(0, 20, "Snapshot %c restored: %d controls changed", 'A' + slot, changed);
+    ui_refresh();
+}
+
+/*
+ * Copy one row of luma samples into dst and return their sum.
+ * Packed 4:2:2 formats carry luma in every second byte, planar
+ * formats start with a contiguous luma plane.
+ */
+static unsigned int luma_row_extract(const unsigned char *src, unsigned char *dst,
+                                     unsigned int width, int step, int offset)
+{
+    unsigned int sum = 0;
+    unsigned int x = 0;
+
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    __m128i a;
+    __m128i b;
+    __m128i y;
+
+    if (step == 2)
+    {
+        for (; x + 16 <= width; x += 16)
+        {
+            a = _mm_loadu_si128((const __m128i *)(src + 2 * x));
+            b = _mm_loadu_si128((const __m128i *)(src + 2 * x + 16));
+            if (offset)
+            {
+                a = _mm_srli_epi16(a, 8);
+                b = _mm_srli_epi16(b, 8);
+            }
+            else
+            {
+                a = _mm_and_si128(a, mask);
+                b = _mm_and_si128(b, mask);
+            }
+            y = _mm_packus_epi16(a, b);
+            _mm_storeu_si128((__m128i *)(dst + x), y);
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(y, zero));
+        }
+    }
+    else
+    {
+        for (; x + 16 <= width; x += 16)
+        {
+            y = _mm_loadu_si128((const __m128i *)(src + x));
+            _mm_storeu_si128((__m128i *)(dst + x), y);
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(y, zero));
+        }
+    }
+    sum = (unsigned int)_mm_cvtsi128_si32(acc) +
+          (unsigned int)_mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+#elif defined(__ARM_NEON)
+    uint32x4_t acc = vdupq_n_u32(0);
+    uint8x16x2_t v;
+    uint8x16_t y;
+
+    for (; x + 16 <= width; x += 16)
+    {
+        if (step == 2)
+        {
+            v = vld2q_u8(src + 2 * x);
+            y = offset ? v.val[1] : v.val[0];
+        }
+        else
+        {
+            y = vld1q_u8(src + x);
+        }
+        vst1q_u8(dst + x, y);
+        acc = vpadalq_u16(acc, vpaddlq_u8(y));
+    }
+    sum = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+          vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+
+    for (; x < width; x++)
+    {
+        dst[x] = src[x * step + offset];
+        sum += dst[x];
+    }
+    return sum;
+}
+
+static int scene_compute_stats(const unsigned char *data, size_t bytesused, struct scene_stats *st)
+{
+    static unsigned int hist[4][256];
+    int step = luma_pixel_step(capture_pixelformat);
+    int offset = (capture_pixelformat == V4L2_PIX_FMT_UYVY ||
+                  capture_pixelformat == V4L2_PIX_FMT_VYUY)
+                     ? 1
+                     : 0;
+    uint64_t start = monotonic_us();
+    uint64_t sum = 0;
+    unsigned int half;
+    unsigned int acc = 0;
+    unsigned int row;
+    unsigned int x;
+    int i;
+
+    if (!step || bytesused < (size_t)capture_bytesperline * capture_height)
+    {
+        return -EINVAL;
+    }
+
+    if (!scene_row)
+    {
+        scene_row = malloc(capture_width + 16);
+        if (!scene_row)
+        {
+            return -ENOMEM;
+        }
+    }
+
+    memset(hist, 0, sizeof(hist));
+
+    for (row = 0; row < capture_height; row += SCENE_ROW_STEP)
+    {
+        sum += luma_row_extract(data + (size_t)row * capture_bytesperline, scene_row,
+                                capture_width, step, offset);
+
+        /* four partial histograms keep consecutive equal samples independent */
+        for (x = 0; x + 4 <= capture_width; x += 4)
+        {
+            hist[0][scene_row[x]]++;
+            hist[1][scene_row[x + 1]]++;
+            hist[2][scene_row[x + 2]]++;
+            hist[3][scene_row[x + 3]]++;
+        }
+        for (; x < capture_width; x++)
+        {
+            hist[0][scene_row[x]]++;
+        }
+    }
+
+    st->count = 0;
+    for (i = 0; i < 256; i++)
+    {
+        st->histogram[i] = hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i];
+        st->count += st->histogram[i];
+    }
+
+    st->mean = st->count ? (double)sum / st->count : 0;
+    st->median = 0;
+    half = st->count / 2;
+    for (i = 0; i < 256; i++)
+    {
+        acc += st->histogram[i];
+        if (acc > half)
+        {
+            st->median = i;
+            break;
+        }
+    }
+
+    st->elapsed_us = (long)(monotonic_us() - start);
+    return 0;
+}
+
+/*
+ * Add the 4-neighbour Laplacian of width luma samples of mid and its square
+ * to sum and sumsq. All three rows have one more sample on either side. The
+ * Laplacian of 8 bit samples fits 16 bits, wrapping unsigned arithmetic
+ * leaves its two's complement in every lane. Squares are summed in 32 bit
+ * lanes, which holds for rows of up to 8192 samples.
+ */
+static void focus_row_laplacian(const unsigned char *up, const unsigned char *mid, const unsigned char *down,
+                                unsigned int width, int64_t *sum, uint64_t *sumsq)
+{
+    const unsigned char *left = mid - 1;
+    const unsigned char *right = mid + 1;
+    unsigned int x = 0;
+    int lap;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i acc = zero;
+    __m128i accsq = zero;
+    __m128i c;
+    __m128i n;
+    __m128i l;
+    __m128i h;
+    uint64_t lanes[2];
+
+    for (; x + 16 <= width; x += 16)
+    {
+        c = _mm_loadu_si128((const __m128i *)(mid + x));
+        n = _mm_loadu_si128((const __m128i *)(left + x));
+        l = _mm_sub_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(c, zero), 2), _mm_unpacklo_epi8(n, zero));
+        h = _mm_sub_epi16(_mm_slli_epi16(_mm_unpackhi_epi8(c, zero), 2), _mm_unpackhi_epi8(n, zero));
+        n = _mm_loadu_si128((const __m128i *)(right + x));
+        l = _mm_sub_epi16(l, _mm_unpacklo_epi8(n, zero));
+        h = _mm_sub_epi16(h, _mm_unpackhi_epi8(n, zero));
+        n = _mm_loadu_si128((const __m128i *)(up + x));
+        l = _mm_sub_epi16(l, _mm_unpacklo_epi8(n, zero));
+        h = _mm_sub_epi16(h, _mm_unpackhi_epi8(n, zero));
+        n = _mm_loadu_si128((const __m128i *)(down + x));
+        l = _mm_sub_epi16(l, _mm_unpacklo_epi8(n, zero));
+        h = _mm_sub_epi16(h, _mm_unpackhi_epi8(n, zero));
+
+        acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(l, ones), _mm_madd_epi16(h, ones)));
+        accsq = _mm_add_epi32(accsq, _mm_add_epi32(_mm_madd_epi16(l, l), _mm_madd_epi16(h, h)));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    *sum += _mm_cvtsi128_si32(acc);
+    accsq = _mm_add_epi64(_mm_unpacklo_epi32(accsq, zero), _mm_unpackhi_epi32(accsq, zero));
+    _mm_storeu_si128((__m128i *)lanes, accsq);
+    *sumsq += lanes[0] + lanes[1];
+#elif defined(__ARM_NEON)
+    int32x4_t acc = vdupq_n_s32(0);
+    uint32x4_t accsq = vdupq_n_u32(0);
+    uint8x16_t c;
+    uint8x16_t l;
+    uint8x16_t r;
+    uint8x16_t u;
+    uint8x16_t d;
+    int16x8_t lo;
+    int16x8_t hi;
+    uint16x8_t a;
+    uint64x2_t sq;
+
+    for (; x + 16 <= width; x += 16)
+    {
+        c = vld1q_u8(mid + x);
+        l = vld1q_u8(left + x);
+        r = vld1q_u8(right + x);
+        u = vld1q_u8(up + x);
+        d = vld1q_u8(down + x);
+        lo = vreinterpretq_s16_u16(vsubq_u16(vshll_n_u8(vget_low_u8(c), 2),
+                                             vaddq_u16(vaddl_u8(vget_low_u8(l), vget_low_u8(r)),
+                                                       vaddl_u8(vget_low_u8(u), vget_low_u8(d)))));
+        hi = vreinterpretq_s16_u16(vsubq_u16(vshll_n_u8(vget_high_u8(c), 2),
+                                             vaddq_u16(vaddl_u8(vget_high_u8(l), vget_high_u8(r)),
+                                                       vaddl_u8(vget_high_u8(u), vget_high_u8(d)))));
+        acc = vpadalq_s16(vpadalq_s16(acc, lo), hi);
+
+        a = vreinterpretq_u16_s16(vabsq_s16(lo));
+        accsq = vmlal_u16(vmlal_u16(accsq, vget_low_u16(a), vget_low_u16(a)), vget_high_u16(a), vget_high_u16(a));
+        a = vreinterpretq_u16_s16(vabsq_s16(hi));
+        accsq = vmlal_u16(vmlal_u16(accsq, vget_low_u16(a), vget_low_u16(a)), vget_high_u16(a), vget_high_u16(a));
+    }
+    *sum += (int64_t)vgetq_lane_s32(acc, 0) + vgetq_lane_s32(acc, 1) +
+            vgetq_lane_s32(acc, 2) + vgetq_lane_s32(acc, 3);
+    sq = vpaddlq_u32(accsq);
+    *sumsq += vgetq_lane_u64(sq, 0) + vgetq_lane_u64(sq, 1);
+#endif
+
+    for (; x < width; x++)
+    {
+        lap = 4 * mid[x] - left[x] - right[x] - up[x] - down[x];
+        *sum += lap;
+        *sumsq += (uint64_t)(lap * lap);
+    }
+}
+
+/*
+ * Sharpness is the variance of the Laplacian of the luma in the centre
+ * half of the frame. Every ROI row is extracted once into a ring of three.
+ */
+static int focus_compute(const unsigned char *data, size_t bytesused, struct focus_stats *fs)
+{
+    int step = luma_pixel_step(capture_pixelformat);
+    int offset = (capture_pixelformat == V4L2_PIX_FMT_UYVY ||
+                  capture_pixelformat == V4L2_PIX_FMT_VYUY)
+                     ? 1
+                     : 0;
+    unsigned int left = capture_width / 4;
+    unsigned int top = capture_height / 4;
+    unsigned int width = capture_width / 2;
+    unsigned int height = capture_height / 2;
+    unsigned int stride = width + 2;
+    uint64_t start = monotonic_us();
+    uint64_t sumsq = 0;
+    int64_t sum = 0;
+    double count;
+    double mean;
+    unsigned int row;
+
+    if (!step || capture_width < 4 || capture_height < 4 ||
+        bytesused < (size_t)capture_bytesperline * capture_height)
+    {
+        return -EINVAL;
+    }
+
+    if (!focus_rows)
+    {
+        focus_rows = malloc(3 * stride);
+        if (!focus_rows)
+        {
+            return -ENOMEM;
+        }
+    }
+
+    for (row = top - 1; row <= top + height; row++)
+    {
+        luma_row_extract(data + (size_t)row * capture_bytesperline + (left - 1) * step,
+                         focus_rows + (row % 3) * stride, stride, step, offset);
+        if (row > top)
+        {
+            focus_row_laplacian(focus_rows + ((row - 2) % 3) * stride + 1,
+                                focus_rows + ((row - 1) % 3) * stride + 1,
+                                focus_rows + (row % 3) * stride + 1, width, &sum, &sumsq);
+        }
+    }
+
+    count = (double)width * height;
+    mean = sum / count;
+    fs->sharpness = sumsq / count - mean * mean;
+    fs->elapsed_us = (long)(monotonic_us() - start);
+    return 0;
+}
+
+/*
+ * Pick scene band for measured mean luma. Leaving the active band needs
+ * the mean to pass the neighbouring threshold by the hysteresis margin
+ * and the new band has to win SCENE_DWELL consecutive measurements.
+ */
+static bool scene_update(const struct scene_stats *st)
+{
+    int band = scene_band_active;
+
+    if (!scene_band_count)
+    {
+        return false;
+    }
+
+    if (band < 0)
+    {
+        for (band = scene_band_count - 1; band > 0; band--)
+        {
+            if (st->mean >= scene_bands[band].threshold)
+            {
+                break;
+            }
+        }
+        scene_band_active = band;
+        return true;
+    }
+
+    while (band + 1 < scene_band_count &&
+           st->mean >= scene_bands[band + 1].threshold + scene_hysteresis)
+    {
+        band++;
+    }
+    while (band > 0 && st->mean < scene_bands[band].threshold - scene_hysteresis)
+    {
+        band--;
+    }
+
+    if (band == scene_band_active)
+    {
+        scene_band_pending = -1;
+        scene_band_votes = 0;
+        return false;
+    }
+
+    if (band != scene_band_pending)
+    {
+        scene_band_pending = band;
+        scene_band_votes = 0;
+    }
+
+    if (++scene_band_votes < SCENE_DWELL)
+    {
+        return false;
+    }
+
+    scene_band_active = band;
+    scene_band_pending = -1;
+    scene_band_votes = 0;
+    return true;
+}
+
+static int sort_scene_bands(const void *v1, const void *v2)
+{
+    const struct scene_band *b1 = (struct scene_band *)v1;
+    const struct scene_band *b2 = (struct scene_band *)v2;
+
+    return b1->threshold - b2->threshold;
+}
+
+static bool scene_parse_bands(const char *spec)
+{
+    const char *pos = spec;
+    char *end;
+    long preset;
+    long threshold;
+
+    scene_band_count = 0;
+
+    while (*pos)
+    {
+        preset = strtol(pos, &end, 10);
+        if (end == pos || *end != ':' || preset < 1 || preset > 9)
+        {
+            return false;
+        }
+        pos = end + 1;
+        threshold = strtol(pos, &end, 10);
+        if (end == pos || threshold < 0 || threshold > 255 || scene_band_count >= 9)
+        {
+            return false;
+        }
+        scene_bands[scene_band_count].preset = (int)preset;
+        scene_bands[scene_band_count].threshold = (int)threshold;
+        scene_band_count++;
+
+        if (*end == ',')
+        {
+            end++;
+        }
+        else if (*end)
+        {
+            return false;
+        }
+        pos = end;
+    }
+
+    qsort(scene_bands, scene_band_count, sizeof(struct scene_band), sort_scene_bands);
+    return scene_band_count > 0;
+}
+
+static bool capture_parse_geometry(const char *spec)
+{
+    unsigned int width;
+    unsigned int height;
+    char fourcc[5] = {'\0'};
+    int n = sscanf(spec, "%ux%u:%4s", &width, &height, fourcc);
+
+    if (n < 2 || !width || !height || width > 8192 || height > 8192)
+    {
+        return false;
+    }
+
+    capture_width = width;
+    capture_height = height;
+    if (n == 3)
+    {
+        if (strlen(fourcc) != 4)
+        {
+            return false;
+        }
+        capture_pixelformat = v4l2_fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+    }
+    return true;
+}
+
+/*
+ * Per frame work of the stream probe: the interval to the previous frame
+ * goes into the window, gaps in the sequence count as dropped frames.
+ * Frames without a buffer timestamp are timed when they are dequeued.
+ */
+static void health_frame(const struct capture_frame *frame)
+{
+    uint64_t timestamp = frame->timestamp_us ? frame->timestamp_us : monotonic_us();
+
+    if (health.frames)
+    {
+        health.intervals[health.count++ & (HEALTH_WINDOW - 1)] = (uint32_t)(timestamp - health.timestamp_us);
+        if (frame->sequence - health.sequence > 1)
+        {
+            health.dropped += frame->sequence - health.sequence - 1;
+        }
+    }
+    health.sequence = frame->sequence;
+    health.timestamp_us = timestamp;
+    health.frames++;
+}
+
+static int sort_frame_intervals(const void *v1, const void *v2)
+{
+    uint32_t i1 = *(const uint32_t *)v1;
+    uint32_t i2 = *(const uint32_t *)v2;
+
+    return (i1 > i2) - (i1 < i2);
+}
+
+/* jitter is the distance of an interval from the median interval */
+static bool health_summarize(struct health_summary *hs)
+{
+    uint32_t intervals[HEALTH_WINDOW];
+    unsigned int count = health.count < HEALTH_WINDOW ? health.count : HEALTH_WINDOW;
+    uint64_t total = 0;
+    uint32_t median;
+    unsigned int i;
+
+    if (!count)
+    {
+        return false;
+    }
+
+    memcpy(intervals, health.intervals, count * sizeof(uint32_t));
+    for (i = 0; i < count; i++)
+    {
+        total += intervals[i];
+    }
+    hs->fps = total ? 1000000.0 * count / total : 0;
+
+    qsort(intervals, count, sizeof(uint32_t), sort_frame_intervals);
+    median = intervals[count / 2];
+    for (i = 0; i < count; i++)
+    {
+        intervals[i] = intervals[i] > median ? intervals[i] - median : median - intervals[i];
+    }
+    qsort(intervals, count, sizeof(uint32_t), sort_frame_intervals);
+    for (i = 0; i < HEALTH_PERCENTILES; i++)
+    {
+        hs->jitter_ms[i] = intervals[(count - 1) * health_percentiles[i] / 100] / 1000.0;
+    }
+    return true;
+}
+
+/* sharpness of every frame of the raw file and the sharpest one */
+static int focus_replay()
+{
+    struct capture_frame frame;
+    struct focus_stats fs;
+    unsigned int best_frame = 0;
+    double best = -1;
+    long total_us = 0;
+    long max_us = 0;
+    int frames = 0;
+
+    if (capture_start() < 0)
+    {
+        return 1;
+    }
+
+    printf("INFO: %6s %12s %8s\n", "frame", "sharpness", "time_us");
+
+    while (capture_next(&frame) > 0)
+    {
+        if (focus_compute(frame.data, frame.bytesused, &fs) < 0)
+        {
+            break;
+        }
+        printf("INFO: %6u %12.1f %8ld\n", frame.sequence, fs.sharpness, fs.elapsed_us);
+
+        if (fs.sharpness > best)
+        {
+            best = fs.sharpness;
+            best_frame = frame.sequence;
+        }
+        total_us += fs.elapsed_us;
+        max_us = fs.elapsed_us > max_us ? fs.elapsed_us : max_us;
+        frames++;
+    }
+
+    if (frames)
+    {
+        printf("INFO: %d frames, average %ld us, maximum %ld us, sharpest frame %u (%.1f)\n", frames,
+               total_us / frames, max_us, best_frame, best);
+    }
+
+    capture_stop();
+    return 0;
+}
+
+static int scene_replay()
+{
+    struct capture_frame frame;
+    struct scene_stats st;
+    long total_us = 0;
+    long max_us = 0;
+    int frames = 0;
+    int preset;
+
+    get_preset_files();
+
+    if (capture_start() < 0)
+    {
+        return 1;
+    }
+
+    printf("INFO: %6s %6s %4s %8s  %s\n", "frame", "mean", "p50", "time_us", "preset");
+
+    while (capture_next(&frame) > 0)
+    {
+        if (scene_compute_stats(frame.data, frame.bytesused, &st) < 0)
+        {
+            break;
+        }
+        scene_update(&st);
+
+        preset = scene_band_active >= 0 ? scene_bands[scene_band_active].preset : 0;
+        printf("INFO: %6u %6.1f %4d %8ld  %d %s\n", frame.sequence, st.mean, st.median,
+               st.elapsed_us, preset, (preset && presets[preset - 1].name) ? presets[preset - 1].name : "");
+
+        total_us += st.elapsed_us;
+        max_us = st.elapsed_us > max_us ? st.elapsed_us : max_us;
+        frames++;
+    }
+
+    if (frames)
+    {
+        printf("INFO: %d frames, average %ld us, maximum %ld us\n", frames, total_us / frames, max_us);
+    }
+
+    capture_stop();
+    return 0;
+}
+
+static void journal_batch_flush(struct journal_batch *batch)
+{
+    int i;
+
+    if (!batch->count)
+    {
+        return;
+    }
+
+    batch->failed += v4l2_set_ctrl_values(batch->items, batch->count);
+    for (i = 0; i < batch->count; i++)
+    {
+        batch->targets[i]->value = batch->items[i].value;
+    }
+    batch->writes++;
+    batch->count = 0;
+}
+
+static bool journal_batch_has(struct journal_batch *batch, unsigned int id)
+{
+    int i;
+
+    for (i = 0; i < batch->count; i++)
+    {
+        if (batch->items[i].id == id)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void sleep_us(uint64_t us)
+{
+    struct timespec delay;
+
+    delay.tv_sec = us / 1000000;
+    delay.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+    {
+    }
+}
+
+/*
+ * Re-apply a change journal at its original timing, or as fast as possible.
+ * Changes due together (preset and config loads) go out in one
+ * VIDIOC_S_EXT_CTRLS, a batch ends when a control repeats.
+ */
+static int journal_replay()
+{
+    struct journal_header header;
+    struct journal_entry entry;
+    struct journal_batch batch;
+    struct control_mapping *cm;
+    uint64_t session_us = 0;
+    uint64_t start_us;
+    uint64_t due_us;
+    uint64_t now_us;
+    uint64_t replay_us;
+    int applied = 0;
+    int skipped = 0;
+    int ret = 1;
+    FILE *fp = fopen(journal_replay_file, "rb");
+
+    if (fp == NULL)
+    {
+        printf("ERROR: Cannot open journal %s: %s (%d)\n", journal_replay_file, strerror(errno), errno);
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) ||
+        header.entry_size != sizeof(struct journal_entry))
+    {
+        printf("ERROR: %s is not a journal file\n", journal_replay_file);
+        goto err;
+    }
+
+    if (v4l2_open(v4l2_devname) < 0)
+    {
+        goto err;
+    }
+
+    v4l2_format_info();
+    v4l2_enum_classes();
+    if (media_open() < 0)
+    {
+        v4l2_close();
+        control_free();
+        goto err;
+    }
+    control_enumerate_all();
+
+    memset(&batch, 0, sizeof(batch));
+    replay_us = monotonic_us();
+    start_us = replay_us;
+
+    while (fread(&entry, sizeof(entry), 1, fp) == 1)
+    {
+        if (entry.source == JOURNAL_SESSION)
+        {
+            journal_batch_flush(&batch);
+            session_us = entry.timestamp_us;
+            start_us = monotonic_us();
+            continue;
+        }
+
+        cm = control_by_journal_id(entry.id);
+        if (cm == NULL || cm->unsupported)
+        {
+            skipped++;
+            continue;
+        }
+
+        if (!journal_fast)
+        {
+            due_us = start_us + (entry.timestamp_us - session_us);
+            now_us = monotonic_us();
+            if (due_us > now_us + JOURNAL_WINDOW_US)
+            {
+                journal_batch_flush(&batch);
+                sleep_us(due_us - now_us);
+            }
+        }
+
+        if (cm->entry_type != V4L2_CONTROL)
+        {
+            journal_batch_flush(&batch);
+            cm->value = clamp((int)entry.new_value, cm->minimum, cm->maximum);
+            v4l2_apply_control(cm);
+            applied++;
+            continue;
+        }
+
+        if (batch.count == JOURNAL_BATCH_MAX || journal_batch_has(&batch, entry.id))
+        {
+            journal_batch_flush(&batch);
+        }
+        batch.items[batch.count].id = entry.id;
+        batch.items[batch.count].value = entry.new_value;
+        batch.targets[batch.count] = cm;
+        batch.count++;
+        applied++;
+    }
+    journal_batch_flush(&batch);
+
+    printf("INFO: Replayed %d changes in %d writes, %d failed, %d skipped, %ld ms\n",
+           applied, batch.writes, batch.failed, skipped, (long)((monotonic_us() - replay_us) / 1000));
+    ret = batch.failed ? 1 : 0;
+
+    v4l2_close();
+    control_free();
+
+err:
+    fclose(fp);
+    return ret;
+}
+
+static void json_string(FILE *fp, const char *value)
+{
+    fputc('"', fp);
+    for (; *value; value++)
+    {
+        if (*value == '"' || *value == '\\')
+        {
+            fprintf(fp, "\\%c", *value);
+        }
+        else if ((unsigned char)*value < 0x20)
+        {
+            fprintf(fp, "\\u%04x", (unsigned char)*value);
+        }
+        else
+        {
+            fputc(*value, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/* a record is built in memory and written as one line, records of the nodes interleave by line */
+static FILE *scan_record(char **line, size_t *size, const char *path, const char *type)
+{
+    FILE *fp = open_memstream(line, size);
+
+    if (fp)
+    {
+        fprintf(fp, "{\"device\":");
+        json_string(fp, path);
+        fprintf(fp, ",\"type\":\"%s\"", type);
+    }
+    return fp;
+}
+
+static void scan_emit(FILE *fp, char **line, size_t *size)
+{
+    if (fp == NULL)
+    {
+        return;
+    }
+    fprintf(fp, "}\n");
+    fclose(fp);
+    flockfile(stdout);
+    fwrite(*line, 1, *size, stdout);
+    fflush(stdout);
+    funlockfile(stdout);
+    free(*line);
+}
+
+static void scan_intervals(FILE *fp, int fd, unsigned int pixelformat, unsigned int width, unsigned int height)
+{
+    struct v4l2_frmivalenum fival;
+
+    memset(&fival, 0, sizeof(fival));
+    fival.pixel_format = pixelformat;
+    fival.width = width;
+    fival.height = height;
+
+    fprintf(fp, ",\"intervals\":");
+    if (v4l2_ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &fival) < 0)
+    {
+        fprintf(fp, "[]");
+    }
+    else if (fival.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+    {
+        fprintf(fp, "[");
+        do
+        {
+            fprintf(fp, "%s[%u,%u]", fival.index ? "," : "", fival.discrete.numerator, fival.discrete.denominator);
+            fival.index++;
+        } while (v4l2_ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &fival) == 0);
+        fprintf(fp, "]");
+    }
+    else
+    {
+        fprintf(fp, "{\"min\":[%u,%u],\"max\":[%u,%u],\"step\":[%u,%u]}",
+                fival.stepwise.min.numerator, fival.stepwise.min.denominator,
+                fival.stepwise.max.numerator, fival.stepwise.max.denominator,
+                fival.stepwise.step.numerator, fival.stepwise.step.denominator);
+    }
+}
+
+static int scan_formats(int fd, const char *path)
+{
+    struct v4l2_fmtdesc fmtdesc;
+    struct v4l2_frmsizeenum fsize;
+    size_t size;
+    char *line;
+    FILE *fp;
+
+    memset(&fmtdesc, 0, sizeof(fmtdesc));
+    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    for (; v4l2_ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0; fmtdesc.index++)
+    {
+        fp = scan_record(&line, &size, path, "format");
+        if (fp == NULL)
+        {
+            break;
+        }
+        fprintf(fp, ",\"fourcc\":\"%c%c%c%c\",\"description\":", pixfmtstr(fmtdesc.pixelformat));
+        json_string(fp, (const char *)fmtdesc.description);
+        fprintf(fp, ",\"flags\":%u,\"sizes\":[", fmtdesc.flags);
+
+        memset(&fsize, 0, sizeof(fsize));
+        fsize.pixel_format = fmtdesc.pixelformat;
+        for (; v4l2_ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &fsize) == 0; fsize.index++)
+        {
+            if (fsize.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+            {
+                fprintf(fp, "%s{\"width\":%u,\"height\":%u", fsize.index ? "," : "",
+                        fsize.discrete.width, fsize.discrete.height);
+                scan_intervals(fp, fd, fmtdesc.pixelformat, fsize.discrete.width, fsize.discrete.height);
+                fprintf(fp, "}");
+                continue;
+            }
+            fprintf(fp, "{\"min_width\":%u,\"max_width\":%u,\"step_width\":%u,"
+                        "\"min_height\":%u,\"max_height\":%u,\"step_height\":%u",
+                    fsize.stepwise.min_width, fsize.stepwise.max_width, fsize.stepwise.step_width,
+                    fsize.stepwise.min_height, fsize.stepwise.max_height, fsize.stepwise.step_height);
+            scan_intervals(fp, fd, fmtdesc.pixelformat, fsize.stepwise.max_width, fsize.stepwise.max_height);
+            fprintf(fp, "}");
+            break;
+        }
+        fprintf(fp, "]");
+        scan_emit(fp, &line, &size);
+    }
+    return fmtdesc.index;
+}
+
+static void scan_menu(FILE *fp, int fd, const struct v4l2_query_ext_ctrl *query)
+{
+    struct v4l2_querymenu querymenu;
+    bool first = true;
+    int64_t index;
+
+    fprintf(fp, ",\"menu\":[");
+    for (index = query->minimum; index <= query->maximum; index++)
+    {
+        memset(&querymenu, 0, sizeof(querymenu));
+        querymenu.id = query->id;
+        querymenu.index = index;
+        if (v4l2_ioctl(fd, VIDIOC_QUERYMENU, &querymenu) < 0)
+        {
+            continue;
+        }
+        fprintf(fp, "%s{\"index\":%u,", first ? "" : ",", querymenu.index);
+        if (query->type == V4L2_CTRL_TYPE_MENU)
+        {
+            fprintf(fp, "\"name\":");
+            json_string(fp, (const char *)querymenu.name);
+        }
+        else
+        {
+            fprintf(fp, "\"value\":%lld", (long long)querymenu.value);
+        }
+        fprintf(fp, "}");
+        first = false;
+    }
+    fprintf(fp, "]");
+}
+
+static int scan_controls(int fd, const char *path)
+{
+    const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+    const struct control_info *info;
+    struct v4l2_query_ext_ctrl query;
+    struct v4l2_ext_controls ctrls;
+    struct v4l2_ext_control ctrl;
+    int count = 0;
+    char *var_name;
+    size_t size;
+    char *line;
+    FILE *fp;
+
+    memset(&query, 0, sizeof(query));
+    query.id = next_fl;
+    for (; v4l2_ioctl(fd, VIDIOC_QUERY_EXT_CTRL, &query) == 0; query.id |= next_fl)
+    {
+        if (query.type == V4L2_CTRL_TYPE_CTRL_CLASS)
+        {
+            continue;
+        }
+        fp = scan_record(&line, &size, path, "control");
+        if (fp == NULL)
+        {
+            break;
+        }
+
+        var_name = name2var(query.name);
+        info = control_info_find(query.id);
+        fprintf(fp, ",\"id\":%u,\"name\":", query.id);
+        json_string(fp, query.name);
+        fprintf(fp, ",\"var\":");
+        json_string(fp, var_name);
+        if (info)
+        {
+            fprintf(fp, ",\"canonical\":");
+            json_string(fp, info->var_name);
+        }
+        if (info && info->unit)
+        {
+            fprintf(fp, ",\"unit\":");
+            json_string(fp, info->unit);
+        }
+        fprintf(fp, ",\"class\":%u,\"ctrl_type\":%u,\"minimum\":%lld,\"maximum\":%lld,\"step\":%llu,"
+                    "\"default\":%lld,\"flags\":%u,\"elems\":%u",
+                (unsigned int)V4L2_CTRL_ID2CLASS(query.id), query.type, (long long)query.minimum, (long long)query.maximum,
+                (unsigned long long)query.step, (long long)query.default_value, query.flags, query.elems);
+        free(var_name);
+
+        /* compound values have no single number, write only controls cannot be read */
+        if (query.type < V4L2_CTRL_COMPOUND_TYPES && !(query.flags & V4L2_CTRL_FLAG_WRITE_ONLY))
+        {
+            memset(&ctrls, 0, sizeof(ctrls));
+            memset(&ctrl, 0, sizeof(ctrl));
+            ctrl.id = query.id;
+            ctrls.which = V4L2_CTRL_WHICH_CUR_VAL;
+            ctrls.count = 1;
+            ctrls.controls = &ctrl;
+            if (v4l2_ioctl(fd, VIDIOC_G_EXT_CTRLS, &ctrls) == 0)
+            {
+                fprintf(fp, ",\"value\":%lld", query.type == V4L2_CTRL_TYPE_INTEGER64 ? (long long)ctrl.value64 : (long long)ctrl.value);
+            }
+        }
+
+        if (query.type == V4L2_CTRL_TYPE_MENU || query.type == V4L2_CTRL_TYPE_INTEGER_MENU)
+        {
+            scan_menu(fp, fd, &query);
+        }
+        scan_emit(fp, &line, &size);
+        count++;
+    }
+    return count;
+}
+
+/* nodes without video capture are reported with their identity only */
+static void *scan_probe(void *data)
+{
+    struct scan_node *node = data;
+    uint64_t start_us = monotonic_us();
+    struct v4l2_capability cap;
+    unsigned int caps;
+    int formats;
+    int controls;
+    size_t size;
+    char *line;
+    FILE *fp;
+    int fd;
+
+    fd = v4l2_node_open(node->path, O_RDWR | O_NONBLOCK);
+    if (fd < 0 || v4l2_ioctl(fd, VIDIOC_QUERYCAP, &cap) < 0)
+    {
+        fp = scan_record(&line, &size, node->path, "error");
+        if (fp)
+        {
+            fprintf(fp, ",\"error\":");
+            json_string(fp, strerror(errno));
+        }
+        scan_emit(fp, &line, &size);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+    fp = scan_record(&line, &size, node->path, "device");
+    if (fp)
+    {
+        fprintf(fp, ",\"driver\":");
+        json_string(fp, (const char *)cap.driver);
+        fprintf(fp, ",\"card\":");
+        json_string(fp, (const char *)cap.card);
+        fprintf(fp, ",\"bus_info\":");
+        json_string(fp, (const char *)cap.bus_info);
+        fprintf(fp, ",\"version\":\"%u.%u.%u\",\"capabilities\":%u,\"device_caps\":%u,\"capture\":%s",
+                (cap.version >> 16) & 0xff, (cap.version >> 8) & 0xff, cap.version & 0xff,
+                cap.capabilities, caps, (caps & V4L2_CAP_VIDEO_CAPTURE) ? "true" : "false");
+    }
+    scan_emit(fp, &line, &size);
+
+    if (caps & V4L2_CAP_VIDEO_CAPTURE)
+    {
+        formats = scan_formats(fd, node->path);
+        controls = scan_controls(fd, node->path);
+        fp = scan_record(&line, &size, node->path, "end");
+        if (fp)
+        {
+            fprintf(fp, ",\"formats\":%d,\"controls\":%d,\"elapsed_us\":%llu", formats, controls,
+                    (unsigned long long)(monotonic_us() - start_us));
+        }
+        scan_emit(fp, &line, &size);
+    }
+    close(fd);
+    return NULL;
+}
+
+static int scan_sort(const void *a, const void *b)
+{
+    return strcmp(((const struct scan_node *)a)->path, ((const struct scan_node *)b)->path);
+}
+
+/*
+ * Inventory of all nodes like the -v device as JSON lines on stdout, one
+ * thread per node so the scan takes as long as the slowest node.
+ */
+static int scan_nodes()
+{
+    struct scan_node *nodes;
+    struct dirent *entry;
+    int count = 0;
+    int started;
+    DIR *dir;
+    int i;
+
+    device_pattern();
+    dir = opendir(device_dir);
+    if (dir == NULL)
+    {
+        printf("ERROR: Cannot open %s: %s (%d)\n", device_dir, strerror(errno), errno);
+        return 1;
+    }
+
+    nodes = calloc(SCAN_NODES_MAX, sizeof(struct scan_node));
+    while (nodes && count < SCAN_NODES_MAX && (entry = readdir(dir)) != NULL)
+    {
+        if (!strncmp(entry->d_name, device_prefix, strlen(device_prefix)) &&
+            isdigit((unsigned char)entry->d_name[strlen(device_prefix)]))
+        {
+            snprintf(nodes[count].path, sizeof(nodes[count].path), "%s/%s", device_dir, entry->d_name);
+            count++;
+        }
+    }
+    closedir(dir);
+    if (nodes == NULL)
+    {
+        return 1;
+    }
+    qsort(nodes, count, sizeof(struct scan_node), scan_sort);
+
+    /* the generated table is indexed before the threads look controls up */
+    control_info_find(0);
+
+    for (started = 0; started < count; started++)
+    {
+        if (pthread_create(&nodes[started].thread, NULL, scan_probe, &nodes[started]) != 0)
+        {
+            break;
+        }
+    }
+    for (i = started; i < count; i++)
+    {
+        scan_probe(&nodes[i]);
+    }
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(nodes[i].thread, NULL);
+    }
+
+    free(nodes);
+    return 0;
+}
+
+static void menu_item(int cid, int y, int x)
+{
+    struct control_mapping *cm = &ctrl_mapping[cid];
+    int idx;
+    char *value_diff = " ";
+    int row_width = menu_dim.cols - 4;
+
+    if (cm->value > cm->default_value)
+    {
+        value_diff = "+";
+    }
+    else if (cm->value < cm->default_value)
+    {
+        value_diff = "-";
+    }
+
+    /* value */
+    mvwprintw(menu_win, y, x, "%*d", row_width, cm->value);
+
+    /* option name */
+    if (cm->hasoptions)
+    {
+        for (idx = cm->minimum; idx <= cm->maximum; idx++)
+        {
+            if (cm->options[idx].index == cm->value)
+            {
+                if (cm->options[idx].name)
+                {
+                    mvwprintw(menu_win, y, x, "%*s", row_width, cm->options[idx].name);
+                }
+                else
+                {
+                    mvwprintw(menu_win, y, x, "%*d", row_width, cm->options[idx].value);
+                }
+            }
+        }
+    }
+
+    /* name */
+    mvwprintw(menu_win, y, x, "%s %s", value_diff, cm->name);
+}
+
+static void ui_uninit()
+{
+    curs_set(1);
+    clrtoeol();
+    refresh();
+    endwin();
+}
+
+static void draw_top()
+{
+    int i;
+    int row = 2;
+    int col = 37;
+
+    ui_erase(top_win);
+    mvwin(top_win, top_dim.top, top_dim.left);
+    wresize(top_win, top_dim.rows, top_dim.cols);
+
+    mvprintw(0, 1, "Camera control: ", v4l2_devname);
+    mvprintw(1, 1, "V4L2:       %s", v4l2_devname);
+    mvprintw(2, 1, "Format:     %c%c%c%c", pixfmtstr(v4l2_dev_pixelformat));
+    mvprintw(3, 1, "Resolution: %dx%d", v4l2_dev_width, v4l2_dev_height);
+
+    mvprintw(1, 28, "Config: %s", config_file);
+    mvprintw(2, 28, "Presets:");
+
+    for (i = 0; i < 10; i++)
+    {
+        if (presets[i].name)
+        {
+            if (col + (int)strlen(presets[i].name) + 5 > (int)top_dim.cols)
+            {
+                row++;
+                col = 37;
+            }
+            if (row < 4)
+            {
+                mvprintw(row, col, "[%d] %s", i + 1, presets[i].name);
+                col += (int)strlen(presets[i].name) + 5;
+            }
+        }
+    }
+
+    wnoutrefresh(top_win);
+}
+
+static void draw_health(int row)
+{
+    struct control_mapping *fps = control_by_var_name("fps");
+    struct health_summary hs;
+    int i;
+
+    mvprintw(row, 0, "%*s", top_dim.cols, " ");
+    mvprintw(row, 1, "Stream:     ");
+    if (!health_summarize(&hs))
+    {
+        printw("waiting for frames");
+        return;
+    }
+
+    printw("%6.2f fps", hs.fps);
+    if (fps && fps->value >= 0 && fps->value < fps_interval_count)
+    {
+        printw(" of %.2f", fract_fps(&fps_intervals[fps->value]));
+    }
+    printw("  jitter");
+    for (i = 0; i < HEALTH_PERCENTILES; i++)
+    {
+        printw(" p%d %.1f", health_percentiles[i], hs.jitter_ms[i]);
+    }
+    printw(" ms  dropped %lu of %lu", health.dropped, health.dropped + health.frames);
+}
+
+static void draw_request(int row)
+{
+    struct control_mapping *cm;
+
+    mvprintw(row, 0, "%*s", top_dim.cols, " ");
+    mvprintw(row, 1, "Request:    ");
+    if (!request_active)
+    {
+        printw("%s", request_error ? request_error : "waiting for the stream");
+        return;
+    }
+
+    if (request_landed.count)
+    {
+        cm = control_by_id(request_landed.controls[0].id);
+        printw("%s", cm ? cm->var_name : "control");
+        if (request_landed.count > 1)
+        {
+            printw(" and %u more", request_landed.count - 1);
+        }
+        printw(" landed on frame %u, %u frames after the change", request_landed.sequence,
+               request_landed.sequence - request_landed.since);
+    }
+    else
+    {
+        printw("no change landed yet");
+    }
+    if (request_pending_count)
+    {
+        printw("  %u pending", request_pending_count);
+    }
+    if (request_error)
+    {
+        printw("  %s", request_error);
+    }
+}
+
+static void draw_stats()
+{
+    int preset;
+
+    if (top_dim.rows < 5)
+    {
+        return;
+    }
+
+    mvprintw(4, 0, "%*s", top_dim.cols, " ");
+
+    if (scene_band_count)
+    {
+        mvprintw(4, 1, "Scene:      Y %5.1f  p50 %3d  %4ld us", scene_last.mean,
+                 scene_last.median, scene_last.elapsed_us);
+        if (scene_band_active >= 0)
+        {
+            preset = scene_bands[scene_band_active].preset;
+            printw("  auto [%d] %s", preset, presets[preset - 1].name ? presets[preset - 1].name : "-");
+        }
+        printw("    ");
+    }
+
+    if (poll_enabled)
+    {
+        if (!scene_band_count)
+        {
+            move(4, 1);
+        }
+        printw("Poll: %d ctrls  %4d ms  %4ld us  %.3f %%", poll_ctrl_count, poll_interval_ms, poll_last_us,
+               poll_count ? 100.0 * poll_busy_us / (monotonic_us() - poll_started_us) : 0.0);
+    }
+
+    if (health_enabled)
+    {
+        draw_health(top_dim.rows - 1 - request_enabled);
+    }
+    if (request_enabled)
+    {
+        draw_request(top_dim.rows - 1);
+    }
+    wnoutrefresh(stdscr);
+}
+
+static void draw_menu(bool full_redraw)
+{
+    int i;
+    int x = 2;
+    int y = 1;
+    int max;
+    int offset = 0;
+    int btitle_offset = 0;
+    int window_lines = menu_dim.rows - 2;
+    char search_line[SEARCH_QUERY_MAX + 32];
+
+    TRACE2(draw_menu_entry, full_redraw, active_control);
+
+    if (full_redraw)
+    {
+        ui_erase(menu_win);
+        mvwin(menu_win, menu_dim.top, menu_dim.left);
+        wresize(menu_win, menu_dim.rows, menu_dim.cols);
+    }
+    else
+    {
+        werase(menu_win);
+    }
+    box(menu_win, 0, 0);
+
+    if (active_control > window_lines - 1)
+    {
+        if (active_control >= last_offset && active_control < last_offset + window_lines)
+        {
+            offset = last_offset;
+        }
+        else
+        {
+            offset = active_control - window_lines + 1;
+        }
+    }
+    else if (last_offset > 0)
+    {
+        if (active_control > last_offset)
+        {
+            offset = last_offset;
+        }
+        else
+        {
+            offset = active_control;
+        }
+    }
+    last_offset = offset;
+
+    max = (view_last >= offset + window_lines) ? offset + window_lines : view_last;
+
+    box(menu_win, 0, 0);
+    for (i = offset; i < max; i++)
+    {
+        if (active_control == i)
+        {
+            wattron(menu_win, A_REVERSE);
+            menu_item(ctrl_view[i], y, x);
+            wattroff(menu_win, A_REVERSE);
+        }
+        else
+        {
+            menu_item(ctrl_view[i], y, x);
+        }
+        y++;
+    }
+
+    btitle_offset = menu_dim.cols - 9;
+    btitle_offset -= (active_control + 1 < 10) ? 1 : ((active_control + 1 < 100) ? 2 : 3);
+    btitle_offset -= (view_last < 10) ? 1 : ((view_last < 100) ? 2 : 3);
+
+    mvwhline(menu_win, 0, 1, ACS_HLINE, menu_dim.cols - 2);
+    wmove(menu_win, 0, 2);
+    if (search_active())
+    {
+        snprintf(search_line, sizeof(search_line), " /%s%s ", search_query, search_typing ? "_" : "");
+        wattron(menu_win, A_REVERSE);
+        waddnstr(menu_win, search_line, menu_dim.cols - 3 - getcurx(menu_win));
+        wattroff(menu_win, A_REVERSE);
+        snprintf(search_line, sizeof(search_line), " %d found in %ld us ", view_last, search_us);
+        if (getcurx(menu_win) + (int)strlen(search_line) < menu_dim.cols - 1)
+        {
+            waddstr(menu_win, search_line);
+        }
+    }
+    for (i = 0; i < class_count && !search_active(); i++)
+    {
+        if (getcurx(menu_win) + (int)strlen(ctrl_classes[i].name) + 3 > menu_dim.cols - 1)
+        {
+            break;
+        }
+        if (i == active_class)
+        {
+            wattron(menu_win, A_REVERSE);
+            wprintw(menu_win, " %s ", ctrl_classes[i].name);
+            wattroff(menu_win, A_REVERSE);
+        }
+        else
+        {
+            wprintw(menu_win, " %s ", ctrl_classes[i].name);
+        }
+        waddch(menu_win, ' ');
+    }
+    wmove(menu_win, menu_dim.rows - 1, btitle_offset);
+    wprintw(menu_win, "[ %d / %d ]", active_control + 1, view_last);
+
+    wnoutrefresh(menu_win);
+
+    wnoutrefresh(menu_win);
+
+    TRACE3(draw_menu_return, full_redraw, active_control, max - offset);
+}
+
+/* the sharpness is shown while a focus control is selected or swept */
+static bool focus_visible()
+{
+    struct control_mapping *cm = control_active();
+
+    return focus_enabled && (focus_sweep.control || cm->id == V4L2_CID_FOCUS_ABSOLUTE ||
+                             cm->id == V4L2_CID_FOCUS_RELATIVE);
 }
 
 static void draw_control(bool full_redraw)
 {
-    struct control_mapping *cm = &ctrl_mapping[active_control];
-    int row = 1;
-    int idx;
+    struct control_mapping *cm = control_active();
+    int row = 1;
+    int idx;
+
+    TRACE3(draw_control_entry, full_redraw, cm->id, cm->value);
+
+    if (full_redraw)
+    {
+        ui_erase(control_win);
+        mvwin(control_win, control_dim.top, control_dim.left);
+        wresize(control_win, control_dim.rows, control_dim.cols);
+    }
+    else
+    {
+        werase(control_win);
+    }
+    box(control_win, 0, 0);
+
+    mvwprintw(control_win, row++, 2, "%.22s", cm->name);
+    if (cm->unit)
+    {
+        mvwprintw(control_win, row++, 2, "Val: %*d %s", 16 - (int)strlen(cm->unit), cm->value, cm->unit);
+    }
+    else
+    {
+        mvwprintw(control_win, row++, 2, "Val: %17d", cm->value);
+    }
+    mvwprintw(control_win, row++, 2, "Min: %17d", cm->minimum);
+    mvwprintw(control_win, row++, 2, "Max: %17d", cm->maximum);
+    mvwprintw(control_win, row++, 2, "Stp: %17d", cm->step);
+    mvwprintw(control_win, row++, 2, "Def: %17d", cm->default_value);
+    mvwprintw(control_win, row, 2, "Opt: %*s", 17, "");
+
+    if (cm->hasoptions)
+    {
+        for (idx = cm->minimum; idx <= cm->maximum; idx++)
+        {
+            if (cm->options[idx].index == cm->value)
+            {
+                if (cm->options[idx].name)
+                {
+                    mvwprintw(control_win, row, 2, "Opt: %17s", cm->options[idx].name);
+                }
+                else
+                {
+                    mvwprintw(control_win, row, 2, "Opt: %17d", cm->options[idx].value);
+                }
+            }
+        }
+    }
+
+    if (focus_visible())
+    {
+        mvwprintw(control_win, ++row, 2, "Shp: %10.1f %4ldus", focus_last.sharpness, focus_last.elapsed_us);
+        if (focus_sweep.best >= 0)
+        {
+            mvwprintw(control_win, ++row, 2, "%s %10.1f @%5d", focus_sweep.control ? "Swp:" : "Pk: ",
+                      focus_sweep.best, focus_sweep.best_value);
+        }
+    }
+
+    wnoutrefresh(control_win);
+
+    TRACE3(draw_control_return, full_redraw, cm->id, cm->value);
+}
+
+static void draw_help()
+{
+    int row = help_dim.top;
+    int col = help_dim.left;
+    int i;
+
+    for (i = row; i < row + 13; i++)
+    {
+        mvprintw(i, col - 1, " ");
+    }
+
+    ui_erase(help_win);
+    mvwin(help_win, help_dim.top, help_dim.left);
+    wresize(help_win, help_dim.rows, help_dim.cols);
+
+    mvprintw(row++, col, "Up/Down/Home/End  Navigate");
+    mvprintw(row++, col, "Left/Right          Adjust");
+    mvprintw(row++, col, "PgDn/PgUp      Jump Adjust");
+    mvprintw(row++, col, "1-9/Tab  Load/next preset");
+    mvprintw(row++, col, "[ ]     Switch control tab");
+    mvprintw(row++, col, "R Reset All  | U Update   ");
+    mvprintw(row++, col, "D Default    | Q Quit     ");
+    mvprintw(row++, col, "N Minimum    | M Maximum  ");
+    mvprintw(row++, col, "L Load       | S Save     ");
+    mvprintw(row++, col, "Z Undo       | Y Redo     ");
+    mvprintw(row++, col, "A B Store    | T Swap A/B ");
+    mvprintw(row++, col, "/ Search     | Esc Cancel ");
+    if (focus_enabled)
+    {
+        mvprintw(row++, col, "F Focus sweep             ");
+    }
+
+    wnoutrefresh(help_win);
+}
+
+static void draw_ui(int row, int col)
+{
+    (void)(row);
+    int control_width = 26;
+
+    top_dim.top = 0;
+    top_dim.left = 0;
+    top_dim.cols = col;
+    top_dim.rows = 4 + (scene_band_count || poll_enabled) + health_enabled + request_enabled;
+
+    menu_dim.top = top_dim.rows;
+    menu_dim.left = 0;
+    menu_dim.cols = col - control_width - 1;
+    menu_dim.rows = row - top_dim.rows;
+
+    control_dim.top = top_dim.rows,
+    control_dim.left = menu_dim.cols + 1,
+    control_dim.cols = control_width,
+    control_dim.rows = focus_enabled ? 11 : 9;
+
+    help_dim.top = control_dim.top + control_dim.rows;
+    help_dim.left = menu_dim.cols + 1;
+    help_dim.cols = control_dim.cols;
+    help_dim.rows = menu_dim.rows - control_dim.rows;
+
+    if (!ui_initialized)
+    {
+        curs_set(0);
+        initscr();
+        clear();
+        noecho();
+        cbreak();
+
+        top_win = newwin(top_dim.rows, top_dim.cols, top_dim.top, top_dim.left);
+        menu_win = newwin(menu_dim.rows, menu_dim.cols, menu_dim.top, menu_dim.left);
+        control_win = newwin(control_dim.rows, control_dim.cols, control_dim.top, control_dim.left);
+        help_win = newwin(help_dim.rows, help_dim.cols, help_dim.top, help_dim.left);
+        if (bandwidth_rate)
+        {
+            input_pad = newpad(1, 1);
+        }
+
+        ui_initialized = true;
+    }
+    resizeterm(row, col);
+
+    touchwin(stdscr);
+    wnoutrefresh(stdscr);
+
+    draw_top();
+    draw_stats();
+    draw_menu(true);
+    draw_control(true);
+    draw_help();
+
+    ui_update();
+}
+
+static int focus_sweep_step(const struct control_mapping *cm, int range)
+{
+    int unit = cm->step > 0 ? cm->step : 1;
+    int step = range / FOCUS_SWEEP_STEPS / unit * unit;
+
+    return step > unit ? step : unit;
+}
+
+/* frames exposed while the lens moves are skipped, with -Q also the buffers queued before the request */
+static void focus_sweep_move(struct control_mapping *cm, int value)
+{
+    focus_sweep.value = value;
+    focus_sweep.settle = FOCUS_SWEEP_SETTLE + (request_active ? capture_nrequests : 0);
+    cm->value = value;
+    v4l2_apply_control(cm);
+}
+
+/* F starts a sweep over the whole range of the absolute focus, again cancels it */
+static void focus_sweep_start()
+{
+    struct control_mapping *cm = control_by_id(V4L2_CID_FOCUS_ABSOLUTE);
+    struct control_mapping *automatic = control_by_id(V4L2_CID_FOCUS_AUTO);
+    const char *error = NULL;
+
+    if (focus_sweep.control)
+    {
+        cm = control_by_id(focus_sweep.control);
+        if (cm)
+        {
+            cm->value = focus_sweep.start_value;
+            v4l2_apply_control(cm);
+        }
+        focus_sweep.control = 0;
+        return;
+    }
+
+    if (!cm)
+    {
+        error = "No absolute focus control";
+    }
+    else if (!capture_active)
+    {
+        error = "Focus sweep needs frames of the device";
+    }
+    else if (automatic && automatic->value)
+    {
+        error = "Focus sweep needs manual focus";
+    }
+    if (error)
+    {
+        mvprintw(0, 20, "%*s", 60, " ");
+        mvprintw(0, 20, "%s", error);
+        ui_refresh();
+        return;
+    }
+
+    focus_sweep.control = cm->id;
+    focus_sweep.start_value = cm->value;
+    focus_sweep.low = cm->minimum;
+    focus_sweep.high = cm->maximum;
+    focus_sweep.step = focus_sweep_step(cm, cm->maximum - cm->minimum);
+    focus_sweep.best = -1;
+    focus_sweep.best_value = cm->value;
+    focus_sweep_move(cm, cm->minimum);
+}
+
+/*
+ * Score the focus value with the first settled frame and move on. A pass
+ * that used the control step ends the sweep at the sharpest value, any
+ * other is followed by a finer pass around it. True when the value changed.
+ * The control is looked up on every step, enumeration may move it.
+ */
+static bool focus_sweep_update()
+{
+    struct control_mapping *cm = control_by_id(focus_sweep.control);
+    int unit;
+
+    if (!cm)
+    {
+        focus_sweep.control = 0;
+        return true;
+    }
+    unit = cm->step > 0 ? cm->step : 1;
+
+    if (focus_sweep.settle > 0)
+    {
+        focus_sweep.settle--;
+        return false;
+    }
+
+    if (focus_last.sharpness > focus_sweep.best)
+    {
+        focus_sweep.best = focus_last.sharpness;
+        focus_sweep.best_value = focus_sweep.value;
+    }
+
+    if (focus_sweep.value + focus_sweep.step <= focus_sweep.high)
+    {
+        focus_sweep_move(cm, focus_sweep.value + focus_sweep.step);
+        return true;
+    }
+
+    if (focus_sweep.step <= unit)
+    {
+        cm->value = focus_sweep.best_value;
+        v4l2_apply_control(cm);
+        control_record(cm, focus_sweep.start_value, JOURNAL_KEY);
+        focus_sweep.control = 0;
+        return true;
+    }
+
+    focus_sweep.low = clamp(focus_sweep.best_value - focus_sweep.step, cm->minimum, cm->maximum);
+    focus_sweep.high = clamp(focus_sweep.best_value + focus_sweep.step, cm->minimum, cm->maximum);
+    focus_sweep.step = focus_sweep_step(cm, focus_sweep.high - focus_sweep.low);
+    focus_sweep_move(cm, focus_sweep.low);
+    return true;
+}
+
+/*
+ * Controls of completed requests and of writes made at once are read back
+ * with the frame they show on, with the controls that depend on them. A
+ * value the driver did not take is shown and journaled as the device has
+ * it, unless a newer write of the control is still queued.
+ */
+static void request_report()
+{
+    struct v4l2_ext_control items[REQUEST_CONTROLS_MAX * 2];
+    struct control_mapping *cm;
+    unsigned int count = 0;
+    unsigned int i;
+    int old_value;
+
+    request_landed.reported = true;
+    for (i = 0; i < request_check_count; i++)
+    {
+        cm = control_by_id(request_check[i]);
+        if (cm && !request_queued(cm->id))
+        {
+            memset(&items[count], 0, sizeof(struct v4l2_ext_control));
+            items[count].id = cm->id;
+            items[count].value = cm->value;
+            count++;
+        }
+    }
+    request_check_count = 0;
+
+    if (count)
+    {
+        v4l2_fd_get_ctrl_values(v4l2_dev_fd, items, count);
+    }
+    for (i = 0; i < count; i++)
+    {
+        cm = control_by_id(items[i].id);
+        if (cm->value != items[i].value)
+        {
+            old_value = cm->value;
+            cm->value = items[i].value;
+            journal_record(cm, old_value, JOURNAL_DEVICE);
+        }
+        control_refresh_related(cm);
+    }
+    draw_stats();
+    ui_update();
+}
+
+/*
+ * Drain queued frames and analyse the newest one at most every
+ * SCENE_INTERVAL_MS. The sharpness of focus assist follows every frame.
+ */
+static bool scene_poll()
+{
+    struct capture_frame frame;
+    struct capture_frame latest;
+    uint64_t now;
+    bool changed = false;
+
+    memset(&latest, 0, sizeof(latest));
+    latest.index = -1;
+
+    while (capture_next(&frame) > 0)
+    {
+        if (health_enabled)
+        {
+            health_frame(&frame);
+        }
+        capture_release(&latest);
+        latest = frame;
+    }
+
+    if ((request_landed.count && !request_landed.reported) || request_check_count)
+    {
+        request_report();
+        changed = true;
+    }
+
+    if (!latest.data)
+    {
+        return false;
+    }
+
+    if (focus_enabled && focus_compute(latest.data, latest.bytesused, &focus_last) == 0)
+    {
+        if (focus_sweep.control && focus_sweep_update())
+        {
+            changed = true;
+        }
+        else if (focus_visible())
+        {
+            draw_control(false);
+            ui_update();
+        }
+    }
+
+    now = monotonic_us();
+    if (scene_band_count && now - scene_last_us >= SCENE_INTERVAL_MS * 1000)
+    {
+        scene_last_us = now;
+        if (scene_compute_stats(latest.data, latest.bytesused, &scene_last) == 0 &&
+            scene_update(&scene_last))
+        {
+            load_preset(scene_bands[scene_band_active].preset - 1);
+            changed = true;
+        }
+        draw_stats();
+        ui_update();
+    }
+    else if ((health_enabled || request_enabled) && now - health_drawn_us >= SCENE_INTERVAL_MS * 1000)
+    {
+        health_drawn_us = now;
+        draw_stats();
+        ui_update();
+    }
+    capture_release(&latest);
+
+    return changed;
+}
+
+static void draw_menu_row(int cid)
+{
+    int window_lines = menu_dim.rows - 2;
+    int row;
+
+    for (row = last_offset; row < view_last && row < last_offset + window_lines; row++)
+    {
+        if (ctrl_view[row] != cid)
+        {
+            continue;
+        }
+
+        if (row == active_control)
+        {
+            wattron(menu_win, A_REVERSE);
+            menu_item(cid, row - last_offset + 1, 2);
+            wattroff(menu_win, A_REVERSE);
+            wnoutrefresh(menu_win);
+            draw_control(false);
+        }
+        else
+        {
+            menu_item(cid, row - last_offset + 1, 2);
+            wnoutrefresh(menu_win);
+        }
+        return;
+    }
+}
+
+static void control_changed(struct control_mapping *mapping, int value)
+{
+    mapping->value = value;
+    draw_menu_row(mapping - ctrl_mapping);
+}
+
+static bool control_events_process()
+{
+    struct control_mapping *cm;
+    struct v4l2_event ev;
+    bool changed = false;
+    bool hidden;
+    int source;
+    int fd;
+
+    if (!events_subscribed)
+    {
+        return false;
+    }
+
+    /* sub-devices queue the events of their own controls */
+    for (source = 0; source <= media_count; source++)
+    {
+        fd = source ? media_sources[source].fd : v4l2_dev_fd;
+        while (v4l2_ioctl(fd, VIDIOC_DQEVENT, &ev) == 0)
+        {
+            cm = ev.type == V4L2_EVENT_CTRL ? control_by_id(ev.id) : NULL;
+            if (cm == NULL)
+            {
+                continue;
+            }
+
+            /* an automatic mode switched on or off, the list is updated in place */
+            if (ev.u.ctrl.changes & (V4L2_EVENT_CTRL_CH_FLAGS | V4L2_EVENT_CTRL_CH_RANGE))
+            {
+                hidden = control_hidden(cm);
+                cm->flags = ev.u.ctrl.flags;
+                if (ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_RANGE)
+                {
+                    control_set_range(cm, ev.u.ctrl.minimum, ev.u.ctrl.maximum, ev.u.ctrl.step, ev.u.ctrl.default_value);
+                }
+                if (hidden != control_hidden(cm) || (ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_RANGE))
+                {
+                    control_view_update();
+                    layout_changed = true;
+                }
+            }
+
+            if ((ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_VALUE) && cm->value != ev.u.ctrl.value)
+            {
+                control_changed(cm, ev.u.ctrl.value);
+                changed = true;
+            }
+        }
+    }
+
+    if (changed)
+    {
+        ui_update();
+    }
+    return changed;
+}
+
+/*
+ * Re-read polled controls in one batch. The interval doubles while the
+ * values are stable and drops to POLL_MIN_MS after any change.
+ */
+static void control_poll()
+{
+    static struct v4l2_ext_control *items = NULL;
+    static int *index = NULL;
+    static int items_size = 0;
+    struct v4l2_ext_control *grown_items;
+    int *grown_index;
+    uint64_t start = monotonic_us();
+    bool changed = false;
+    int count = 0;
+    int i;
+
+    if (start < poll_next_us)
+    {
+        return;
+    }
+
+    if (items_size < ctrl_last)
+    {
+        /* the old arrays stay in use until both have grown, the poll is retried later */
+        grown_items = realloc(items, ctrl_size * sizeof(struct v4l2_ext_control));
+        if (grown_items)
+        {
+            items = grown_items;
+        }
+        grown_index = realloc(index, ctrl_size * sizeof(int));
+        if (grown_index)
+        {
+            index = grown_index;
+        }
+        if (!grown_items || !grown_index)
+        {
+            poll_next_us = start + poll_interval_ms * 1000;
+            return;
+        }
+        items_size = ctrl_size;
+    }
+
+    for (i = 0; i < ctrl_last; i++)
+    {
+        if (ctrl_mapping[i].polled)
+        {
+            memset(&items[count], 0, sizeof(struct v4l2_ext_control));
+            items[count].id = ctrl_mapping[i].id;
+            items[count].value = ctrl_mapping[i].value;
+            index[count++] = i;
+        }
+    }
+
+    if (count)
+    {
+        v4l2_get_ctrl_values(items, count);
+    }
+
+    poll_last_us = (long)(monotonic_us() - start);
+    poll_busy_us += poll_last_us;
+    poll_ctrl_count = count;
+    poll_count++;
+
+    for (i = 0; i < count; i++)
+    {
+        if (ctrl_mapping[index[i]].value != items[i].value)
+        {
+            control_changed(&ctrl_mapping[index[i]], items[i].value);
+            changed = true;
+        }
+    }
+
+    poll_interval_ms = changed ? POLL_MIN_MS : poll_interval_ms * 2;
+    poll_interval_ms = clamp(poll_interval_ms, POLL_MIN_MS, POLL_MAX_MS);
+    poll_next_us = monotonic_us() + poll_interval_ms * 1000;
+
+    draw_stats();
+    ui_update();
+}
+
+/* the device node was removed or its driver unbound, keep the state for the reconnect */
+static void device_lose()
+{
+    device_capture = capture_active;
+    capture_stop();
+    close(v4l2_dev_fd);
+    v4l2_dev_fd = -1;
+    device_lost = true;
+    device_lost_us = monotonic_us();
+    device_seen_us = 0;
+    device_scan_us = 0;
+    events_subscribed = false;
+
+    /* the device may come back under another number */
+    device_pattern();
+
+    if (device_watch_fd < 0)
+    {
+        device_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    if (device_watch_fd >= 0)
+    {
+        inotify_add_watch(device_watch_fd, device_dir, IN_CREATE | IN_ATTRIB);
+    }
+
+    mvprintw(0, 20, "%*s", 60, " ");
+    mvprintw(0, 20, "Device lost, waiting for %.32s", v4l2_bus_info);
+    ui_refresh();
+}
+
+/* capture node with the bus_info and card of the lost device */
+static int device_find()
+{
+    struct v4l2_capability cap;
+    struct dirent *entry;
+    unsigned int caps;
+    DIR *dir;
+    int fd;
+
+    dir = opendir(device_dir);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, device_prefix, strlen(device_prefix)))
+        {
+            continue;
+        }
+
+        snprintf(device_path, sizeof(device_path), "%s/%s", device_dir, entry->d_name);
+        fd = v4l2_node_open(device_path, O_RDWR | O_NONBLOCK);
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        memset(&cap, 0, sizeof(cap));
+        caps = 0;
+        if (v4l2_ioctl(fd, VIDIOC_QUERYCAP, &cap) == 0)
+        {
+            caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+        }
+        if ((caps & V4L2_CAP_VIDEO_CAPTURE) &&
+            !strncmp((char *)cap.bus_info, v4l2_bus_info, sizeof(v4l2_bus_info)) &&
+            !strncmp((char *)cap.card, v4l2_card, sizeof(v4l2_card)))
+        {
+            closedir(dir);
+            return fd;
+        }
+        close(fd);
+    }
+    closedir(dir);
+    return -1;
+}
+
+/*
+ * Reuse the enumeration made before the loss. The stream format goes back
+ * to the last device state, controls that differ from the device are
+ * written in one batch. Returns false when the restore could not start,
+ * the device stays lost and is found again on the next scan.
+ */
+static bool device_restore(int fd)
+{
+    unsigned int pixelformat = v4l2_dev_pixelformat;
+    unsigned int width = v4l2_dev_width;
+    unsigned int height = v4l2_dev_height;
+    struct v4l2_ext_control *items = calloc(ctrl_last + 1, sizeof(struct v4l2_ext_control));
+    struct v4l2_ext_control *writes = calloc(ctrl_last + 1, sizeof(struct v4l2_ext_control));
+    struct control_mapping *cm;
+    struct v4l2_fract interval;
+    int count = 0;
+    int written = 0;
+    int failed = 0;
+    int fi;
+    int i;
 
-    if (full_redraw)
+    if (!items || !writes)
     {
-        wclear(control_win);
-        mvwin(control_win, control_dim.top, control_dim.left);
-        wresize(control_win, control_dim.rows, control_dim.cols);
+        free(items);
+        free(writes);
+        close(fd);
+        mvprintw(0, 20, "%*s", 60, " ");
+        mvprintw(0, 20, "Device back, cannot allocate the restore");
+        ui_refresh();
+        return false;
     }
-    else
+
+    v4l2_dev_fd = fd;
+    v4l2_devname = device_path;
+    device_lost = false;
+
+    cm = control_by_var_name("fps");
+    fi = cm ? cm->value : -1;
+    interval = fi >= 0 && fi < fps_interval_count ? fps_intervals[fi] : fps_default_interval;
+
+    v4l2_format_info();
+    v4l2_set_format(pixelformat, width, height);
+
+    if (cm && fps_interval_count)
     {
-        werase(control_win);
+        fi = fps_interval_index(&interval);
+        if (fi >= 0 && fi != v4l2_fps_get())
+        {
+            v4l2_fps_set(fi);
+        }
+        cm->value = v4l2_fps_get();
     }
-    box(control_win, 0, 0);
 
-    mvwprintw(control_win, row++, 2, "%.22s", cm->name);
-    mvwprintw(control_win, row++, 2, "Val: %17d", cm->value);
-    mvwprintw(control_win, row++, 2, "Min: %17d", cm->minimum);
-    mvwprintw(control_win, row++, 2, "Max: %17d", cm->maximum);
-    mvwprintw(control_win, row++, 2, "Stp: %17d", cm->step);
-    mvwprintw(control_win, row++, 2, "Def: %17d", cm->default_value);
-    mvwprintw(control_win, row, 2, "Opt: %*s", 17, "");
+    for (i = 0; i < ctrl_last; i++)
+    {
+        cm = &ctrl_mapping[i];
+        if (cm->entry_type != V4L2_CONTROL || cm->unsupported || (cm->flags & V4L2_CTRL_FLAG_VOLATILE))
+        {
+            continue;
+        }
+        items[count].id = cm->id;
+        items[count].value = cm->value;
+        count++;
+    }
 
-    if (cm->hasoptions)
+    /* read the defaults the device came back with, write only what differs */
+    for (i = 0; i < count; i++)
     {
-        for (idx = cm->minimum; idx <= cm->maximum; idx++)
+        writes[i] = items[i];
+    }
+    v4l2_get_ctrl_values(items, count);
+    for (i = 0; i < count; i++)
+    {
+        if (items[i].value != writes[i].value)
         {
-            if (cm->options[idx].index == cm->value)
+            writes[written++] = writes[i];
+        }
+    }
+    if (written)
+    {
+        apply_plan(v4l2_dev_fd, writes, written);
+        failed = v4l2_set_ctrl_values(writes, written);
+    }
+    if (failed)
+    {
+        v4l2_get_ctrl_values(writes, written);
+        for (i = 0; i < written; i++)
+        {
+            if ((cm = control_by_id(writes[i].id)))
             {
-                if (cm->options[idx].name)
-                {
-                    mvwprintw(control_win, row, 2, "Opt: %17s", cm->options[idx].name);
-                }
-                else
-                {
-                    mvwprintw(control_win, row, 2, "Opt: %17d", cm->options[idx].value);
-                }
+                cm->value = writes[i].value;
             }
         }
     }
 
-    if (full_redraw)
+    /* automatic modes may differ from the enumeration, the list follows the device */
+    for (i = 0; i < ctrl_last; i++)
     {
-        wnoutrefresh(control_win);
+        if (ctrl_mapping[i].entry_type == V4L2_CONTROL)
+        {
+            control_refresh(&ctrl_mapping[i]);
+        }
     }
-    else
+    control_view_update();
+
+    for (i = 0; i < ctrl_last && poll_enabled; i++)
+    {
+        /* subscriptions on sub-devices survive the loss of the video node */
+        if (ctrl_mapping[i].has_events && !ctrl_mapping[i].source)
+        {
+            v4l2_subscribe_control(v4l2_dev_fd, ctrl_mapping[i].id);
+        }
+    }
+
+    if (device_capture)
     {
-        wrefresh(control_win);
+        capture_start();
     }
+
+    free(items);
+    free(writes);
+
+    draw_ui(LINES, COLS);
+    mvprintw(0, 20, "%*s", 60, " ");
+    mvprintw(0, 20, "Device back after %.1f s, restored in %.1f ms (%d written, %d failed)",
+             (device_seen_us - device_lost_us) / 1000000.0,
+             (monotonic_us() - device_seen_us) / 1000.0, written, failed);
+    ui_refresh();
+    return true;
 }
 
-static void draw_help()
+/*
+ * A removed device reports POLLHUP, writes fail with ENODEV. While it is
+ * gone the device directory is watched and scanned for the same device.
+ * Returns true when the device was lost or restored.
+ */
+static bool device_check()
 {
-    int row = help_dim.top;
-    int col = help_dim.left;
-    int i;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    struct pollfd pfd;
+    bool scan = false;
+    uint64_t now = monotonic_us();
+    ssize_t len;
+    char *pos;
+    int fd;
+
+    if (!device_lost)
+    {
+        if (now < device_check_us)
+        {
+            return false;
+        }
+        device_check_us = now + DEVICE_CHECK_MS * 1000;
+
+        pfd.fd = v4l2_dev_fd;
+        pfd.events = 0;
+        if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLNVAL)))
+        {
+            device_lose();
+            return true;
+        }
+        return false;
+    }
 
-    for (i = row; i < row + 11; i++)
+    while (device_watch_fd >= 0 && (len = read(device_watch_fd, events, sizeof(events))) > 0)
     {
-        mvprintw(i, col - 1, " ");
+        for (pos = events; pos < events + len; pos += sizeof(struct inotify_event) + event->len)
+        {
+            event = (const struct inotify_event *)pos;
+            if (event->len && !strncmp(event->name, device_prefix, strlen(device_prefix)))
+            {
+                scan = true;
+            }
+        }
     }
 
-    wclear(help_win);
-    werase(help_win);
-    mvwin(help_win, help_dim.top, help_dim.left);
-    wresize(help_win, help_dim.rows, help_dim.cols);
+    /* inotify may be unavailable, rescan now and then anyway */
+    if (!scan && now < device_scan_us)
+    {
+        return false;
+    }
+    device_scan_us = now + DEVICE_RESCAN_MS * 1000;
+    if (!device_seen_us && scan)
+    {
+        device_seen_us = now;
+    }
 
-    mvprintw(row++, col, "Up/Down/Home/End  Navigate");
-    mvprintw(row++, col, "Left/Right          Adjust");
-    mvprintw(row++, col, "PgDn/PgUp      Jump Adjust");
-    mvprintw(row++, col, "1-9       Load preset file");
-    mvprintw(row++, col, "Tab     Switch preset file");
-    mvprintw(row++, col, "                          ");
-    mvprintw(row++, col, "R Reset All  | U Update   ");
-    mvprintw(row++, col, "D Default");
-    mvprintw(row++, col, "N Minimum    | M Maximum  ");
-    mvprintw(row++, col, "L Load       | S Save     ");
-    mvprintw(row++, col, "Q Quit");
+    fd = device_find();
+    if (fd < 0)
+    {
+        return false;
+    }
+    if (!device_seen_us)
+    {
+        device_seen_us = now;
+    }
+    return device_restore(fd);
+}
 
-    wnoutrefresh(help_win);
+/* next deadline of timed work in ms, -1 when only descriptors can wake the loop */
+static int loop_timeout()
+{
+    uint64_t now = monotonic_us();
+    int wait;
+    int ms = -1;
+
+    /* startup work goes on as soon as there is no key to handle */
+    if (startup_stage != STARTUP_DONE && !device_lost)
+    {
+        return startup_stage == STARTUP_MEDIA && media_busy() ? STARTUP_WAIT_MS : 0;
+    }
+
+    /* a device that cannot be waited for is checked for removal and events on a timer */
+    if (!device_lost && loop_device_fd < 0)
+    {
+        ms = capture_active ? SCENE_INTERVAL_MS / 5 : DEVICE_CHECK_MS;
+        if (events_subscribed && ms > POLL_MIN_MS)
+        {
+            ms = POLL_MIN_MS;
+        }
+    }
+
+    if (device_lost)
+    {
+        ms = device_scan_us > now ? (int)((device_scan_us - now) / 1000) + 1 : 0;
+    }
+    else if (poll_enabled)
+    {
+        wait = poll_next_us > now ? (int)((poll_next_us - now) / 1000) + 1 : 0;
+        ms = ms < 0 || wait < ms ? wait : ms;
+    }
+
+    /* a deferred screen update is sent once the byte budget allows it */
+    if (ui_pending)
+    {
+        wait = (int)(-bandwidth_tokens * 1000 / bandwidth_rate) + 1;
+        ms = ms < 0 || wait < ms ? wait : ms;
+    }
+    return ms;
 }
 
-static void draw_ui(int row, int col)
+/*
+ * Signals are read from a signalfd, they have to be blocked before any
+ * thread is started so that no thread receives them.
+ */
+static int loop_open()
 {
-    (void)(row);
-    int control_width = 26;
+    struct epoll_event ev;
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    loop_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop_signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    loop_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop_epoll_fd < 0 || loop_signal_fd < 0 || loop_timer_fd < 0)
+    {
+        printf("ERROR: Cannot create event loop: %s (%d)\n", strerror(errno), errno);
+        return -1;
+    }
 
-    top_dim.top = 0;
-    top_dim.left = 0;
-    top_dim.cols = col;
-    top_dim.rows = 4;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = loop_signal_fd;
+    epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, loop_signal_fd, &ev);
+    ev.data.fd = loop_timer_fd;
+    epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, loop_timer_fd, &ev);
+    ev.data.fd = STDIN_FILENO;
+    epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+    return 0;
+}
 
-    menu_dim.top = top_dim.rows;
-    menu_dim.left = 0;
-    menu_dim.cols = col - control_width - 1;
-    menu_dim.rows = row - top_dim.rows;
+static void loop_close()
+{
+    if (loop_timer_fd >= 0)
+    {
+        close(loop_timer_fd);
+        loop_timer_fd = -1;
+    }
+    if (loop_signal_fd >= 0)
+    {
+        close(loop_signal_fd);
+        loop_signal_fd = -1;
+    }
+    if (loop_epoll_fd >= 0)
+    {
+        close(loop_epoll_fd);
+        loop_epoll_fd = -1;
+    }
+}
 
-    control_dim.top = top_dim.rows,
-    control_dim.left = menu_dim.cols + 1,
-    control_dim.cols = control_width,
-    control_dim.rows = 9;
+/*
+ * Keep the device descriptors of the epoll set in line with the device
+ * state: events need EPOLLPRI, captured frames EPOLLIN, removal is always
+ * reported as EPOLLHUP. Drivers that signal errors while the device is
+ * present fall back to timed checks.
+ */
+static void loop_update()
+{
+    struct epoll_event ev;
+    uint32_t mask = (events_subscribed ? EPOLLPRI : 0) | (capture_active ? EPOLLIN : 0);
+    int fd;
+    int i;
 
-    help_dim.top = control_dim.top + control_dim.rows;
-    help_dim.left = menu_dim.cols + 1;
-    help_dim.cols = control_dim.cols;
-    help_dim.rows = menu_dim.rows - control_dim.rows;
+    if (loop_device_hangup && !device_lost)
+    {
+        loop_device_timed = true;
+    }
+    loop_device_hangup = false;
 
-    if (!ui_initialized)
+    fd = device_lost || loop_device_timed ? -1 : v4l2_dev_fd;
+    if (fd != loop_device_fd || mask != loop_device_mask)
     {
-        curs_set(0);
-        initscr();
-        clear();
-        noecho();
-        cbreak();
+        /* the old descriptor may be closed already, which removed it from the set */
+        if (loop_device_fd >= 0)
+        {
+            epoll_ctl(loop_epoll_fd, EPOLL_CTL_DEL, loop_device_fd, NULL);
+        }
+        memset(&ev, 0, sizeof(ev));
+        ev.events = mask;
+        ev.data.fd = fd;
+        loop_device_fd = fd >= 0 && epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0 ? fd : -1;
+        loop_device_mask = mask;
+    }
 
-        top_win = newwin(top_dim.rows, top_dim.cols, top_dim.top, top_dim.left);
-        menu_win = newwin(menu_dim.rows, menu_dim.cols, menu_dim.top, menu_dim.left);
-        control_win = newwin(control_dim.rows, control_dim.cols, control_dim.top, control_dim.left);
-        help_win = newwin(help_dim.rows, help_dim.cols, help_dim.top, help_dim.left);
+    if (device_watch_fd >= 0 && device_watch_fd != loop_watch_fd)
+    {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = device_watch_fd;
+        epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, device_watch_fd, &ev);
+        loop_watch_fd = device_watch_fd;
+    }
 
-        ui_initialized = true;
+    /* sub-devices only raise control events, they stay in the set until exit */
+    if (events_subscribed && !media_watched)
+    {
+        for (i = 1; i <= media_count; i++)
+        {
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLPRI;
+            ev.data.fd = media_sources[i].fd;
+            epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, media_sources[i].fd, &ev);
+        }
+        media_watched = true;
     }
-    resizeterm(row, col);
+}
 
-    touchwin(stdscr);
-    wnoutrefresh(stdscr);
+/* sleep until a key, a signal, a device event or the next deadline */
+static void loop_wait()
+{
+    struct epoll_event events[LOOP_EVENTS_MAX];
+    struct signalfd_siginfo info;
+    struct itimerspec timer;
+    uint64_t expirations;
+    int ms = loop_timeout();
+    int count;
+    int i;
 
-    draw_top();
-    draw_menu(true);
-    draw_control(true);
-    draw_help();
+    /* an all zero value disarms the timer, an expired deadline is one ns away */
+    memset(&timer, 0, sizeof(timer));
+    if (ms >= 0)
+    {
+        timer.it_value.tv_sec = ms / 1000;
+        timer.it_value.tv_nsec = (ms % 1000) * 1000000L + 1;
+    }
+    timerfd_settime(loop_timer_fd, 0, &timer, NULL);
 
-    doupdate();
+    count = epoll_wait(loop_epoll_fd, events, LOOP_EVENTS_MAX, -1);
+    for (i = 0; i < count; i++)
+    {
+        if (events[i].data.fd == loop_signal_fd)
+        {
+            while (read(loop_signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                if (info.ssi_signo == SIGWINCH)
+                {
+                    loop_resize = true;
+                }
+                else
+                {
+                    term(info.ssi_signo);
+                }
+            }
+        }
+        else if (events[i].data.fd == loop_timer_fd)
+        {
+            while (read(loop_timer_fd, &expirations, sizeof(expirations)) > 0)
+            {
+            }
+        }
+        else if (events[i].data.fd == loop_device_fd && (events[i].events & (EPOLLERR | EPOLLHUP)))
+        {
+            device_check_us = 0;
+            loop_device_hangup = true;
+        }
+        else if (events[i].data.fd != STDIN_FILENO && (events[i].events & (EPOLLERR | EPOLLHUP)))
+        {
+            /* a sub-device went away, its controls just fail from now on */
+            epoll_ctl(loop_epoll_fd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+        }
+    }
+}
+
+static void control_class_select(int index)
+{
+    search_len = 0;
+    search_query[0] = '\0';
+    search_typing = false;
+
+    ctrl_classes[active_class].cursor = active_control;
+    active_class = (index + class_count) % class_count;
+
+    v4l2_get_class_controls(&ctrl_classes[active_class]);
+
+    view_last = 0;
+    last_offset = 0;
+    active_control = ctrl_classes[active_class].cursor;
+    control_view_update();
+}
+
+/* all tabs are searched, so all classes are read first */
+static void search_begin()
+{
+    control_enumerate_all();
+    search_typing = true;
+    search_update();
+    control_view_update();
+}
+
+/* the tab of the selected control is shown after the search */
+static void search_end()
+{
+    struct control_mapping *cm = control_active();
+    int i;
+
+    search_len = 0;
+    search_query[0] = '\0';
+    search_typing = false;
+    for (i = 0; i < class_count; i++)
+    {
+        if (ctrl_classes[i].id == cm->ctrl_class && ctrl_classes[i].source == cm->source)
+        {
+            active_class = i;
+        }
+    }
+    last_offset = 0;
+    control_view_update();
+}
+
+/* keys typed while searching, false for keys that keep their usual function */
+static bool search_key(int c)
+{
+    if (c == KEY_BACKSPACE || c == 127 || c == 8)
+    {
+        if (search_len)
+        {
+            search_query[--search_len] = '\0';
+        }
+    }
+    else if (c == '\n' || c == KEY_ENTER)
+    {
+        if (!search_len)
+        {
+            search_end();
+            return true;
+        }
+        search_typing = false;
+        return true;
+    }
+    else if (c == 27)
+    {
+        search_end();
+        return true;
+    }
+    else if (c < 256 && isprint(c))
+    {
+        if (search_len < SEARCH_QUERY_MAX)
+        {
+            search_query[search_len++] = tolower(c);
+            search_query[search_len] = '\0';
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    search_update();
+    control_view_update();
+    return true;
 }
 
 static void update_controls()
 {
     struct v4l2_control control;
+    int updated = 0;
+    int failed = 0;
     int i;
 
+    TRACE1(update_controls_entry, ctrl_last);
+
     memset(&control, 0, sizeof(struct v4l2_control));
 
     for (i = 0; i < ctrl_last; i++)
     {
+        if (ctrl_mapping[i].entry_type != V4L2_CONTROL)
+        {
+            continue;
+        }
         control.id = ctrl_mapping[i].id;
-        if (ioctl(v4l2_dev_fd, VIDIOC_G_CTRL, &control) == 0)
+        if (v4l2_ioctl(control_fd(&ctrl_mapping[i]), VIDIOC_G_CTRL, &control) == 0)
         {
             ctrl_mapping[i].value = control.value;
+            updated++;
+        }
+        else
+        {
+            failed++;
         }
     }
+
+    TRACE2(update_controls_return, updated, failed);
 }
 
-static void win_watch(int sigNo)
+/* defaults of stream parameters first, then the controls in planned order */
+static void control_reset()
 {
-    struct winsize termSize;
-    if (sigNo == SIGWINCH)
+    struct v4l2_ext_control *items = calloc(ctrl_last + 1, sizeof(struct v4l2_ext_control));
+    struct control_mapping *cm;
+    int old_value;
+    int count = 0;
+    int i;
+
+    if (items == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < ctrl_last; i++)
     {
-        if (isatty(STDIN_FILENO) &&
-            ioctl(STDIN_FILENO, TIOCGWINSZ, (char *)&termSize) >= 0)
+        cm = &ctrl_mapping[i];
+        if (cm->unsupported)
         {
-            draw_ui((int)termSize.ws_row, (int)termSize.ws_col);
+            continue;
+        }
+        if (cm->entry_type == V4L2_CONTROL)
+        {
+            count = batch_add(items, count, cm->id, cm->default_value);
+            continue;
         }
+        old_value = cm->value;
+        cm->value = cm->default_value;
+        control_apply(cm, old_value, JOURNAL_RESET);
     }
+
+    apply_plan(v4l2_dev_fd, items, count);
+    for (i = 0; i < count; i++)
+    {
+        cm = control_by_id(items[i].id);
+        old_value = cm->value;
+        cm->value = items[i].value;
+        control_apply(cm, old_value, JOURNAL_RESET);
+    }
+    free(items);
 }
 
-static void init_win_watch()
+/*
+ * One slice of the startup: the controls of the shown tab first, then the
+ * other tabs, the stream parameters and the sub-devices read by their
+ * threads in the meantime. Returns true when the screen needs a redraw.
+ */
+static bool startup_step()
 {
-    struct winsize termSize;
-    struct sigaction newSigAction;
-    struct sigaction oldSigAction;
+    struct control_class *cc = NULL;
+    int last = ctrl_last;
+    int i;
 
-    if (isatty(STDIN_FILENO) &&
-        ioctl(STDIN_FILENO, TIOCGWINSZ, (char *)&termSize) >= 0)
+    if (device_lost)
+    {
+        return false;
+    }
+
+    switch (startup_stage)
+    {
+    case STARTUP_CONTROLS:
+        if (!ctrl_classes[active_class].enumerated)
+        {
+            cc = &ctrl_classes[active_class];
+        }
+        for (i = 0; i < class_count && !cc; i++)
+        {
+            if (!ctrl_classes[i].enumerated)
+            {
+                cc = &ctrl_classes[i];
+            }
+        }
+        if (cc)
+        {
+            v4l2_get_class_slice(cc, monotonic_us() + STARTUP_SLICE_US);
+        }
+        else
+        {
+            startup_stage = STARTUP_STREAM;
+        }
+        break;
+
+    case STARTUP_STREAM:
+        v4l2_init_format();
+        v4l2_init_fps();
+        startup_stage = STARTUP_MEDIA;
+        break;
+
+    case STARTUP_MEDIA:
+        if (media_busy())
+        {
+            return false;
+        }
+        media_add_controls();
+        if (depend_arg_count)
+        {
+            depend_resolve();
+        }
+        startup_stage = STARTUP_DEPEND;
+        break;
+
+    case STARTUP_DEPEND:
+        startup_stage = STARTUP_DONE;
+        startup_done_us = monotonic_us();
+        break;
+
+    case STARTUP_DONE:
+        return false;
+    }
+
+    if (ctrl_last != last)
+    {
+        control_view_update();
+    }
+
+    mvprintw(0, 20, "%*s", 60, " ");
+    if (startup_stage == STARTUP_DONE)
+    {
+        mvprintw(0, 20, "%d controls after %.1f ms, first paint after %.1f ms", ctrl_last,
+                 (startup_done_us - startup_begin_us) / 1000.0, (startup_paint_us - startup_begin_us) / 1000.0);
+    }
+    else
     {
-        memset(&newSigAction.sa_mask, 0, sizeof(newSigAction.sa_mask));
-        newSigAction.sa_flags = 0;
-        newSigAction.sa_handler = win_watch;
-        sigaction(SIGWINCH, &newSigAction, &oldSigAction);
+        mvprintw(0, 20, "Reading controls: %d", ctrl_last);
     }
+    wnoutrefresh(stdscr);
+    return true;
 }
 
 static int init()
@@ -1100,11 +8979,17 @@ static int init()
     struct winsize termSize;
     int prev_active_control;
     int prev_value;
+    int cm_index;
     bool redraw;
+    bool loaded;
+    bool keys_pending = false;
     bool quit = false;
+    int ret = 0;
     int c;
     int i;
 
+    startup_begin_us = monotonic_us();
+
     if (v4l2_open(v4l2_devname) < 0)
     {
         return 1;
@@ -1112,11 +8997,36 @@ static int init()
 
     v4l2_format_info();
 
-    v4l2_get_controls();
-    v4l2_init_fps();
+    v4l2_enum_classes();
+    if (media_open() < 0)
+    {
+        ret = 1;
+        goto end;
+    }
 
     if (list_controls)
     {
+        control_enumerate_all();
+        goto end;
+    }
+
+    if (loop_open() < 0 || (journal_file && journal_open() < 0) || (shm_name && shm_create() < 0))
+    {
+        ret = 1;
+        goto end;
+    }
+
+    for (i = 1; i <= sync_count; i++)
+    {
+        if (sync_open(&sync_devices[i]) < 0)
+        {
+            ret = 1;
+            goto end;
+        }
+    }
+    if (sync_count && sync_start_threads() < 0)
+    {
+        ret = 1;
         goto end;
     }
 
@@ -1131,22 +9041,88 @@ static int init()
     {
         draw_ui(24, 80);
     }
-
-    init_win_watch();
+    startup_paint_us = monotonic_us();
 
     keypad(stdscr, TRUE);
+    nodelay(stdscr, TRUE);
+    if (input_pad)
+    {
+        keypad(input_pad, TRUE);
+        nodelay(input_pad, TRUE);
+    }
+
+    if (scene_band_count || focus_enabled || health_enabled || request_enabled)
+    {
+        if (capture_start() < 0)
+        {
+            mvprintw(0, 20, "Scene capture is not available");
+            ui_refresh();
+        }
+    }
 
-    while (!quit)
+    poll_started_us = monotonic_us();
+
+    while (!quit && !terminate)
     {
-        c = getch();
+        /* keys already buffered by ncurses do not wake epoll */
+        loop_update();
+        if (!keys_pending)
+        {
+            loop_wait();
+        }
+        if (loop_resize)
+        {
+            loop_resize = false;
+            if (isatty(STDIN_FILENO) &&
+                ioctl(STDIN_FILENO, TIOCGWINSZ, (char *)&termSize) >= 0)
+            {
+                draw_ui((int)termSize.ws_row, (int)termSize.ws_col);
+            }
+        }
+
+        c = input_pad ? wgetch(input_pad) : getch();
+        keys_pending = c != ERR;
+        ui_keys += keys_pending && c != KEY_RESIZE;
+        undo_step_open = false;
+
+        redraw = capture_active && scene_poll();
+        if (!keys_pending && startup_step())
+        {
+            redraw = true;
+        }
+        if (device_check())
+        {
+            redraw = true;
+        }
+        if (poll_enabled && !device_lost)
+        {
+            control_events_process();
+            control_poll();
+        }
+
+        if (search_typing && c != ERR && search_key(c))
+        {
+            c = ERR;
+            redraw = true;
+        }
+        else if (c == 27 && search_len)
+        {
+            search_end();
+            c = ERR;
+            redraw = true;
+        }
 
-        cm = &ctrl_mapping[active_control];
+        cm = control_active();
+        cm_index = view_last ? cm - ctrl_mapping : -1;
         prev_value = cm->value;
         prev_active_control = active_control;
-        redraw = false;
+        loaded = false;
 
         switch (c)
         {
+        case ERR:
+            break;
+
         case KEY_UP:
             active_control -= 1;
             break;
@@ -1176,56 +9152,76 @@ static int init()
             break;
 
         case 360: // END
-            active_control = ctrl_last - 1;
+            active_control = view_last - 1;
             break;
 
         case '1':
             load_preset(0);
+            loaded = true;
             redraw = true;
             break;
 
         case '2':
             load_preset(1);
+            loaded = true;
             redraw = true;
             break;
 
         case '3':
             load_preset(2);
+            loaded = true;
             redraw = true;
             break;
 
         case '4':
             load_preset(3);
+            loaded = true;
             redraw = true;
             break;
 
         case '5':
             load_preset(4);
+            loaded = true;
             redraw = true;
             break;
 
         case '6':
             load_preset(5);
+            loaded = true;
             redraw = true;
             break;
 
         case '7':
             load_preset(6);
+            loaded = true;
             redraw = true;
             break;
 
         case '8':
             load_preset(7);
+            loaded = true;
             redraw = true;
             break;
 
         case '9':
             load_preset(8);
+            loaded = true;
             redraw = true;
             break;
 
         case 9:
             load_next_preset();
+            loaded = true;
+            redraw = true;
+            break;
+
+        case '[':
+            control_class_select(active_class - 1);
+            redraw = true;
+            break;
+
+        case ']':
+            control_class_select(active_class + 1);
             redraw = true;
             break;
 
@@ -1246,11 +9242,9 @@ static int init()
 
         case 'R':
         case 'r':
-            for (i = 0; i < ctrl_last; i++)
-            {
-                ctrl_mapping[i].value = ctrl_mapping[i].default_value;
-                v4l2_apply_control(&ctrl_mapping[i]);
-            }
+            control_enumerate_all();
+            control_reset();
+            loaded = true;
             redraw = true;
             break;
 
@@ -1259,7 +9253,8 @@ static int init()
             mvprintw(0, 20, "%*s", 58, " ");
             if (!DEBUG)
             {
-                control_load("Config", config_file);
+                control_load("Config", config_file, JOURNAL_CONFIG);
+                loaded = true;
                 redraw = true;
             }
             break;
@@ -1278,27 +9273,80 @@ static int init()
             quit = true;
             break;
 
+        case 'Z':
+        case 'z':
+            snapshot_undo();
+            loaded = true;
+            redraw = true;
+            break;
+
+        case 'Y':
+        case 'y':
+            snapshot_redo();
+            loaded = true;
+            redraw = true;
+            break;
+
+        case 'A':
+        case 'a':
+            snapshot_store(0);
+            break;
+
+        case 'B':
+        case 'b':
+            snapshot_store(1);
+            break;
+
+        case 'T':
+        case 't':
+            snapshot_toggle();
+            loaded = true;
+            redraw = true;
+            break;
+
         case 'U':
         case 'u':
             update_controls();
             redraw = true;
             break;
 
+        case '/':
+            search_begin();
+            redraw = true;
+            break;
+
+        case 'F':
+        case 'f':
+            if (focus_enabled)
+            {
+                focus_sweep_start();
+                redraw = true;
+            }
+            break;
+
+        case 12: /* Ctrl-L */
+            clearok(curscr, TRUE);
+            layout_changed = true;
+            break;
+
         default:
             if (DEBUG)
             {
                 mvprintw(0, 0, "Character %3d '%c'", c, c);
-                refresh();
+                ui_refresh();
             }
             break;
         }
 
+        /* tabs, search and presets may have enumerated more controls and moved ctrl_mapping */
+        cm = cm_index >= 0 ? &ctrl_mapping[cm_index] : control_active();
         cm->value = clamp(cm->value, cm->minimum, cm->maximum);
-        active_control = clamp(active_control, 0, ctrl_last - 1);
+        active_control = clamp(active_control, 0, view_last - 1);
 
-        if (prev_value != cm->value)
+        /* presets, config, reset and snapshots have applied the active control already */
+        if (prev_value != cm->value && !loaded)
         {
-            v4l2_apply_control(cm);
+            control_apply(cm, prev_value, JOURNAL_KEY);
             redraw = true;
         }
 
@@ -1307,19 +9355,49 @@ static int init()
             redraw = true;
         }
 
-        if (redraw)
+        if (layout_changed)
+        {
+            layout_changed = false;
+            draw_ui(LINES, COLS);
+        }
+        else if (redraw)
         {
             draw_control(false);
             draw_menu(false);
+            ui_update();
+        }
+        else if (bandwidth_rate)
+        {
+            /* status text, deferred updates */
+            ui_update();
         }
+
+        shm_publish();
     }
 
     ui_uninit();
+    if (bandwidth_rate)
+    {
+        printf("INFO: %llu bytes of screen updates for %llu keys\n", ui_bytes, ui_keys);
+    }
+    printf("INFO: First paint after %.1f ms", (startup_paint_us - startup_begin_us) / 1000.0);
+    if (startup_done_us)
+    {
+        printf(", %d controls after %.1f ms", ctrl_last, (startup_done_us - startup_begin_us) / 1000.0);
+    }
+    printf("\n");
+    capture_stop();
+    journal_close();
+    snapshot_free_all();
 
 end:
+    media_wait();
+    shm_close();
+    sync_close();
+    loop_close();
     v4l2_close();
     control_free();
-    return 0;
+    return ret;
 }
 
 static void usage(const char *argv0)
@@ -1327,21 +9405,42 @@ static void usage(const char *argv0)
     fprintf(stderr, "Usage: %s [options]\n", argv0);
     fprintf(stderr, "Available options are\n");
     fprintf(stderr, " -a                    Load preset files in alphabetical order\n");
+    fprintf(stderr, " -A preset:luma,...    Select preset automatically by scene mean luma\n");
+    fprintf(stderr, " -b rate               Low bandwidth screen updates, at most rate bytes per second\n");
     fprintf(stderr, " -c file               Path to config file\n");
     fprintf(stderr, " -d                    Disable unsupported controls\n");
-    fprintf(stderr, " -f fps                Maximum FPS value (b/w 1 and 120, default: 30)\n");
+    fprintf(stderr, " -D master:dependent   Write control master before its dependent, e.g. an automatic mode\n");
+    fprintf(stderr, " -f fps                Maximum FPS for devices without discrete frame intervals (b/w 1 and 120, default: 30)\n");
+    fprintf(stderr, " -F                    Focus assist, show the sharpness of frames and sweep focus with F\n");
+    fprintf(stderr, " -g WxH[:fourcc]       Geometry and format of raw frame file (default: YUYV)\n");
+    fprintf(stderr, " -G file               Media pipeline topology from file instead of the media device\n");
     fprintf(stderr, " -h                    Print this help screen and exit\n");
+    fprintf(stderr, " -H luma               Hysteresis of automatic preset selection (default: 8)\n");
     fprintf(stderr, " -i control_variable   Ignore control with defined name\n");
+    fprintf(stderr, " -j file               Record control changes to journal file\n");
+    fprintf(stderr, " -J file               Replay journal file to the device and exit\n");
     fprintf(stderr, " -l                    List available controls\n");
+    fprintf(stderr, " -L                    Scan all nodes like the -v device, print JSON lines and exit\n");
+    fprintf(stderr, " -m device             Apply presets to this device too, synchronised (up to %d)\n", SYNC_DEVICES_MAX);
+    fprintf(stderr, " -N file               Answer device ioctls from fixture file instead of the device\n");
     fprintf(stderr, " -p path               Path to directory with preset files\n");
+    fprintf(stderr, " -P                    Follow control changes made by the device (events or polling)\n");
+    fprintf(stderr, " -Q                    Queue control changes in media requests with frames, show the frame they land on\n");
+    fprintf(stderr, " -r file               Analyse scene (or sharpness with -F) in raw frame file instead of camera\n");
+    fprintf(stderr, " -R file               Record device ioctls with their latency to fixture file\n");
+    fprintf(stderr, " -s name               Publish control values in shared memory /dev/shm/name\n");
+    fprintf(stderr, " -S                    Show measured FPS, frame interval jitter and dropped frames of the stream\n");
+    fprintf(stderr, " -t                    Keep the recorded latency of ioctls answered from a fixture\n");
     fprintf(stderr, " -v device             V4L2 Video Capture device\n");
+    fprintf(stderr, " -X                    Replay journal as fast as possible\n");
 }
 
 int main(int argc, char *argv[])
 {
     int opt;
+    int ret;
 
-    while ((opt = getopt(argc, argv, "ac:df:hi:lp:v:")) != -1)
+    while ((opt = getopt(argc, argv, "aA:b:c:dD:f:Fg:G:hH:i:j:J:lLm:N:p:PQr:R:s:Stv:X")) != -1)
     {
         switch (opt)
         {
@@ -1349,6 +9448,28 @@ int main(int argc, char *argv[])
             preset_alpabetically = true;
             break;
 
+        case 'A':
+            if (!scene_parse_bands(optarg))
+            {
+                printf("ERROR: Invalid scene thresholds '%s'\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'b':
+            if (atoi(optarg) >= 100)
+            {
+                bandwidth_rate = atoi(optarg);
+                bandwidth_tokens = bandwidth_rate;
+                bandwidth_us = monotonic_us();
+            }
+            else
+            {
+                printf("ERROR: Invalid output rate '%s', at least 100 bytes per second\n", optarg);
+                return 1;
+            }
+            break;
+
         case 'c':
             config_file = optarg;
             break;
@@ -1357,6 +9478,16 @@ int main(int argc, char *argv[])
             disable_unsupported_controls = true;
             break;
 
+        case 'D':
+            if (depend_arg_count == DEPEND_PAIRS_MAX || strchr(optarg, ':') == NULL ||
+                strchr(optarg, ':') == optarg || !strchr(optarg, ':')[1])
+            {
+                printf("ERROR: Invalid dependency '%s'\n", optarg);
+                return 1;
+            }
+            depend_args[depend_arg_count++] = optarg;
+            break;
+
         case 'f':
             if (atoi(optarg) > 0 && atoi(optarg) < 121)
             {
@@ -1369,10 +9500,38 @@ int main(int argc, char *argv[])
             }
             break;
 
+        case 'F':
+            focus_enabled = true;
+            break;
+
+        case 'g':
+            if (!capture_parse_geometry(optarg))
+            {
+                printf("ERROR: Invalid raw frame geometry '%s'\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'G':
+            media_topology_file = optarg;
+            break;
+
         case 'h':
             usage(argv[0]);
             return 1;
 
+        case 'H':
+            if (atoi(optarg) >= 0 && atoi(optarg) < 128)
+            {
+                scene_hysteresis = atoi(optarg);
+            }
+            else
+            {
+                printf("ERROR: Invalid hysteresis '%s'\n", optarg);
+                return 1;
+            }
+            break;
+
         case 'i':
             if (last_ignored_variable < 49)
             {
@@ -1382,25 +9541,118 @@ int main(int argc, char *argv[])
             }
             break;
 
+        case 'j':
+            journal_file = optarg;
+            break;
+
+        case 'J':
+            journal_replay_file = optarg;
+            break;
+
         case 'l':
             list_controls = true;
             break;
 
+        case 'L':
+            scan_enabled = true;
+            break;
+
+        case 'm':
+            if (sync_count == SYNC_DEVICES_MAX)
+            {
+                printf("ERROR: More than %d synchronised devices\n", SYNC_DEVICES_MAX);
+                return 1;
+            }
+            sync_count++;
+            sync_devices[sync_count].devname = optarg;
+            sync_devices[sync_count].fd = -1;
+            break;
+
+        case 'N':
+            fixture_replay_file = optarg;
+            break;
+
         case 'p':
             presets_path = optarg;
             break;
 
+        case 'P':
+            poll_enabled = true;
+            break;
+
+        case 'Q':
+            request_enabled = true;
+            break;
+
+        case 'r':
+            raw_file = optarg;
+            break;
+
+        case 'R':
+            fixture_record_file = optarg;
+            break;
+
+        case 's':
+            if (!optarg[0] || strlen(optarg) > CAMERA_CTL_SHM_NAME_MAX || strchr(optarg, '/'))
+            {
+                printf("ERROR: Invalid shared memory name '%s'\n", optarg);
+                return 1;
+            }
+            shm_name = optarg;
+            break;
+
+        case 'S':
+            health_enabled = true;
+            break;
+
+        case 't':
+            fixture_timed = true;
+            break;
+
         case 'v':
             v4l2_devname = optarg;
             break;
 
+        case 'X':
+            journal_fast = true;
+            break;
+
         default:
             printf("ERROR: Invalid option '-%c'\n", opt);
             goto err;
         }
     }
 
-    return init();
+    if (raw_file)
+    {
+        return focus_enabled ? focus_replay() : scene_replay();
+    }
+
+    if (fixture_record_file && fixture_replay_file)
+    {
+        printf("ERROR: -R and -N cannot be combined\n");
+        return 1;
+    }
+    if ((fixture_record_file || fixture_replay_file) && fixture_open() < 0)
+    {
+        return 1;
+    }
+
+    if (journal_replay_file)
+    {
+        ret = journal_replay();
+    }
+    else if (scan_enabled)
+    {
+        ret = scan_nodes();
+    }
+    else
+    {
+        ret = init();
+    }
+
+    fixture_close();
+    return ret;
 
 err:
     usage(argv[0]);
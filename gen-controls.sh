@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+# Generate the table of known V4L2 controls from the kernel headers
+# the program is built against.
+#
+# usage: gen-controls.sh cc [cflags...] > camera-ctl-controls.h
+#
+# Every V4L2_CID_* id becomes one entry with its canonical variable name
+# (macro name without prefix, lower case), the codecs it applies to and
+# its unit where the V4L2 specification defines one.
+
+[ $# -gt 0 ] || set -- cc
+
+echo '#include <linux/videodev2.h>' | "$@" -E -dM -x c - | LC_ALL=C sort | awk '
+BEGIN {
+    unit["EXPOSURE_ABSOLUTE"] = "100us"
+    unit["WHITE_BALANCE_TEMPERATURE"] = "K"
+    unit["PAN_ABSOLUTE"] = "arcsec"
+    unit["PAN_RELATIVE"] = "arcsec"
+    unit["TILT_ABSOLUTE"] = "arcsec"
+    unit["TILT_RELATIVE"] = "arcsec"
+    unit["AUTO_EXPOSURE_BIAS"] = "mEV"
+    unit["ROTATE"] = "deg"
+    unit["CAMERA_SENSOR_ROTATION"] = "deg"
+    unit["FLASH_TIMEOUT"] = "us"
+    unit["FLASH_INTENSITY"] = "mA"
+    unit["FLASH_TORCH_INTENSITY"] = "mA"
+    unit["FLASH_INDICATOR_INTENSITY"] = "uA"
+    unit["MPEG_VIDEO_BITRATE"] = "bps"
+    unit["MPEG_VIDEO_BITRATE_PEAK"] = "bps"
+    unit["MPEG_VIDEO_GOP_SIZE"] = "frames"
+    unit["MPEG_VIDEO_H264_I_PERIOD"] = "frames"
+    unit["MPEG_VIDEO_H264_CPB_SIZE"] = "kB"
+    unit["MPEG_VIDEO_VBV_SIZE"] = "kB"
+
+    codec["H264"] = "CODEC_H264"
+    codec["H263"] = "CODEC_H263"
+    codec["MPEG2"] = "CODEC_MPEG2"
+    codec["MPEG4"] = "CODEC_MPEG4"
+    codec["HEVC"] = "CODEC_HEVC"
+    codec["VP8"] = "CODEC_VP8"
+    codec["VP9"] = "CODEC_VP9"
+    codec["VPX"] = "CODEC_VP8 | CODEC_VP9"
+    codec["FWHT"] = "CODEC_FWHT"
+
+    print "/* generated by gen-controls.sh from <linux/videodev2.h>, do not edit */"
+    print ""
+    print "static const struct control_info control_table[] = {"
+}
+
+$1 == "#define" && $2 ~ /^V4L2_CID_[A-Z0-9_]+$/ {
+    name = substr($2, 10)
+
+    # class ids, id ranges and plain aliases of other controls
+    if (name ~ /(^|_)(BASE|CLASS)$/ || name ~ /^(LASTP1|MAX_CTRLS)$/ ||
+        (NF == 3 && $3 ~ /^\(?V4L2_CID_[A-Z0-9_]+\)?$/))
+        next
+
+    codecs = ""
+    n = split(name, token, "_")
+    for (i = 1; i <= n; i++)
+    {
+        if (token[i] in codec && index(codecs, codec[token[i]]) == 0)
+            codecs = codecs == "" ? codec[token[i]] : codecs " | " codec[token[i]]
+    }
+
+    printf "    {V4L2_CID_%s, \"%s\", %s, %s},\n", name, tolower(name),
+           codecs == "" ? "0" : codecs, name in unit ? "\"" unit[name] "\"" : "NULL"
+}
+
+END {
+    print "};"
+}
+'